@@ -1,11 +1,17 @@
 #pragma once
 #include "structs.hpp"
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
 
 struct aiMaterial;
+struct aiString;
 struct aiScene;
 
 namespace TDModelView 
 {
+	class ModelLoader;
+
 	class ASSIMPreader
 	{
 	public:
@@ -13,19 +19,46 @@ namespace TDModelView
 		std::string extension = "";
 		std::string filepath = "";
 		unsigned int flags = 0;
+		bool compactVertices = false;// upload meshes in the PackedVertex layout
+		bool keepGeometry = false;// keep a mapped CPU copy of the meshes (see GeometryStore)
+		bool optimizeMeshes = false;// reorder indices/vertices for the GPU caches after import (see MeshOptimizer)
+		bool reduceOverdraw = false;
+		bool splitLargeMeshes = false;// split meshes too big for 16-bit indices
+		bool preserveInstances = false;// keep node transforms instead of pre-transforming, drawing shared meshes instanced
+		bool generateLODs = false;// build simplified levels of detail for each mesh (see Simplifier)
+		bool buildMeshlets = false;// split each mesh's triangles into separately culled clusters (see Meshlets)
+		Arena arena;// backs imported mesh arrays until they're uploaded; declared before 'scene' so it outlives it
 		aiScene* aiscene = nullptr;
 		std::shared_ptr<Scene> scene = nullptr;
-		ASSIMPreader(std::string filepath);
+		std::vector<std::shared_ptr<Texture>> retained_textures;// keeps the previous model's textures alive for reuse until this load finishes
+		ASSIMPreader(std::string filepath, ModelLoader* loader);
 		~ASSIMPreader();
+		bool Import();// Runs the whole import. Called on the loader's background thread.
 	private:
-		std::unordered_multimap<int,std::shared_ptr<Mesh>> mesh_load_data;
+		std::vector<std::shared_ptr<Mesh>> mesh_load_data;// one slot per aiMesh, written only by that mesh's import task
+		std::vector<std::future<void>> mesh_tasks;
+		std::vector<std::shared_ptr<Texture>> texture_load_data;// texture being decoded by the matching entry in texture_tasks
+		std::vector<std::future<bool>> texture_tasks;
+		std::atomic<unsigned int> meshes_done{ 0 };
+		unsigned int meshes_requested = 0;// meshes being converted, which excludes those no node references
+		std::atomic<unsigned int> textures_done{ 0 };
+		std::atomic<unsigned int> textures_requested{ 0 };
+		ModelLoader* loader = nullptr;
 		std::vector<Texture> embedded_textures;
+		std::unordered_map<std::string, std::shared_ptr<Texture>> texture_cache;
+		std::shared_ptr<Texture> GetTexture(std::string fpath);
+		bool GetMaterialTexturePath(aiMaterial* mMaterial, aiTextureType& texType, aiString& texPath);
 		std::shared_ptr<Material> ImportMaterial(aiMaterial* mMaterial);
 		void ImportMaterialTextures(aiMaterial* mMaterial, std::shared_ptr<Material> material);
 		void ImportMaterials();
 		void ImportMeshes();
-		void ImportScene();
+		bool ImportScene();
 		void ImportTextures();
+		void OptimizeMeshes();
+		void SplitLargeMeshes();
+		void GenerateLODs();
+		void BuildMeshlets();
 		void waitForMeshThreadsToFinish();
+		void waitForTextureThreadsToFinish();
 	};
 }
\ No newline at end of file
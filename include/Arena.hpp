@@ -0,0 +1,78 @@
+/**	Arena.hpp
+*
+*	Thread-safe bump allocator for short-lived bulk data. Memory is carved out of large blocks and only ever returned
+*	all at once when the arena is destroyed, so building many large arrays costs a handful of system allocations.
+*	ArenaAllocator lets std::vector draw from an arena; with no arena it falls back to the regular heap.
+*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace TDModelView
+{
+	class Arena
+	{
+	public:
+		static const size_t DEFAULT_BLOCK_SIZE = size_t(64) << 20;
+
+		Arena(size_t blockSize = DEFAULT_BLOCK_SIZE) : blockSize(blockSize) {}
+		Arena(const Arena&) = delete;
+		Arena& operator=(const Arena&) = delete;
+
+		void* allocate(size_t bytes, size_t alignment = alignof(std::max_align_t));
+
+		size_t bytesUsed() const { return used; }
+		size_t bytesReserved() const { return reserved; }
+		size_t numBlocks() const { return blocks.size(); }
+
+	private:
+		std::mutex mutex;
+		std::vector<std::unique_ptr<uint8_t[]>> blocks;
+		size_t blockSize;
+		uint8_t* head = nullptr;
+		size_t remaining = 0;
+		size_t used = 0;
+		size_t reserved = 0;
+	};
+
+	template<class T>
+	class ArenaAllocator
+	{
+	public:
+		typedef T value_type;
+		// Moving a vector in takes its allocator along, so assigning a default-constructed vector detaches from the arena.
+		typedef std::true_type propagate_on_container_move_assignment;
+
+		ArenaAllocator(Arena* arena = nullptr) : arena(arena) {}
+		template<class U>
+		ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+		T* allocate(size_t n)
+		{
+			if (arena)
+				return (T*)arena->allocate(n * sizeof(T), alignof(T));
+			return (T*)::operator new(n * sizeof(T));
+		}
+		void deallocate(T* p, size_t)
+		{
+			if (!arena)
+				::operator delete(p);
+		}
+
+		template<class U>
+		bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+		template<class U>
+		bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+
+		Arena* arena;
+	};
+
+	template<class T>
+	using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+}
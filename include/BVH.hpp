@@ -0,0 +1,56 @@
+/**	BVH.hpp
+*
+*	Bounding volume hierarchy over a set of axis-aligned boxes, built with binned SAH and flattened into a single node
+*	array (sibling nodes are stored next to each other). Used by the scene for frustum culling, picking and bounds
+*	queries without scanning every mesh.
+*/
+
+#pragma once
+#include "Frustum.hpp"
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace TDModelView
+{
+	class BVH
+	{
+	public:
+		struct Node
+		{
+			glm::vec3 bboxMin;
+			uint32_t leftFirst;// first item for leaves, index of the left child (right child follows it) otherwise
+			glm::vec3 bboxMax;
+			uint32_t count;// number of items; 0 for interior nodes
+			bool isLeaf() const { return count > 0; }
+		};
+
+		std::vector<Node> nodes;
+		std::vector<uint32_t> items;// leaf item ranges index into this
+
+		// Build over boxes [bboxMin[i], bboxMax[i]]. Item i in queries refers to box i.
+		void build(const std::vector<glm::vec3>& bboxMin, const std::vector<glm::vec3>& bboxMax);
+		void clear() { nodes.clear(); items.clear(); boxMin.clear(); boxMax.clear(); }
+		bool empty() const { return nodes.empty(); }
+		const Node& root() const { return nodes[0]; }
+
+		// Set visible[i] to 1 for every item whose box intersects the frustum, 0 otherwise. Returns the visible count.
+		unsigned int cull(const Frustum& frustum, std::vector<uint8_t>& visible) const;
+
+		// Index of the item with the nearest box hit by the ray, or -1. 'tHit' receives the entry distance.
+		int raycast(const glm::vec3& origin, const glm::vec3& dir, float& tHit) const;
+
+		// As above, but every item whose box is hit closer than the best hit so far is passed to 'intersectItem' with
+		// the box entry distance. It returns false on a miss, or true and the exact distance (>= the one passed in).
+		typedef std::function<bool(uint32_t item, float& t)> ItemTest;
+		int raycast(const glm::vec3& origin, const glm::vec3& dir, float& tHit, const ItemTest& intersectItem) const;
+
+	private:
+		static const int NUM_BINS = 12;
+		static const int MAX_LEAF_ITEMS = 4;
+		std::vector<glm::vec3> boxMin, boxMax, centroid;
+		void updateBounds(uint32_t n);
+		void subdivide(uint32_t n);
+	};
+}
@@ -0,0 +1,39 @@
+/**	Frustum.hpp
+*
+*	View frustum planes and a batched AABB-vs-frustum test. Boxes are stored as separate center/extent arrays so the
+*	test can run on four boxes at a time with SSE.
+*/
+
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+namespace TDModelView
+{
+	struct Frustum
+	{
+		glm::vec4 planes[6];// left, right, bottom, top, near, far; inside where dot(plane.xyz, p) + plane.w >= 0
+
+		// Gribb/Hartmann plane extraction from a combined view-projection matrix.
+		void extract(const glm::mat4& VP);
+	};
+
+	// Axis-aligned boxes in structure-of-arrays form.
+	struct BoxArray
+	{
+		std::vector<float> cx, cy, cz;// centers
+		std::vector<float> ex, ey, ez;// half extents
+
+		void clear();
+		void push(const glm::vec3& bboxMin, const glm::vec3& bboxMax);
+		void append(const BoxArray& other);
+		size_t size() const { return cx.size(); }
+	};
+
+	// Set visible[i] to 1 if box i intersects the frustum and 0 otherwise. Returns the number of visible boxes.
+	unsigned int cullBoxes(const Frustum& frustum, const BoxArray& boxes, uint8_t* visible);
+
+	// The same for boxes [first, first + count) only. Other entries of 'visible' are left alone.
+	unsigned int cullBoxes(const Frustum& frustum, const BoxArray& boxes, uint8_t* visible, size_t first, size_t count);
+}
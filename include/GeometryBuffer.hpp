@@ -0,0 +1,114 @@
+/**	GeometryBuffer.hpp
+*
+*	Scene-wide GPU storage for mesh geometry. All vertices of one vertex format share a single vertex buffer and VAO,
+*	and all indices share a single index buffer, so a mesh is just a pair of ranges drawn with
+*	glDrawElementsBaseVertex instead of owning buffer objects of its own. Per-instance transforms of instanced meshes
+*	live in a third shared buffer, read as a mat4 attribute (locations 5-8) at the draw's base instance. Freed ranges go
+*	back on a free list; live ranges are packed into a fresh buffer when a buffer has to grow, or when compact() finds
+*	too much of it unused.
+*/
+
+#pragma once
+#include <GL/glew.h>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace TDModelView
+{
+	enum class VertexFormat
+	{
+		FULL = 0,// Vertex
+		COMPACT,// PackedVertex
+		COUNT
+	};
+
+	// First-fit allocator over [0, capacity) in whatever unit the caller uses. Adjacent free ranges are merged.
+	class RangeAllocator
+	{
+	public:
+		static const uint64_t INVALID = ~uint64_t(0);
+
+		// Start over with 'capacity' units, of which the first 'used' are taken.
+		void reset(uint64_t capacity, uint64_t used = 0);
+		uint64_t allocate(uint64_t size);
+		void free(uint64_t offset, uint64_t size);
+		uint64_t capacity() const { return total; }
+		uint64_t used() const { return inUse; }
+
+	private:
+		std::map<uint64_t, uint64_t> freeRanges;// offset -> size
+		uint64_t total = 0;
+		uint64_t inUse = 0;
+	};
+
+	class GeometryBuffer
+	{
+	public:
+		struct Allocation
+		{
+			VertexFormat format = VertexFormat::FULL;
+			uint64_t firstVertex = 0;
+			uint64_t numVertices = 0;
+			uint64_t indexOffset = 0;// bytes
+			uint64_t indexBytes = 0;
+			uint64_t firstInstance = 0;
+			uint64_t numInstances = 0;
+			bool live = false;
+		};
+
+		GeometryBuffer() {}
+		~GeometryBuffer() { release(); }
+		GeometryBuffer(const GeometryBuffer&) = delete;
+		GeometryBuffer& operator=(const GeometryBuffer&) = delete;
+
+		// Copy one mesh's vertices, indices and instance transforms (column-major float4x4s, may be none) into the
+		// shared buffers. Returns the handle used to draw and free it. GL thread only, as are all other members.
+		int add(VertexFormat format, const void* vertices, uint64_t numVertices, const void* indices, uint64_t indexBytes,
+			const float* instances = nullptr, uint64_t numInstances = 0);
+		void free(int handle);
+
+		// Grow the buffers once ahead of a batch of add() calls instead of step by step as meshes arrive. 'indexBytes'
+		// is the batch total over all formats.
+		void reserve(VertexFormat format, uint64_t numVertices, uint64_t indexBytes);
+
+		// Pack live ranges into smaller buffers if more than half of a buffer is unused. Offsets of live handles
+		// change, so read them through allocation() at draw time rather than caching them.
+		void compact();
+
+		// Delete every buffer and VAO. Outstanding handles become invalid.
+		void release();
+
+		const Allocation& allocation(int handle) const { return allocations[handle]; }
+		GLuint vao(VertexFormat format) const { return pools[(int)format].VAO; }
+		size_t capacityBytes() const;
+		size_t usedBytes() const;
+		unsigned int compactions() const { return numCompactions; }
+		unsigned int revision() const { return layoutRevision; }// bumped whenever live ranges move
+
+	private:
+		struct VertexPool
+		{
+			GLuint VBO = 0;
+			GLuint VAO = 0;
+			RangeAllocator ranges;// in vertices
+		};
+
+		VertexPool pools[(int)VertexFormat::COUNT];
+		GLuint EBO = 0;
+		RangeAllocator indexRanges;// in 4 byte words, so 32-bit indices stay aligned
+		GLuint instanceBuffer = 0;
+		RangeAllocator instanceRanges;// in transforms
+		std::vector<Allocation> allocations;
+		std::vector<int> freeHandles;
+		unsigned int liveCount = 0;
+		unsigned int numCompactions = 0;
+		unsigned int layoutRevision = 0;
+
+		void createVAO(VertexFormat format);
+		void resizeVertices(VertexFormat format, uint64_t capacity);
+		void resizeIndices(uint64_t capacity);
+		void resizeInstances(uint64_t capacity);
+	};
+}
@@ -0,0 +1,57 @@
+/**	GeometryStore.hpp
+*
+*	Keeps a model's CPU-side vertex and index arrays in a scratch file that is memory-mapped once the import is done,
+*	so picking and other geometry queries can read them after the GPU upload without holding a second copy in RAM.
+*	Pages are brought in by the OS on first touch and can be dropped again under memory pressure.
+*/
+
+#pragma once
+#include "MappedFile.hpp"
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace TDModelView
+{
+	struct Vertex;
+
+	class GeometryStore
+	{
+	public:
+		struct Range
+		{
+			uint64_t vertexOffset = 0;
+			uint64_t indexOffset = 0;
+			uint32_t numVertices = 0;
+			uint32_t numIndices = 0;
+		};
+
+		// Create a store backed by a new file in the system temp directory. 'name' only makes the file recognizable.
+		GeometryStore(const std::string& name);
+		~GeometryStore();
+		GeometryStore(const GeometryStore&) = delete;
+		GeometryStore& operator=(const GeometryStore&) = delete;
+
+		// Append one mesh's arrays and return its id, or -1 on a write error. Only valid before finalize().
+		int add(const Vertex* vertices, size_t numVertices, const uint32_t* indices, size_t numIndices);
+
+		// Close the file for writing and map it. Returns false if nothing can be read back.
+		bool finalize();
+
+		bool isMapped() const { return file.isOpen(); }
+		const Range& range(int id) const { return ranges[id]; }
+		const Vertex* vertices(int id) const { return (const Vertex*)(file.data() + ranges[id].vertexOffset); }
+		const uint32_t* indices(int id) const { return (const uint32_t*)(file.data() + ranges[id].indexOffset); }
+		size_t size() const { return file.size(); }
+		size_t residentBytes() const { return file.residentBytes(); }
+
+	private:
+		std::string filepath = "";
+		std::ofstream out;
+		uint64_t offset = 0;
+		std::vector<Range> ranges;
+		MappedFile file;
+		void writeAligned(const void* data, uint64_t size);
+	};
+}
@@ -0,0 +1,66 @@
+/**	GpuProfiler.hpp
+*
+*	GPU time of named parts of a frame, from timestamp queries. Results are collected a few frames later, once the GPU
+*	has caught up, so measuring never waits on the pipeline. Sections may nest.
+*/
+
+#pragma once
+#include <GL/glew.h>
+#include <string>
+#include <vector>
+
+namespace TDModelView
+{
+	class GpuProfiler
+	{
+	public:
+		struct Section
+		{
+			std::string name;
+			float milliseconds = 0.0f;// smoothed over recent frames
+		};
+
+		GpuProfiler() {}
+		~GpuProfiler() { release(); }
+		GpuProfiler(const GpuProfiler&) = delete;
+		GpuProfiler& operator=(const GpuProfiler&) = delete;
+
+		// Start a frame, picking up the oldest frame's timings if the GPU has finished it. GL thread only.
+		void beginFrame();
+		// Bracket a section. Every begin() needs a matching end() before endFrame().
+		void begin(const std::string& name);
+		void end();
+		void endFrame();
+
+		// Every section seen so far, in order of first use.
+		const std::vector<Section>& sections() const { return results; }
+
+		// Delete the query objects.
+		void release();
+
+	private:
+		static const int FRAMES_IN_FLIGHT = 4;
+		struct Marker
+		{
+			int section;
+			GLuint start;
+			GLuint stop;
+		};
+		struct Frame
+		{
+			std::vector<GLuint> queries;// reused from frame to frame
+			size_t used = 0;
+			std::vector<Marker> markers;
+			GLuint last = 0;// latest timestamp written
+			bool pending = false;
+		};
+		Frame frames[FRAMES_IN_FLIGHT];
+		int current = 0;
+		std::vector<int> open;// marker indices of sections begun but not ended
+		std::vector<Section> results;
+		std::vector<bool> measured;// results[i] has had a sample
+
+		GLuint nextQuery(Frame& f);
+		void collect(Frame& f);
+	};
+}
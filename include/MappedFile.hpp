@@ -0,0 +1,142 @@
+/**	MappedFile.hpp
+*
+*	Minimal read-only memory mapping of a whole file, used for cache and geometry files that are read in place.
+*/
+
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <Windows.h>
+#include <Psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace TDModelView
+{
+	class MappedFile
+	{
+	public:
+		MappedFile() {}
+		MappedFile(const std::string& path) { open(path); }
+		~MappedFile() { close(); }
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool open(const std::string& path)
+		{
+			close();
+#ifdef _WIN32
+			fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (fileHandle == INVALID_HANDLE_VALUE)
+				return false;
+			LARGE_INTEGER sz;
+			if (!GetFileSizeEx(fileHandle, &sz) || sz.QuadPart == 0) {
+				close();
+				return false;
+			}
+			mapSize = (size_t)sz.QuadPart;
+			mapHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapHandle == NULL) {
+				close();
+				return false;
+			}
+			mapData = (const uint8_t*)MapViewOfFile(mapHandle, FILE_MAP_READ, 0, 0, 0);
+#else
+			fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+				return false;
+			struct stat st;
+			if (fstat(fd, &st) != 0 || st.st_size == 0) {
+				close();
+				return false;
+			}
+			mapSize = (size_t)st.st_size;
+			void* p = mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+			mapData = (p == MAP_FAILED) ? nullptr : (const uint8_t*)p;
+#endif
+			if (mapData == nullptr) {
+				close();
+				return false;
+			}
+			return true;
+		}
+
+		void close()
+		{
+#ifdef _WIN32
+			if (mapData)
+				UnmapViewOfFile(mapData);
+			if (mapHandle != NULL)
+				CloseHandle(mapHandle);
+			if (fileHandle != INVALID_HANDLE_VALUE)
+				CloseHandle(fileHandle);
+			mapHandle = NULL;
+			fileHandle = INVALID_HANDLE_VALUE;
+#else
+			if (mapData)
+				munmap((void*)mapData, mapSize);
+			if (fd >= 0)
+				::close(fd);
+			fd = -1;
+#endif
+			mapData = nullptr;
+			mapSize = 0;
+		}
+
+		bool isOpen() const { return mapData != nullptr; }
+		const uint8_t* data() const { return mapData; }
+		size_t size() const { return mapSize; }
+
+		// Bytes of the mapping currently paged into physical memory. Costs a system call over every page of the
+		// mapping, so sample it rather than calling it each frame.
+		size_t residentBytes() const
+		{
+			if (!mapData)
+				return 0;
+#ifdef _WIN32
+			SYSTEM_INFO si;
+			GetSystemInfo(&si);
+			size_t pageSize = si.dwPageSize;
+			size_t numPages = (mapSize + pageSize - 1) / pageSize;
+			size_t resident = 0;
+			std::vector<PSAPI_WORKING_SET_EX_INFORMATION> info(std::min<size_t>(numPages, 4096));
+			for (size_t first = 0; first < numPages; first += info.size()) {
+				size_t count = std::min(info.size(), numPages - first);
+				for (size_t i = 0; i < count; ++i)
+					info[i].VirtualAddress = (PVOID)(mapData + (first + i) * pageSize);
+				if (!QueryWorkingSetEx(GetCurrentProcess(), info.data(), DWORD(count * sizeof(PSAPI_WORKING_SET_EX_INFORMATION))))
+					return 0;
+				for (size_t i = 0; i < count; ++i)
+					resident += info[i].VirtualAttributes.Valid ? pageSize : 0;
+			}
+#else
+			size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+			size_t numPages = (mapSize + pageSize - 1) / pageSize;
+			std::vector<unsigned char> pages(numPages);
+			if (mincore((void*)mapData, mapSize, pages.data()) != 0)
+				return 0;
+			size_t resident = 0;
+			for (unsigned char p : pages)
+				resident += (p & 1) ? pageSize : 0;
+#endif
+			return std::min(resident, mapSize);
+		}
+
+	private:
+		const uint8_t* mapData = nullptr;
+		size_t mapSize = 0;
+#ifdef _WIN32
+		HANDLE fileHandle = INVALID_HANDLE_VALUE;
+		HANDLE mapHandle = NULL;
+#else
+		int fd = -1;
+#endif
+	};
+}
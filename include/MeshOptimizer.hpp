@@ -0,0 +1,32 @@
+/**	MeshOptimizer.hpp
+*
+*	Index and vertex reordering for faster rendering of imported meshes: triangle order for the post-transform vertex
+*	cache (Forsyth's linear-speed algorithm), optional cluster ordering to cut overdraw (after Sander et al.), and
+*	vertex order for fetch locality. All functions expect every index to be < numVertices.
+*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace TDModelView
+{
+	// FIFO cache size used to report ACMR, the same as most desktop GPUs' effective post-transform cache.
+	static const unsigned int ACMR_CACHE_SIZE = 16;
+
+	// Number of vertex shader invocations a FIFO cache of 'cacheSize' entries would need to draw the triangles.
+	// Divide by the triangle count for ACMR (average cache miss ratio).
+	size_t countCacheMisses(const uint32_t* indices, size_t numIndices, size_t numVertices, unsigned int cacheSize = ACMR_CACHE_SIZE);
+
+	// Reorder triangles in place so consecutive triangles reuse recently transformed vertices.
+	void optimizeVertexCache(uint32_t* indices, size_t numIndices, size_t numVertices);
+
+	// Reorder runs of triangles produced by optimizeVertexCache() so outward facing clusters are drawn first, which
+	// lets early depth testing reject more of what is behind them. 'positions' is a strided float3 stream.
+	void optimizeOverdraw(uint32_t* indices, size_t numIndices, const float* positions, size_t stride, size_t numVertices);
+
+	// Number vertices in order of first use and rewrite the indices to match. remap[old] is the new position of each
+	// vertex; vertices no index refers to are moved to the end.
+	void buildFetchRemap(uint32_t* indices, size_t numIndices, size_t numVertices, std::vector<uint32_t>& remap);
+}
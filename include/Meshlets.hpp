@@ -0,0 +1,46 @@
+/**	Meshlets.hpp
+*
+*	Splits meshes into small clusters of triangles (meshlets) so the renderer can reject parts of a large mesh instead
+*	of all or none of it. Each cluster is a contiguous run of the mesh's index buffer with a bounding sphere and a
+*	normal cone; when the camera is behind the cone every triangle of the cluster faces away from it.
+*/
+
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace TDModelView
+{
+	struct Meshlet
+	{
+		uint32_t firstIndex;// into the mesh's index buffer
+		uint32_t indexCount;
+		float center[3];// bounding sphere
+		float radius;
+		float coneAxis[3];// average facing direction of the triangles
+		float coneCutoff;// sine of the widest angle between coneAxis and a triangle normal, 1 if too wide to cull by
+	};
+
+	// Cluster size limits. 64 vertices and 124 triangles keep clusters small enough to cull finely without making so
+	// many that testing them costs more than drawing them.
+	static const size_t MESHLET_MAX_VERTICES = 64;
+	static const size_t MESHLET_MAX_TRIANGLES = 124;
+
+	// Reorder the triangles in place into clusters of at most maxVertices distinct vertices and maxTriangles triangles,
+	// grown across shared vertices so each stays compact, and fill 'meshlets' in index order. 'positions' is a strided
+	// float3 stream. Returns the number of clusters.
+	size_t buildMeshlets(uint32_t* indices, size_t numIndices, const float* positions, size_t stride, size_t numVertices,
+		size_t maxVertices, size_t maxTriangles, std::vector<Meshlet>& meshlets);
+
+	// True if a camera at 'eye' sees only the back of every triangle in a cluster with the given bounding sphere and
+	// normal cone.
+	inline bool clusterBackfacing(const float* center, float radius, const float* coneAxis, float coneCutoff, const float* eye)
+	{
+		float d[3] = { center[0] - eye[0], center[1] - eye[1], center[2] - eye[2] };
+		float dist = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+		float facing = d[0] * coneAxis[0] + d[1] * coneAxis[1] + d[2] * coneAxis[2];
+		return facing >= coneCutoff * std::sqrt(dist) + radius;
+	}
+}
@@ -0,0 +1,91 @@
+/**	ModelLoader.hpp
+*
+*	Runs model imports on a background thread so the render loop never blocks. The loader thread parses the file,
+*	decodes textures and converts meshes; finished textures and meshes are queued and uploaded to the GPU from
+*	update() on the GL thread in bounded batches each frame.
+*/
+
+#pragma once
+#include "structs.hpp"
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace TDModelView
+{
+	class ASSIMPreader;
+
+	enum class LoadStage
+	{
+		IDLE = 0,
+		PARSING,
+		TEXTURES,
+		MATERIALS,
+		MESHES,
+		UPLOADING,
+		DONE,
+		CANCELLED,
+		FAILED
+	};
+
+	class ModelLoader
+	{
+	public:
+		int maxMeshesPerFrame = 64;
+		unsigned int maxVerticesPerFrame = 2000000;
+		int maxTexturesPerFrame = 4;
+
+		ModelLoader() {}
+		~ModelLoader();
+
+		// Start loading a model, cancelling any load already in progress. Call from the GL thread.
+		void load(std::string filepath);
+		void cancel();
+
+		// Upload queued work and finish completed loads. Call once per frame from the GL thread.
+		void update();
+
+		bool isLoading() const { return active; }
+		bool isCancelled() const { return cancelRequested; }
+		LoadStage stage() const { return (LoadStage)currentStage.load(); }
+		float progress() const { return stageProgress; }
+		std::string stageName() const;
+		std::string filename() const { return getFilename(filepath); }
+
+		// Called from the loader thread to report progress and hand over finished work.
+		void setStage(LoadStage s, float fraction = 0.0f);
+		void setProgress(float fraction) { stageProgress = fraction; }
+		void queueTexture(std::shared_ptr<Texture> tx, std::shared_ptr<TextureData> data);
+		void queueMesh(std::shared_ptr<Mesh> mesh);
+
+	private:
+		struct PendingTexture
+		{
+			std::shared_ptr<Texture> texture;
+			std::shared_ptr<TextureData> data;
+		};
+
+		std::string filepath = "";
+		std::thread worker;
+		std::shared_ptr<ASSIMPreader> reader;
+		bool active = false;
+		bool materialsAdded = false;
+		std::atomic<bool> cancelRequested{ false };
+		std::atomic<bool> workerDone{ false };
+		std::atomic<bool> workerFailed{ false };
+		std::atomic<int> currentStage{ (int)LoadStage::IDLE };
+		std::atomic<float> stageProgress{ 0.0f };
+		std::atomic<unsigned int> queuedMeshes{ 0 };
+		unsigned int uploadedMeshes = 0;
+		unsigned int reservedMeshes = 0;// queuedMeshes when GPU buffer space was last reserved
+
+		std::mutex queueMutex;
+		std::deque<PendingTexture> pendingTextures;
+		std::deque<std::shared_ptr<Mesh>> pendingMeshes;
+
+		void run();
+		void finish();
+		void join();
+	};
+}
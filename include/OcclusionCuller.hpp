@@ -0,0 +1,80 @@
+/**	OcclusionCuller.hpp
+*
+*	GPU occlusion culling against a hierarchical depth buffer (Hi-Z). After a frame is drawn its depth buffer is
+*	copied and reduced into a mip chain where every texel holds the farthest depth below it. The next frame's draws
+*	that survived frustum culling are tested in a compute shader: a box whose nearest point lies behind the farthest
+*	depth of the texels covering its screen rectangle, at most 4x4 on the level picked for its size, is hidden. Only
+*	needs GL 4.3 compute shaders, so it also runs on software rasterizers such as Mesa llvmpipe.
+*/
+
+#pragma once
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+#include "Frustum.hpp"
+
+namespace TDModelView
+{
+	struct Shader;
+
+	class OcclusionCuller
+	{
+	public:
+		OcclusionCuller() {}
+		~OcclusionCuller() { release(); }
+		OcclusionCuller(const OcclusionCuller&) = delete;
+		OcclusionCuller& operator=(const OcclusionCuller&) = delete;
+
+		// Compile the compute shaders. Returns false if the context lacks compute shaders or storage buffers.
+		bool init();
+		bool supported() const { return reduceShader != nullptr && cullShader != nullptr; }
+
+		// True once a depth pyramid has been captured, and until invalidate().
+		bool ready() const { return pyramidValid; }
+
+		// Forget the captured pyramid, e.g. after the scene changed so last frame's depth no longer matches it.
+		void invalidate() { pyramidValid = false; }
+
+		// Copy the depth buffer of 'framebuffer' (0 for the window) over the current viewport and rebuild the pyramid.
+		// Call once the opaque part of the scene has been drawn, before anything that shouldn't occlude.
+		void capture(GLuint framebuffer);
+
+		// World space bounds of every draw, in the order later passed to cull().
+		void setBounds(const BoxArray& boxes);
+
+		// Clear visible[i] for the first 'count' bounds hidden behind the captured depth, as seen through 'VP'. Only
+		// bounds with visible[i] set are tested. If 'commandBuffer' is given its DrawElementsIndirectCommands (one per draw, same order) get a
+		// zero instance count for hidden draws and 'visible' is left unchanged, so nothing waits on the GPU; otherwise
+		// the result is read back into 'visible'. Returns the number of draws culled, which in the indirect case is the
+		// latest count the GPU has finished.
+		unsigned int cull(const glm::mat4& VP, uint8_t* visible, size_t count, GLuint commandBuffer = 0);
+
+		// Triangles, times instances, of the draws the latest finished indirect cull() zeroed.
+		unsigned int culledTriangles() const { return lastCulledTriangles; }
+
+		// Delete all GL objects and shaders.
+		void release();
+
+	private:
+		Shader* reduceShader = nullptr;
+		Shader* cullShader = nullptr;
+		GLuint depthTexture = 0;// copy of the scene depth
+		GLuint depthFBO = 0;
+		GLenum depthFormat = 0;
+		GLuint pyramid = 0;// R32F, level 0 is half the depth size
+		int width = 0, height = 0;// depth size
+		int levels = 0;
+		bool pyramidValid = false;
+		GLuint boundsBuffer = 0;// vec4 center, vec4 extent per draw
+		GLuint visibilityBuffer = 0;// one uint per draw
+		GLuint statsBuffer = 0;// culled draw and triangle counters
+		GLsync statsFence = 0;
+		size_t numBounds = 0;
+		unsigned int lastCulled = 0;
+		unsigned int lastCulledTriangles = 0;
+		std::vector<uint32_t> flags;
+
+		void resize(int w, int h, GLenum format);
+	};
+}
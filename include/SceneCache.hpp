@@ -0,0 +1,38 @@
+/**	SceneCache.hpp
+*
+*	Native binary cache (".tdmv") of an imported Scene. Files are keyed on the source model's path, size, write time
+*	and the Assimp import flags, and store vertex/index arrays at aligned offsets so they can be read straight out
+*	of a memory-mapped view on the next load without going through Assimp.
+*/
+
+#pragma once
+#include "structs.hpp"
+#include <cstdint>
+#include <functional>
+
+namespace TDModelView
+{
+	class SceneCache
+	{
+	public:
+		static const uint32_t VERSION = 2;
+		typedef std::function<std::shared_ptr<Texture>(const std::string&)> TextureResolver;
+		std::string cachePath = "";
+		std::string sourcePath = "";
+
+		SceneCache(std::string sourcePath, unsigned int importFlags);
+
+		// Returns the cached scene if a valid cache file exists for the current key, otherwise nullptr. Texture paths
+		// are handed to 'resolveTexture', so the caller decides how (and on which thread) they get loaded.
+		std::shared_ptr<Scene> load(TextureResolver resolveTexture);
+
+		// Write 'scene' (which must still hold its CPU-side vertex data) to the cache file.
+		bool save(std::shared_ptr<Scene> scene);
+
+	private:
+		uint64_t sourceSize = 0;
+		int64_t sourceTime = 0;
+		uint32_t importFlags = 0;
+		bool hasSource = false;
+	};
+}
@@ -0,0 +1,21 @@
+/**	Simplifier.hpp
+*
+*	Triangle mesh decimation by quadric error metric edge collapse (Garland and Heckbert), used to build level of
+*	detail index buffers over a mesh's existing vertices. A vertex only ever collapses onto one of its neighbours, so
+*	no new vertices are made. Vertices on open borders and on attribute seams (several vertices sharing a position)
+*	never move, so simplified meshes keep their outline and don't crack along UV or normal seams.
+*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace TDModelView
+{
+	// Write a simplified copy of the triangle list to 'destination' (room for numIndices entries), stopping once it has
+	// at most 'targetIndexCount' indices or the next collapse would move the surface by more than 'targetError'.
+	// Errors are distances relative to the mesh's largest extent. Returns the new index count and stores the largest
+	// error of any collapse made in 'resultError' if given. 'positions' is a strided float3 stream.
+	size_t simplifyMesh(uint32_t* destination, const uint32_t* indices, size_t numIndices, const float* positions,
+		size_t stride, size_t numVertices, size_t targetIndexCount, float targetError, float* resultError = nullptr);
+}
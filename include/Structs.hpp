@@ -9,16 +9,31 @@
 #include <GLFW/glfw3.h>
 #include <opencv2/opencv.hpp>
 #include <array>
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <limits>
 #include <glm/gtx/orthonormalize.hpp>
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtx/euler_angles.hpp>
 #include "UI.hpp"
+#include "ThreadPool.hpp"
+#include "BVH.hpp"
+#include "GeometryStore.hpp"
+#include "GeometryBuffer.hpp"
+#include "OcclusionCuller.hpp"
+#include "Arena.hpp"
+#include "GpuProfiler.hpp"
+#include "VertexKernels.hpp"
+#include "Tangents.hpp"
+#include "MeshOptimizer.hpp"
+#include "Simplifier.hpp"
+#include "Meshlets.hpp"
 #include <assimp/material.h>
 #include "nv_dds.h"
 
@@ -28,24 +43,73 @@ namespace TDModelView
 	{
 		unsigned int ID = 0;
 		std::string handle = "";
-		void clear() { ID = 0; handle = ""; }
+		void clear() { ID = 0; handle = ""; uniforms.clear(); uniformIndex.clear(); }
 		void use() { glUseProgram(ID); }
-		void setBool(const std::string& name, bool value) const { glUniform1i(glGetUniformLocation(ID, name.c_str()), value); }
-		void setInt(const std::string& name, int value) const { glUniform1i(glGetUniformLocation(ID, name.c_str()), value); }
-		void setUint(const std::string& name, int value) const { glUniform1ui(glGetUniformLocation(ID, name.c_str()), value); }
-		void setFloat(const std::string& name, float value) const { glUniform1f(glGetUniformLocation(ID, name.c_str()), value); }
-		void setIvec2(const std::string& name, const glm::ivec2& value) const { glUniform2iv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]); }
-		void setIvec3(const std::string& name, const glm::ivec3& value) const { glUniform3iv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]); }
-		void setIvec4(const std::string& name, const glm::ivec4& value) const { glUniform4iv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]); }
-		void setVec2(const std::string& name, const glm::vec2& value) const { glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]); }
-		void setVec2(const std::string& name, float x, float y) const { glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y); }
-		void setVec3(const std::string& name, const glm::vec3& value) const { glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]); }
-		void setVec3(const std::string& name, float x, float y, float z) const { glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z); }
-		void setVec4(const std::string& name, const glm::vec4& value) const { glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]); }
-		void setVec4(const std::string& name, float x, float y, float z, float w) { glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w); }
-		void setMat2(const std::string& name, const glm::mat2& mat) const { glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]); }
-		void setMat3(const std::string& name, const glm::mat3& mat) const { glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]); }
-		void setMat4(const std::string& name, const glm::mat4& mat) const { glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]); }
+
+		// Look up every active uniform once after linking, so setters never call glGetUniformLocation.
+		void cacheUniforms() {
+			uniforms.clear();
+			uniformIndex.clear();
+			GLint count = 0;
+			GLint maxLength = 0;
+			glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+			glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+			std::vector<GLchar> nameBuf(std::max(maxLength, 1));
+			for (GLint i = 0; i < count; ++i) {
+				GLsizei length = 0;
+				GLint size = 0;
+				GLenum type = 0;
+				glGetActiveUniform(ID, (GLuint)i, (GLsizei)nameBuf.size(), &length, &size, &type, nameBuf.data());
+				std::string name(nameBuf.data(), length);
+				GLint location = glGetUniformLocation(ID, name.c_str());
+				if (location < 0)
+					continue;// uniform block member
+				if (name.size() > 3 && name.compare(name.size() - 3, 3, "[0]") == 0)
+					name.resize(name.size() - 3);
+				Uniform u;
+				u.location = location;
+				uniformIndex[name] = (int)uniforms.size();
+				uniforms.push_back(u);
+			}
+		}
+
+		// Handle for a uniform name, or -1 if the program doesn't use it. Setters ignore -1.
+		int uniform(const std::string& name) const {
+			auto it = uniformIndex.find(name);
+			return it == uniformIndex.end() ? -1 : it->second;
+		}
+
+		// Handle-based setters. Values are shadowed per uniform and only sent to GL when they change.
+		void setBool(int h, bool value) const { setInt(h, (int)value); }
+		void setInt(int h, int value) const { if (changed(h, &value, sizeof(value))) glUniform1i(uniforms[h].location, value); }
+		void setUint(int h, unsigned int value) const { if (changed(h, &value, sizeof(value))) glUniform1ui(uniforms[h].location, value); }
+		void setFloat(int h, float value) const { if (changed(h, &value, sizeof(value))) glUniform1f(uniforms[h].location, value); }
+		void setIvec2(int h, const glm::ivec2& value) const { if (changed(h, &value[0], sizeof(value))) glUniform2iv(uniforms[h].location, 1, &value[0]); }
+		void setIvec3(int h, const glm::ivec3& value) const { if (changed(h, &value[0], sizeof(value))) glUniform3iv(uniforms[h].location, 1, &value[0]); }
+		void setIvec4(int h, const glm::ivec4& value) const { if (changed(h, &value[0], sizeof(value))) glUniform4iv(uniforms[h].location, 1, &value[0]); }
+		void setVec2(int h, const glm::vec2& value) const { if (changed(h, &value[0], sizeof(value))) glUniform2fv(uniforms[h].location, 1, &value[0]); }
+		void setVec3(int h, const glm::vec3& value) const { if (changed(h, &value[0], sizeof(value))) glUniform3fv(uniforms[h].location, 1, &value[0]); }
+		void setVec4(int h, const glm::vec4& value) const { if (changed(h, &value[0], sizeof(value))) glUniform4fv(uniforms[h].location, 1, &value[0]); }
+		void setMat2(int h, const glm::mat2& mat) const { if (changed(h, &mat[0][0], sizeof(mat))) glUniformMatrix2fv(uniforms[h].location, 1, GL_FALSE, &mat[0][0]); }
+		void setMat3(int h, const glm::mat3& mat) const { if (changed(h, &mat[0][0], sizeof(mat))) glUniformMatrix3fv(uniforms[h].location, 1, GL_FALSE, &mat[0][0]); }
+		void setMat4(int h, const glm::mat4& mat) const { if (changed(h, &mat[0][0], sizeof(mat))) glUniformMatrix4fv(uniforms[h].location, 1, GL_FALSE, &mat[0][0]); }
+
+		void setBool(const std::string& name, bool value) const { setBool(uniform(name), value); }
+		void setInt(const std::string& name, int value) const { setInt(uniform(name), value); }
+		void setUint(const std::string& name, int value) const { setUint(uniform(name), (unsigned int)value); }
+		void setFloat(const std::string& name, float value) const { setFloat(uniform(name), value); }
+		void setIvec2(const std::string& name, const glm::ivec2& value) const { setIvec2(uniform(name), value); }
+		void setIvec3(const std::string& name, const glm::ivec3& value) const { setIvec3(uniform(name), value); }
+		void setIvec4(const std::string& name, const glm::ivec4& value) const { setIvec4(uniform(name), value); }
+		void setVec2(const std::string& name, const glm::vec2& value) const { setVec2(uniform(name), value); }
+		void setVec2(const std::string& name, float x, float y) const { setVec2(uniform(name), glm::vec2(x, y)); }
+		void setVec3(const std::string& name, const glm::vec3& value) const { setVec3(uniform(name), value); }
+		void setVec3(const std::string& name, float x, float y, float z) const { setVec3(uniform(name), glm::vec3(x, y, z)); }
+		void setVec4(const std::string& name, const glm::vec4& value) const { setVec4(uniform(name), value); }
+		void setVec4(const std::string& name, float x, float y, float z, float w) { setVec4(uniform(name), glm::vec4(x, y, z, w)); }
+		void setMat2(const std::string& name, const glm::mat2& mat) const { setMat2(uniform(name), mat); }
+		void setMat3(const std::string& name, const glm::mat3& mat) const { setMat3(uniform(name), mat); }
+		void setMat4(const std::string& name, const glm::mat4& mat) const { setMat4(uniform(name), mat); }
 		void checkCompileErrors(GLuint shader, std::string handle) {
 			GLint success;
 			GLchar infoLog[1024];
@@ -57,7 +121,43 @@ namespace TDModelView
 				ErrorMessageBox(str);
 			}
 		}
+
+	private:
+		struct Uniform
+		{
+			GLint location = -1;
+			bool isSet = false;
+			uint8_t value[sizeof(glm::mat4)];// last value uploaded
+		};
+		mutable std::vector<Uniform> uniforms;
+		std::unordered_map<std::string, int> uniformIndex;
+
+		// Store 'data' as the uniform's current value. Returns false if the handle is invalid or the value is unchanged.
+		bool changed(int h, const void* data, size_t bytes) const {
+			if (h < 0 || h >= (int)uniforms.size())
+				return false;
+			Uniform& u = uniforms[h];
+			if (u.isSet && memcmp(u.value, data, bytes) == 0)
+				return false;
+			memcpy(u.value, data, bytes);
+			u.isSet = true;
+			return true;
+		}
+	};
+	// Decoded pixel data for a texture, produced off the GL thread and handed to Texture::upload().
+	struct TextureData
+	{
+		std::string filepath = "";
+		int width = 0;
+		int height = 0;
+		GLenum format = GL_RGB;
+		GLenum internalFormat = GL_RGB;
+		GLenum dataType = GL_UNSIGNED_BYTE;
+		bool isCompressed = false;
+		std::vector<uint8_t> pixels;
+		bool empty() const { return pixels.empty() || width <= 0 || height <= 0; }
 	};
+
 	struct Texture
 	{
 		GLuint id = 0;
@@ -70,31 +170,20 @@ namespace TDModelView
 			this->filepath = filename;
 			if (img.channels() != 4)
 				cv::cvtColor(img, img, cv::COLOR_BGRA2RGBA);
-			int h = img.rows;
-			int w = img.cols;
+			TextureData data;
+			data.filepath = filename;
+			data.width = img.cols;
+			data.height = img.rows;
+			data.format = data.internalFormat = GL_RGBA;
 			unsigned int sz = img.total() * img.elemSize();
-			uint8_t* data = new uint8_t[sz];
-			memcpy(data, img.data, sz);
+			data.pixels.assign(img.data, img.data + sz);
 			img.deallocate();
-			glPixelStorei(GL_PACK_ALIGNMENT, 1);
-			glPixelStorei(GL_PACK_ROW_LENGTH, 0);
-			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-			glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-			if (this->id)
-				glDeleteTextures(1, &this->id);
-			glGenTextures(1, &this->id);
-			glBindTexture(GL_TEXTURE_2D, id);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_REPEAT);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, &data[0]);
-			glGenerateMipmap(GL_TEXTURE_2D);
-			glBindTexture(GL_TEXTURE_2D, 0);
+			upload(data);
 		}
 
-		void loadDDS(std::string path) {
+		static TextureData decodeDDS(std::string path) {
+			TextureData result;
+			result.filepath = path;
 			nv_dds::CDDSImage image;
 			nv_dds::CSurface surf;
 
@@ -106,7 +195,7 @@ namespace TDModelView
 			catch (std::exception e1)
 			{
 				ErrorMessageBox(e1.what());
-				return;
+				return result;
 			}
 
 			int w = image.get_width();
@@ -217,58 +306,46 @@ namespace TDModelView
 				isCompressed = true;
 			}			
 
-			int dataType = GL_UNSIGNED_BYTE;
-			uint8_t* data = new uint8_t[totalBytes];
-			unsigned int byte_counter = 0;
 			switch (type)
 			{
 			case GL_TEXTURE_2D:
 				if (image.get_num_mipmaps() > 1)
-					memcpy(data, surf, surf.get_size());
+					result.pixels.assign((uint8_t*)surf, (uint8_t*)surf + surf.get_size());
 				else
-					memcpy(data, image, image.get_size());
+					result.pixels.assign((uint8_t*)image, (uint8_t*)image + image.get_size());
 				break;
 			case GL_TEXTURE_CUBE_MAP:
 			case GL_TEXTURE_3D:
 			case -1:
 				ErrorMessageBox("ERROR! Cannot load non-2D DDS files.");
+				return result;
 			}
 
-			glPixelStorei(GL_PACK_ALIGNMENT, 1);
-			glPixelStorei(GL_PACK_ROW_LENGTH, 0);
-			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-			glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-			if (this->id)
-				glDeleteTextures(1, &this->id);
-			glGenTextures(1, &this->id);
-			glBindTexture(GL_TEXTURE_2D, id);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_REPEAT);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			if (isCompressed)
-				glCompressedTexImage2D(GL_TEXTURE_2D, 0, internalFormat, w, h, 0, totalBytes, &data[0]);
-			else
-				glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, w, h, 0, format, dataType, &data[0]);
-			glGenerateMipmap(GL_TEXTURE_2D);
-			glBindTexture(GL_TEXTURE_2D, 0);
-
-			delete[] data;
+			result.width = w;
+			result.height = h;
+			result.format = format;
+			result.internalFormat = internalFormat;
+			result.dataType = GL_UNSIGNED_BYTE;
+			result.isCompressed = isCompressed;
 			image.clear();
+			return result;
 		}
 
-		Texture(std::string filename, std::string dir) {
-			this->filepath = checkFilepath(filename, dir);
-			std::string ext = getExtension(this->filepath);
-			if (ext != ".dds" && !std::filesystem::is_regular_file(filepath)) {
-				ErrorMessageBox("ERROR! Could not load texture " + filepath);
-				return;
+		// Read and convert an image file to GL-ready pixels. Makes no GL calls, so it's safe to run on worker threads.
+		static TextureData decode(std::string filename, std::string dir) {
+			TextureData result;
+			result.filepath = checkFilepath(filename, dir);
+			std::string ext = getExtension(result.filepath);
+			if (ext != ".dds" && !std::filesystem::is_regular_file(result.filepath)) {
+				ErrorMessageBox("ERROR! Could not load texture " + result.filepath);
+				return result;
 			}
 			else if (ext == ".dds")
 			{
-				loadDDS(filepath);
-				return;
+				std::string fpath = result.filepath;
+				result = decodeDDS(fpath);
+				result.filepath = fpath;
+				return result;
 			}
 
 			cv::Mat img = cv::imread(filename, -1);
@@ -276,7 +353,7 @@ namespace TDModelView
 			GLenum internalFormat = GL_RGB;
 			GLenum dataType = GL_UNSIGNED_BYTE;
 			if (img.empty())
-				return;
+				return result;
 			cv::flip(img, img, 0);
 			switch (img.depth()) {
 			case CV_8U:
@@ -350,12 +427,21 @@ namespace TDModelView
 				break;
 			}
 
-			int h = img.rows;
-			int w = img.cols;
+			result.width = img.cols;
+			result.height = img.rows;
+			result.format = format;
+			result.internalFormat = internalFormat;
+			result.dataType = dataType;
 			unsigned int sz = img.total() * img.elemSize();
-			uint8_t* data = new uint8_t[sz];
-			memcpy(data, img.data, sz);
+			result.pixels.assign(img.data, img.data + sz);
 			img.deallocate();
+			return result;
+		}
+
+		// Create the GL texture from decoded pixels. Must be called on the GL thread.
+		void upload(const TextureData& data) {
+			if (data.empty())
+				return;
 			glPixelStorei(GL_PACK_ALIGNMENT, 1);
 			glPixelStorei(GL_PACK_ROW_LENGTH, 0);
 			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
@@ -369,11 +455,20 @@ namespace TDModelView
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, w, h, 0, format, dataType, &data[0]);
+			if (data.isCompressed)
+				glCompressedTexImage2D(GL_TEXTURE_2D, 0, data.internalFormat, data.width, data.height, 0, (GLsizei)data.pixels.size(), data.pixels.data());
+			else
+				glTexImage2D(GL_TEXTURE_2D, 0, data.internalFormat, data.width, data.height, 0, data.format, data.dataType, data.pixels.data());
 			glGenerateMipmap(GL_TEXTURE_2D);
 			glBindTexture(GL_TEXTURE_2D, 0);
 		}
 
+		Texture(std::string filename, std::string dir) {
+			TextureData data = decode(filename, dir);
+			this->filepath = data.filepath;
+			upload(data);
+		}
+
 		void clear() 
 		{
 			if (id)
@@ -382,6 +477,52 @@ namespace TDModelView
 		}
 	};
 
+	const GLuint MATERIAL_BLOCK_BINDING = 0;// uniform buffer binding point of the material block
+	const GLuint DRAW_DATA_BINDING = 0;// shader storage binding points used by the indirect shader, see ShaderText.cpp
+	const GLuint MATERIAL_BUFFER_BINDING = 1;
+
+	// Permutation bits of the default shader, see Renderer::shaderFeatures. The low bits are a material's texture mask
+	// and compile in only the maps it has; the rest pick the pass and the material options fixed at compile time.
+	const uint32_t SHADER_TEXTURE_MASK = (1u << 24) - 1;
+	const uint32_t SHADER_INDIRECT = 1u << 24;// per-draw values from storage buffers at gl_DrawID, see renderIndirect()
+	const uint32_t SHADER_DEPTH_ONLY = 1u << 25;// depth pre-pass, no shading
+	const uint32_t SHADER_ALPHA_TEST = 1u << 26;// depth pre-pass that still discards like the full shader
+	const uint32_t SHADER_BUMP_MAP = 1u << 27;// Material::useBumpMap
+	// The texture types the shader tests with HAS_MAP. Other bits would only make duplicate programs.
+	const uint32_t SHADER_MAPS = (1u << aiTextureType_DIFFUSE) | (1u << aiTextureType_SPECULAR) |
+		(1u << aiTextureType_EMISSIVE) | (1u << aiTextureType_HEIGHT) | (1u << aiTextureType_NORMALS) |
+		(1u << aiTextureType_SHININESS) | (1u << aiTextureType_OPACITY) | (1u << aiTextureType_DISPLACEMENT) |
+		(1u << aiTextureType_BASE_COLOR) | (1u << aiTextureType_EMISSION_COLOR) | (1u << aiTextureType_METALNESS) |
+		(1u << aiTextureType_DIFFUSE_ROUGHNESS) | (1u << aiTextureType_AMBIENT_OCCLUSION);
+	static_assert(aiTextureType_UNKNOWN <= 24, "texture types must fit in SHADER_TEXTURE_MASK");
+
+	// std140 layout of the "MaterialBlock" uniform block declared in ShaderText.cpp. Keep the two in sync.
+	struct MaterialBlock
+	{
+		glm::vec3 diffuse;
+		float specularFactor;
+		glm::vec3 specular;
+		float roughness;
+		glm::vec3 ambient;
+		float opacity;
+		glm::vec3 emissive;
+		float ior;
+		glm::vec3 transparent;
+		float metalness;
+		float displacementMapAmplitude;
+		float displacementMapBias;
+		float heightMapAmplitude;
+		float lightmapMultiplier;
+		float emissiveMapAmplitude;
+		float ambientocclusionMapAmplitude;
+		float alphaCutoff;
+		int32_t parallaxSamples;
+		int32_t useBumpMap;
+		uint32_t textureMask;// bit i set if the material has a texture of aiTextureType i
+		int32_t pad[2];
+	};
+	static_assert(sizeof(MaterialBlock) == 128, "MaterialBlock must match the std140 block layout");
+
 	struct Material 
 	{
 		bool useBumpMap = false;
@@ -407,6 +548,11 @@ namespace TDModelView
 		float ior = 1.5f;
 		std::array<std::shared_ptr<Texture>, int(aiTextureType_UNKNOWN) + 1> textures;
 		bool HasTexture(aiTextureType texType) { return (textures[texType] != nullptr); }
+		// Fragments may be discarded by the alpha test, so depth can't be laid down without reading textures.
+		bool alphaTested() { return HasTexture(aiTextureType_OPACITY) || HasTexture(aiTextureType_DIFFUSE) ||
+			HasTexture(aiTextureType_BASE_COLOR) || opacity <= alphaCutoff; }
+		// Blended over what's behind it rather than hiding it.
+		bool translucent() const { return opacity < 1.0f; }
 		void AddTexture(const std::shared_ptr<Texture>& spTexture, aiTextureType texType) { textures[texType] = spTexture; }
 		void BindTexture(aiTextureType texType) {
 			if (textures[texType] != nullptr)
@@ -414,163 +560,74 @@ namespace TDModelView
 			else
 				glBindTexture(GL_TEXTURE_2D, 0);
 		}
-		void setUniforms(Shader* prog, bool useModelNormals) {
-			static const std::vector<std::string> materialUniformNamesNoSpace{
-		   "None",
-		   "Diffuse",
-		   "Specular",
-		   "Ambient",
-		   "Emissive",
-		   "Height",
-		   "Normal",
-		   "Shininess",
-		   "Opacity",
-		   "Displacement",
-		   "Lightmap",
-		   "Reflection",
-		   "Albedo",
-		   "NormalCamera",
-		   "EmissiveColor",
-		   "Metalness",
-		   "Roughness",
-		   "AmbientOcclusion",
-		   "Unknown"//Often the metalRoughness map is detected as 'Unknown'
-			};
-
-			prog->setVec3("material.diffuse", diffuse);
-			prog->setVec3("material.specular", specular);
-			prog->setVec3("material.ambient", ambient);
-			prog->setVec3("material.emissive", emissive);
-			prog->setVec3("material.transparent", transparent);
-			prog->setFloat("material.specularFactor", specularFactor);
-			prog->setFloat("material.roughness", roughness);
-			prog->setFloat("material.opacity", opacity);
-			prog->setFloat("material.ior", ior);
-			prog->setFloat("material.metalness", metalness);
-			prog->setFloat("displacementMapAmplitude", bumpMultiplier);
-
-			//static unsigned int Udiffuse = glGetUniformLocation(prog->ID, "material.diffuse");
-			//glUniform3fv(Udiffuse, 1, &diffuse[0]);
-			//static unsigned int Uspecular = glGetUniformLocation(prog->ID, "material.specular");
-			//glUniform3fv(Udiffuse, 1, &specular[0]);
-			//static unsigned int Uemissive = glGetUniformLocation(prog->ID, "material.emissive");
-			//glUniform3fv(Uemissive, 1, &emissive[0]);
-			//static unsigned int Utransparent = glGetUniformLocation(prog->ID, "material.transparent");
-			//glUniform3fv(Utransparent, 1, &transparent[0]);
-			//static unsigned int Uambient = glGetUniformLocation(prog->ID, "material.ambient");
-			//glUniform3fv(Uambient, 1, &ambient[0]);
-			//static unsigned int UspecularFactor = glGetUniformLocation(prog->ID, "material.specularFactor");
-			//glUniform1f(UspecularFactor, specularFactor);
-			//static unsigned int Uroughness = glGetUniformLocation(prog->ID, "material.roughness");
-			//glUniform1f(Uroughness, roughness);
-			//static unsigned int Uopacity = glGetUniformLocation(prog->ID, "material.opacity");
-			//glUniform1f(Uopacity, opacity);
-			//static unsigned int Uior = glGetUniformLocation(prog->ID, "material.ior");
-			//glUniform1f(Uior, ior);
-			//static unsigned int Umetalness = glGetUniformLocation(prog->ID, "material.metalness");
-			//glUniform1f(Umetalness, metalness);
-			//static unsigned int UbumpMultiplier = glGetUniformLocation(prog->ID, "material.bumpMultiplier");
-			//glUniform1f(UbumpMultiplier, bumpMultiplier);
-
-			prog->setFloat("displacementMapBias", displacementMapBias);
-			prog->setInt("parallaxSamples", parallaxSamples);
-			prog->setFloat("heightMapAmplitude", heightMultiplier);
-			prog->setFloat("lightmapMultiplier", lightmapMultiplier);
-			prog->setFloat("emissiveMapAmplitude", emissiveMultiplier);
-			prog->setFloat("ambientocclusionMapAmplitude", ambientocclusionMultiplier);
-			prog->setFloat("alphaCutoff", alphaCutoff);
-			prog->setBool("hasDisplacementMap", HasTexture(aiTextureType_DISPLACEMENT));
-			prog->setBool("useBumpMap", useBumpMap);
-			for (int i = 1; i < aiTextureType_UNKNOWN; ++i)
-			{
-				if(i == (int)aiTextureType_NORMALS && useModelNormals)
-					prog->setBool("hasNormalMap", false);
-				else
-					prog->setBool("has" + materialUniformNamesNoSpace[i] + "Map", HasTexture(aiTextureType(i)));
+		int uboIndex = -1;// slot in the scene's material uniform buffer, -1 until it's been built
+		MaterialBlock getBlock() const {
+			MaterialBlock b;
+			b.diffuse = diffuse;
+			b.specularFactor = specularFactor;
+			b.specular = specular;
+			b.roughness = roughness;
+			b.ambient = ambient;
+			b.opacity = opacity;
+			b.emissive = emissive;
+			b.ior = ior;
+			b.transparent = transparent;
+			b.metalness = metalness;
+			b.displacementMapAmplitude = bumpMultiplier;
+			b.displacementMapBias = displacementMapBias;
+			b.heightMapAmplitude = heightMultiplier;
+			b.lightmapMultiplier = lightmapMultiplier;
+			b.emissiveMapAmplitude = emissiveMultiplier;
+			b.ambientocclusionMapAmplitude = ambientocclusionMultiplier;
+			b.alphaCutoff = alphaCutoff;
+			b.parallaxSamples = parallaxSamples;
+			b.useBumpMap = useBumpMap;
+			b.textureMask = textureMask();
+			return b;
+		}
+		// Bit i set if the material has a texture of aiTextureType i.
+		uint32_t textureMask() const {
+			uint32_t mask = 0;
+			for (int i = 1; i < aiTextureType_UNKNOWN; ++i) {
+				if (textures[i] != nullptr)
+					mask |= 1u << i;
 			}
+			return mask;
 		}
 	};
 
+	// Textures loaded from files, indexed by resolved path. Textures are handed out as shared handles, and a
+	// texture's GL object is deleted as soon as the last handle to it (normally held by materials) is released.
 	class TextureBank 
 	{
 	public:
-		TextureBank() {}
-		~TextureBank() {}
-		void remove(int i) {
-			if (i < 0 || i >= textures.size())
-				return;
-			this->remove(textures[i].filepath);
-		}
+		TextureBank() : table(std::make_shared<SlotTable>()) {}
+		~TextureBank() { clear(); }
+
+		// Return the handle for 'filename', creating an empty (id 0) texture if it isn't in the bank yet. 'created' is
+		// set when a new texture was made and still needs its pixels uploaded. Safe to call from any thread.
+		std::shared_ptr<Texture> acquire(const std::string& filename, bool* created = nullptr);
+		std::shared_ptr<Texture> add(std::string filename, std::string dir);
+		void clear();
+		bool exists(const std::string& filename) { return getPtr(filename) != nullptr; }
+		std::shared_ptr<Texture> getPtr(const std::string& filename);
+		std::vector<std::shared_ptr<Texture>> handles();
 		void remove(std::string filename);
-		int add(std::string filename, std::string dir) {
-			// Add only unique textures.
-			if (exists(filename)) {
-				Texture tx = get(filename);
-				return tx.id;
-			}
-			else {
-				Texture tx = Texture(filename, dir);
-				if (tx.id != 0) {
-					textures.push_back(tx);
-					return tx.id;
-				}
-				else {
-					return -1;
-				}
-			}
-		}
-		int add(Texture tx) {
-			if (exists(tx.filepath))
-				return tx.id;
-			else {
-				if (tx.id != 0) {
-					textures.push_back(tx);
-					return tx.id;
-				}
-				else {
-					return -1;
-				}
-			}
-		}
-		void clear() {
-			for (int i = 0; i < textures.size(); ++i) {
-				if (textures[i].id)
-					glDeleteTextures(1, &textures[i].id);
-			}
-			textures.clear();
-		}
-		bool exists(std::string filename) {
-			for (int i = 0; i < textures.size(); ++i) {
-				if (textures[i].filepath == filename)
-					return true;
-			}
-			return false;
-		}
-		Texture get(std::string filename) {
-			for (int i = 0; i < textures.size(); ++i) {
-				if (textures[i].filepath == filename)
-					return textures[i];
-			}
-			return Texture();
-		}
-		inline std::shared_ptr<Texture> getPtr(std::string filename) {
-			for (int i = 0; i < textures.size(); ++i) {
-				if (textures[i].filepath == filename)
-					return std::make_shared<Texture>(textures[i]);
-			}
-			return nullptr;
-		}
-		Texture get(int idx) {
-			if (idx > 0 && idx < textures.size())
-				return textures[idx];
-			return Texture();
-		}
+		size_t size();
 		Texture GenIrradianceMap(Texture tx) {
 
 		}
 	private:
+		// Shared with every handle's deleter, so handles that outlive the bank don't touch freed memory.
+		struct SlotTable
+		{
+			std::mutex mutex;
+			std::unordered_map<std::string, unsigned int> index;
+			std::vector<std::weak_ptr<Texture>> slots;
+			std::vector<unsigned int> freeSlots;
+		};
 		Shader* irradianceShader = nullptr;
-		std::vector<Texture> textures;
+		std::shared_ptr<SlotTable> table;
 	};
 
     struct Vertex 
@@ -588,6 +645,18 @@ namespace TDModelView
         }
     };
 
+    // Compact vertex layout (20 bytes vs. 60 for Vertex). Positions are 16-bit fractions of the mesh bounds, normal
+    // and tangent are octahedral-encoded snorm16 pairs, and the bitangent is rebuilt in the vertex shader from the
+    // handedness sign kept in position[3]. Decoded in the default vertex shader when compactVertices is set.
+    struct PackedVertex
+    {
+        uint16_t position[4];// xyz relative to the mesh bounds, w = 65535 for right-handed tangent frames, else 0
+        uint16_t uv[2];// half floats
+        int16_t normal[2];
+        int16_t tangent[2];
+    };
+    static_assert(sizeof(PackedVertex) == 20, "PackedVertex must stay tightly packed");
+
     struct BoundingBox 
 	{
         glm::vec3 bboxMin = glm::vec3(std::numeric_limits<float>::max());
@@ -656,31 +725,91 @@ namespace TDModelView
         GLuint numVertices = 0;
         std::shared_ptr<Material> material = nullptr;
         glm::mat4 modelMatrix = glm::mat4(1.0f);
-        GLuint EBO = 0;
+        std::vector<glm::mat4> instances;// transform of each copy, applied before modelMatrix; empty if drawn once
         bool loaded = false;
-        GLuint VBO = 0;
-        GLuint VAO = 0;
+        bool compact = false;// upload PackedVertex instead of Vertex
+        GLenum indexType = GL_UNSIGNED_INT;// GL_UNSIGNED_SHORT once loaded if every index fits in 16 bits
+        glm::vec3 positionOffset = glm::vec3(0.0f);// dequantization: position = offset + scale * packed position
+        glm::vec3 positionScale = glm::vec3(1.0f);
+        std::shared_ptr<GeometryStore> store;// CPU copy of the vertices/indices, kept after Load() clears them
+        int storeIndex = -1;
+        std::shared_ptr<GeometryBuffer> gpu;// shared scene buffers holding this mesh's ranges once loaded
+        int gpuHandle = -1;
+        // A simplified index range over the same vertices. 'error' is how far it strays from the full mesh, relative
+        // to the mesh's largest extent.
+        struct LOD { GLuint firstIndex; GLuint indexCount; float error; };
+        std::vector<LOD> lods;// coarser levels after the full one, coarsest last; their indices follow the mesh's own
+        std::vector<Meshlet> meshlets;// clusters covering the full level's triangles in index order, if built at import
+        Mesh(Arena* arena = nullptr) : vertices(ArenaAllocator<Vertex>(arena)), indices(ArenaAllocator<GLuint>(arena)) {}
         ~Mesh(){reset();}
         void AddVertex(const Vertex& v) { vertices.push_back(v); }
         void AddIndex(const GLuint& i)  { indices.push_back(i); }
+        void Reserve(size_t numVerts, size_t numInds) { vertices.reserve(numVerts); indices.reserve(numInds); }
+        int WriteTo(GeometryStore& s) const { return s.add(vertices.data(), vertices.size(), indices.data(), indices.size()); }
+        GLuint vertexCount() const { return loaded ? numVertices : (GLuint)vertices.size(); }
+        GLuint instanceCount() const { return instances.empty() ? 1 : (GLuint)instances.size(); }
+        GLuint indexCount() const { return loaded ? numIndices : (GLuint)(indices.size() ? indices.size() : vertices.size()); }
+        GLuint vertexSize() const { return compact ? sizeof(PackedVertex) : sizeof(Vertex); }
+        GLuint indexSize() const { return indexType == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(GLuint); }
+        // Indices uploaded for the mesh, including every level of detail.
+        GLuint indexBufferCount() const { return lods.empty() ? indexCount() : lods.back().firstIndex + lods.back().indexCount; }
+        // Level 0 is the full mesh, level i > 0 is lods[i - 1].
+        GLuint lodFirstIndex(unsigned int level) const { return level ? lods[level - 1].firstIndex : 0; }
+        GLuint lodIndexCount(unsigned int level) const { return level ? lods[level - 1].indexCount : numIndices; }
+        VertexFormat format() const { return compact ? VertexFormat::COMPACT : VertexFormat::FULL; }
+        GLuint vao() const { return gpu ? gpu->vao(format()) : 0; }
+        bool hasGeometry() const { return store && store->isMapped() && storeIndex >= 0; }
+        bool intersect(const glm::vec3& origin, const glm::vec3& dir, float& t) const;
+        void packVertices(std::vector<PackedVertex>& out);
+        // Reorder triangles for the vertex cache (and optionally overdraw), then vertices for fetch locality. Returns
+        // the number of triangles reordered (0 if the mesh was left alone) and the simulated cache misses.
+        size_t optimize(bool reduceOverdraw, size_t& missesBefore, size_t& missesAfter);
+        // Split into meshes of at most MAX_SHORT_INDEX_VERTICES vertices each, so all of them can use 16-bit indices.
+        // Triangle order is kept. Returns an empty list if the mesh is small enough already.
+        static const size_t MAX_SHORT_INDEX_VERTICES = 65536;
+        std::vector<std::shared_ptr<Mesh>> splitForShortIndices();
+        // Build up to 'maxLevels' simplified versions, each with about half the triangles of the one before, stopping
+        // early once a level would stray more than 'maxError' or barely shrinks. Returns the number of levels built.
+        size_t buildLODs(size_t maxLevels, float maxError);
+        // Reorder the triangles into clusters (see Meshlets) for culling parts of the mesh. Returns the cluster count, 0
+        // for meshes too small to be worth splitting. If the mesh was 'optimized' before, each cluster is put back in
+        // vertex cache order and the vertices in fetch order, and the simulated cache misses before and after are set.
+        size_t buildMeshlets(bool optimized, size_t& missesBefore, size_t& missesAfter);
+        // Transform the vertices by M in place, for meshes whose node transform is baked in at import.
+        void bakeTransform(const glm::mat4& M);
+        // Bounds of every instance, or of the mesh under modelMatrix if it isn't instanced.
+        void worldBounds(glm::vec3& wMin, glm::vec3& wMax) {
+            if (instances.empty()) {
+                transformedBounds(modelMatrix, wMin, wMax);
+                return;
+            }
+            wMin = glm::vec3(std::numeric_limits<float>::max());
+            wMax = glm::vec3(-std::numeric_limits<float>::max());
+            for (auto& inst : instances) {
+                glm::vec3 iMin, iMax;
+                transformedBounds(modelMatrix * inst, iMin, iMax);
+                wMin = glm::min(wMin, iMin);
+                wMax = glm::max(wMax, iMax);
+            }
+        }
         void reset(){
-            indices.clear();
-            vertices.clear();
+            releaseArrays();
             numIndices = numVertices = 0;
-            if (VBO)
-                glDeleteBuffers(1, &VBO);
-            if (EBO)
-                glDeleteBuffers(1, &EBO);
-            if (VAO)
-                glDeleteVertexArrays(1, &VAO);
+            lods.clear();
+            meshlets.clear();
+            if (gpu)
+                gpu->free(gpuHandle);
+            gpu.reset();
+            gpuHandle = -1;
             material.reset();
+            store.reset();
+            storeIndex = -1;
             loaded = false;
         }
-        void Load(){
+        // Copy the vertices and indices into the scene's shared buffers and free the CPU arrays. GL thread only.
+        void Load(std::shared_ptr<GeometryBuffer> buffer){
             if (loaded)
                 return;
-            glBindBuffer(GL_ARRAY_BUFFER, 0);
-            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
             numIndices = 0;
             // Create dummy indices if necessary.
             if (!indices.size()) {
@@ -690,124 +819,90 @@ namespace TDModelView
             }
             numIndices = indices.size();//preserve index count for glDrawElements()
 			numVertices = vertices.size();
-			if (VAO)
-                glDeleteVertexArrays(1, &VAO);
-            if (VBO)
-                glDeleteBuffers(1, &VBO);
-            if (EBO)
-                glDeleteBuffers(1, &EBO);
-            glGenVertexArrays(1, &VAO);
-            glGenBuffers(1, &VBO);
-            glGenBuffers(1, &EBO);
-            glBindVertexArray(VAO);
-            glBindBuffer(GL_ARRAY_BUFFER, VBO);
-            glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
-            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-            glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
-            glEnableVertexAttribArray(0);
-            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
-            glEnableVertexAttribArray(1);
-            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, uv));
-            glEnableVertexAttribArray(2);
-            glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
-            glEnableVertexAttribArray(3);
-            glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, tangent));
-            glEnableVertexAttribArray(4);
-            glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, bitangent));
-            this->vertices.clear();
-            this->indices.clear();
-            glBindVertexArray(0);
+            if (gpu)
+                gpu->free(gpuHandle);
+            gpu = buffer;
+            const void* vertexData = vertices.data();
+            std::vector<PackedVertex> packed;
+            if (compact) {
+                packVertices(packed);
+                vertexData = packed.data();
+            }
+            indexType = numVertices <= MAX_SHORT_INDEX_VERTICES ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+            const float* instanceData = instances.empty() ? nullptr : &instances[0][0][0];
+            // Levels of detail share the allocation, their indices after the mesh's own.
+            const GLuint* indexData = indices.data();
+            std::vector<GLuint> allIndices;
+            if (!lodIndices.empty()) {
+                allIndices.reserve(indices.size() + lodIndices.size());
+                allIndices.insert(allIndices.end(), indices.begin(), indices.end());
+                allIndices.insert(allIndices.end(), lodIndices.begin(), lodIndices.end());
+                indexData = allIndices.data();
+            }
+            size_t totalIndices = indices.size() + lodIndices.size();
+            if (indexType == GL_UNSIGNED_SHORT) {
+                std::vector<uint16_t> shortIndices(indexData, indexData + totalIndices);
+                gpuHandle = gpu->add(format(), vertexData, numVertices, shortIndices.data(), shortIndices.size() * sizeof(uint16_t),
+                    instanceData, instances.size());
+            }
+            else
+                gpuHandle = gpu->add(format(), vertexData, numVertices, indexData, totalIndices * sizeof(GLuint),
+                    instanceData, instances.size());
+            releaseArrays();
             loaded = true;
         }
 
+        // Draw every instance from the shared buffers at the given level of detail. The VAO returned by vao() must be
+        // bound.
+        void Draw(GLenum mode, unsigned int level = 0) const {
+            DrawRange(mode, lodFirstIndex(level), lodIndexCount(level));
+        }
+
+        // Draw 'count' indices from 'firstIndex' on, e.g. a run of meshlets.
+        void DrawRange(GLenum mode, GLuint firstIndex, GLuint count) const {
+            const GeometryBuffer::Allocation& a = gpu->allocation(gpuHandle);
+            glDrawElementsInstancedBaseVertexBaseInstance(mode, count, indexType,
+                (void*)(uintptr_t)(a.indexOffset + (size_t)firstIndex * indexSize()),
+                instanceCount(), (GLint)a.firstVertex, (GLuint)a.firstInstance);
+        }
+
         void DrawElements(GLenum mode){
-            glBindVertexArray(VAO);
-            glDrawElements(mode, numIndices, GL_UNSIGNED_INT, 0);
+            glBindVertexArray(vao());
+            Draw(mode);
             glBindVertexArray(0);
         }
 
-        void calculateTangents(){//Ref: https://stackoverflow.com/questions/5255806/how-to-calculate-tangent-and-binormal
-            for (unsigned int i = 0; i < indices.size(); i += 3){
-                // Shortcuts for vertices
-                int index0 = indices[i];
-                int index1 = indices[i + 1];
-                int index2 = indices[i + 2];
-
-                glm::vec3& v0 = vertices[index0].position;
-                glm::vec3& v1 = vertices[index1].position;
-                glm::vec3& v2 = vertices[index2].position;
-
-                // Shortcuts for UVs
-                glm::vec2 uv0 = glm::vec2(vertices[index0].uv);
-                glm::vec2 uv1 = glm::vec2(vertices[index1].uv);
-                glm::vec2 uv2 = glm::vec2(vertices[index2].uv);
-
-                // Edges of the triangle : postion delta
-                glm::vec3 deltaPos1 = v1 - v0;
-                glm::vec3 deltaPos2 = v2 - v0;
-
-                // UV delta
-                glm::vec2 deltaUV1 = uv1 - uv0;
-                glm::vec2 deltaUV2 = uv2 - uv0;
-
-                float r = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x);
-                glm::vec3 tangent = (deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y) * r;
-                glm::vec3 bitangent = (deltaPos2 * deltaUV1.x - deltaPos1 * deltaUV2.x) * r;
-
-                // Set the same tangent for all three vertices of the triangle.
-                vertices[index0].tangent = tangent;
-                vertices[index1].tangent = tangent;
-                vertices[index2].tangent = tangent;
-
-                // Same thing for bitangents
-                vertices[index0].bitangent = bitangent;
-                vertices[index1].bitangent = bitangent;
-                vertices[index2].bitangent = bitangent;
-            }
-            // See "Going Further"
-            for (unsigned int i = 0; i < vertices.size(); i += 1)
-            {
-                glm::vec3& n = vertices[i].normal;
-                glm::vec3& t = vertices[i].tangent;
-                glm::vec3& b = vertices[i].bitangent;
-
-                // Gram-Schmidt orthogonalize
-                t = glm::normalize(t - n * glm::dot(n, t));
-                b = b - n * glm::dot(b, n);
-				b = b - t * glm::dot(b, t);
-
-                // Calculate handedness
-                if (glm::dot(glm::cross(n, t), b) < 0.0f) {
-                    t = t * -1.0f;
-                }
-            }
-        }
+        // Area-weighted per-vertex tangents for meshes imported without them. Runs on the engine's thread pool.
+        void calculateTangents();
         void recalcBounds(){
             bbox.Reset();
-            for (int i = 0; i < vertices.size(); ++i){
-                // Find min point.
-                bbox.bboxMin.x = (vertices[i].position.x < bbox.bboxMin.x)
-                    ? vertices[i].position.x : bbox.bboxMin.x;
-                bbox.bboxMin.y = (vertices[i].position.y < bbox.bboxMin.y)
-                    ? vertices[i].position.y : bbox.bboxMin.y;
-                bbox.bboxMin.z = (vertices[i].position.z < bbox.bboxMin.z)
-                    ? vertices[i].position.z : bbox.bboxMin.z;
-
-                // Find max point.
-                bbox.bboxMax.x = (vertices[i].position.x > bbox.bboxMax.x)
-                    ? vertices[i].position.x : bbox.bboxMax.x;
-                bbox.bboxMax.y = (vertices[i].position.y > bbox.bboxMax.y)
-                    ? vertices[i].position.y : bbox.bboxMax.y;
-                bbox.bboxMax.z = (vertices[i].position.z > bbox.bboxMax.z)
-                    ? vertices[i].position.z : bbox.bboxMax.z;
-            }
-			if (vertices.size() == 0)
+            if (vertices.size())
+                positionBounds(&vertices[0].position.x, vertices.size(), sizeof(Vertex), bbox.bboxMin, bbox.bboxMax);
+			else
 				bbox.bboxMin = bbox.bboxMax = glm::vec3(0.0f);
         }
+
+        // p = p * scale + offset for every vertex position. Call recalcBounds() afterwards.
+        void scalePositions(float scale, const glm::vec3& offset){
+            if (vertices.size())
+                TDModelView::scalePositions(&vertices[0].position.x, vertices.size(), sizeof(Vertex), scale, offset);
+        }
 		friend class Scene;
+		friend class SceneCache;
         protected:
-            std::vector<Vertex> vertices;
-            std::vector<GLuint> indices;
+            ArenaVector<Vertex> vertices;
+            ArenaVector<GLuint> indices;
+            std::vector<GLuint> lodIndices;// indices of every level in 'lods' until Load()
+            // Free the CPU arrays. Assigning fresh vectors also detaches them from any import arena.
+            void releaseArrays() { vertices = ArenaVector<Vertex>(); indices = ArenaVector<GLuint>(); lodIndices = std::vector<GLuint>(); }
+            void transformedBounds(const glm::mat4& M, glm::vec3& wMin, glm::vec3& wMax) {
+                glm::vec3 c = glm::vec3(M * glm::vec4(bbox.center(), 1.0f));
+                glm::vec3 e = bbox.extent();
+                glm::mat3 L = glm::mat3(M);
+                e = glm::abs(L[0]) * e.x + glm::abs(L[1]) * e.y + glm::abs(L[2]) * e.z;
+                wMin = c - e;
+                wMax = c + e;
+            }
     };
 
 	struct Scene 
@@ -819,81 +914,184 @@ namespace TDModelView
 		std::vector<std::shared_ptr<Material>> materials;
 		Camera m_Camera;
 		glm::vec4 m_Light = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
-		unsigned int triCount = 0;
+		unsigned int triCount = 0;// drawn triangles, counting every instance
 		unsigned int vertexCount = 0;
+		unsigned int instanceCount = 0;// copies drawn by instanced meshes
+		size_t vertexBytes = 0;// size of all vertex buffers
+		size_t indexBytes = 0;// size of all index buffers
+		size_t cacheMissesBefore = 0, cacheMissesAfter = 0;// totals from the import optimization pass, if it ran
+		unsigned int optimizedTriangles = 0;
+		unsigned int lodMeshes = 0, lodLevels = 0;// meshes given levels of detail at import, and the levels built
+		unsigned int meshletCount = 0;// clusters built at import
+		GLuint materialUBO = 0;
+		GLint materialStride = 0;
+		GLuint materialSSBO = 0;// the same blocks tightly packed, for the indirect shader's material array
+		unsigned int revision = 0;// bumped whenever meshes are added or removed
+		std::shared_ptr<GeometryBuffer> buffers;// GPU vertex/index storage shared by all meshes
+		std::shared_ptr<GeometryStore> geometry;// null unless the model was loaded with "Keep CPU Geometry"
+		BVH bvh;// over mesh world bounds; item i is meshes[i]
+		unsigned int bvhRevision = 0;
+		int selectedMesh = -1;
+
+		bool hasBVH() const { return bvhRevision == revision && !bvh.empty(); }
+		void buildBVH()
+		{
+			std::vector<glm::vec3> wMin(meshes.size()), wMax(meshes.size());
+			for (size_t i = 0; i < meshes.size(); ++i)
+				meshes[i]->worldBounds(wMin[i], wMax[i]);
+			bvh.build(wMin, wMax);
+			bvhRevision = revision;
+		}
+
+		// Index of the mesh hit first by the ray, or -1. Tests triangles when CPU geometry was kept, bounds otherwise.
+		// The bounds fallback is only approximate: a box can be hit where its mesh has no surface, and boxes holding
+		// the ray origin (entry distance 0) are skipped, since they would win over everything in front of the camera.
+		int pick(const glm::vec3& origin, const glm::vec3& dir)
+		{
+			if (!hasBVH())
+				buildBVH();
+			float t = 0.0f;
+			return bvh.raycast(origin, dir, t, [&](uint32_t i, float& tItem) {
+				if (!meshes[i]->hasGeometry())
+					return tItem > 0.0f;
+				return meshes[i]->intersect(origin, dir, tItem);
+			});
+		}
+
+		// Place the camera so the whole box is in view.
+		void fitCamera(BoundingBox b)
+		{
+			m_Camera.position = b.center();
+			m_Camera.position.z -= (b.extent().z * 2.5f);
+			m_Camera.movementSpeed = glm::length(b.extent()) * 0.25f;
+			m_Camera.Update();
+		}
 
 		void recalcBounds()
 		{
-			bbox.bboxMin.xyz = glm::vec3(std::numeric_limits<float>::max());
-			bbox.bboxMax.xyz = -glm::vec3(std::numeric_limits<float>::max());
+			if (hasBVH()) {
+				bbox.bboxMin = bvh.root().bboxMin;
+				bbox.bboxMax = bvh.root().bboxMax;
+				return;
+			}
+			bbox.Reset();
 			for (auto& m : this->meshes){
-				// Find min point.
-				bbox.bboxMin.x = (m->bbox.bboxMin.x < bbox.bboxMin.x) ? m->bbox.bboxMin.x : bbox.bboxMin.x;
-				bbox.bboxMin.y = (m->bbox.bboxMin.y < bbox.bboxMin.y) ? m->bbox.bboxMin.y : bbox.bboxMin.y;
-				bbox.bboxMin.z = (m->bbox.bboxMin.z < bbox.bboxMin.z) ? m->bbox.bboxMin.z : bbox.bboxMin.z;
-
-				// Find max point.
-				bbox.bboxMax.x = (m->bbox.bboxMax.x > bbox.bboxMax.x) ? m->bbox.bboxMax.x : bbox.bboxMax.x;
-				bbox.bboxMax.y = (m->bbox.bboxMax.y > bbox.bboxMax.y) ? m->bbox.bboxMax.y : bbox.bboxMax.y;
-				bbox.bboxMax.z = (m->bbox.bboxMax.z > bbox.bboxMax.z) ? m->bbox.bboxMax.z : bbox.bboxMax.z;
+				glm::vec3 wMin, wMax;
+				m->worldBounds(wMin, wMax);
+				bbox.bboxMin = glm::min(bbox.bboxMin, wMin);
+				bbox.bboxMax = glm::max(bbox.bboxMax, wMax);
 			}
 		}
 
-		void copyToOutput(std::shared_ptr<Scene> scn) 
-		{
-			triCount = vertexCount = 0;
-			if (scn == nullptr)
-				return;
+		// Rescale a freshly imported scene to fit the scene limits. Touches only CPU-side data, so the loader thread
+		// runs this before any mesh is handed over for upload.
+		void normalize();
 
-			// Copy materials.
-			for (int i = 0; i < scn->materials.size(); ++i)
-				this->materials.push_back(scn->materials[i]);
+		// Upload a mesh and add it to the scene. GL thread only.
+		void addMesh(std::shared_ptr<Mesh> x)
+		{
+			if (!buffers)
+				buffers = std::make_shared<GeometryBuffer>();
+			x->Load(buffers);
+			triCount += x->numIndices / 3 * x->instanceCount();
+			instanceCount += (unsigned int)x->instances.size();
+			vertexCount += x->numVertices;
+			vertexBytes += (size_t)x->numVertices * x->vertexSize();
+			indexBytes += (size_t)x->indexBufferCount() * x->indexSize();
+			meshes.push_back(x);
+			revision++;
+		}
 
-			// Calculate dimensions for rescaling models to make them fit scene limits.
-			scn->recalcBounds();
-			float scaleFactor = 1.0f;
-			if (scn->bbox.maxDim() < minSceneBound)
-				scaleFactor = minSceneBound / scn->bbox.minDim();
-			else if (scn->bbox.minDim() > maxSceneBound)
-				scaleFactor = maxSceneBound / scn->bbox.maxDim();
+		// Grow the shared buffers once for meshes about to be added. GL thread only.
+		void reserveMeshes(const std::vector<Mesh*>& batch)
+		{
+			if (!buffers)
+				buffers = std::make_shared<GeometryBuffer>();
+			uint64_t numVertices[(int)VertexFormat::COUNT] = {};
+			uint64_t indexBytes = 0;
+			for (Mesh* m : batch) {
+				numVertices[(int)m->format()] += m->vertexCount();
+				// GeometryBuffer::add() places each mesh's indices on a 4-byte boundary.
+				uint64_t bytes = (uint64_t)m->indexBufferCount() * (m->vertexCount() <= Mesh::MAX_SHORT_INDEX_VERTICES ? sizeof(uint16_t) : sizeof(GLuint));
+				indexBytes += (bytes + 3) & ~uint64_t(3);
+			}
+			for (int f = 0; f < (int)VertexFormat::COUNT; ++f)
+				if (numVertices[f])
+					buffers->reserve(VertexFormat(f), numVertices[f], indexBytes);
+		}
 
-			if (scaleFactor < 1.0e-6f)
-				scaleFactor = 1.0e-6f;
+		// Remove a mesh and release its GPU ranges, packing the shared buffers if too much of them is left unused.
+		// GL thread only.
+		void removeMesh(size_t i)
+		{
+			bool hadBVH = hasBVH();
+			std::shared_ptr<Mesh> x = meshes[i];
+			triCount -= x->numIndices / 3 * x->instanceCount();
+			instanceCount -= (unsigned int)x->instances.size();
+			vertexCount -= x->numVertices;
+			vertexBytes -= (size_t)x->numVertices * x->vertexSize();
+			indexBytes -= (size_t)x->indexBufferCount() * x->indexSize();
+			meshes.erase(meshes.begin() + i);
+			x->reset();
+			if (buffers)
+				buffers->compact();
+			selectedMesh = -1;
+			revision++;
+			if (hadBVH)
+				buildBVH();
+		}
 
-			// Copy meshes, rescaling as necessary.
-			if (scn->meshes.size())
-			{
-				for (auto x : scn->meshes)
-				{
-					// Add dummy material if necessary.
-					if (x->material == nullptr)
-						x->material = std::shared_ptr<Material>();
-
-					// Apply scaling to vertices if necessary.
-					if (scaleFactor != 1.0f)
-					{
-						for (auto vt : x->vertices)						
-							vt.position *= scaleFactor;						
-					}
-
-					x->Load();
-					triCount += x->numIndices;
-					vertexCount += x->numVertices;
-					this->meshes.push_back(x);
-				}
+		// Pack every material into one uniform buffer, each at an aligned offset so draws can bind it with
+		// glBindBufferRange instead of setting uniforms. GL thread only.
+		void buildMaterialBuffer()
+		{
+			GLint align = 256;
+			glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+			materialStride = ((GLint)sizeof(MaterialBlock) + align - 1) / align * align;
+			std::vector<uint8_t> data(materials.size() * materialStride, 0);
+			for (int i = 0; i < materials.size(); ++i) {
+				MaterialBlock b = materials[i]->getBlock();
+				memcpy(&data[i * materialStride], &b, sizeof(b));
+				materials[i]->uboIndex = i;
 			}
+			if (!materialUBO)
+				glGenBuffers(1, &materialUBO);
+			glBindBuffer(GL_UNIFORM_BUFFER, materialUBO);
+			glBufferData(GL_UNIFORM_BUFFER, data.size(), data.data(), GL_STATIC_DRAW);
+			glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
-			triCount /= 3;
-			this->recalcBounds();
+			std::vector<MaterialBlock> blocks(materials.size());
+			for (int i = 0; i < materials.size(); ++i)
+				blocks[i] = materials[i]->getBlock();
+			if (!materialSSBO)
+				glGenBuffers(1, &materialSSBO);
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, materialSSBO);
+			glBufferData(GL_SHADER_STORAGE_BUFFER, blocks.size() * sizeof(MaterialBlock), blocks.data(), GL_STATIC_DRAW);
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 		}
 
 		~Scene(){clear();}
 
 		void clear() {
+			if (materialUBO)
+				glDeleteBuffers(1, &materialUBO);
+			materialUBO = 0;
+			if (materialSSBO)
+				glDeleteBuffers(1, &materialSSBO);
+			materialSSBO = 0;
 			meshes.clear();
 			materials.clear();
 			bbox.Reset();
-			triCount = vertexCount = 0;
+			triCount = vertexCount = instanceCount = 0;
+			vertexBytes = indexBytes = 0;
+			cacheMissesBefore = cacheMissesAfter = 0;
+			optimizedTriangles = 0;
+			lodMeshes = lodLevels = 0;
+			meshletCount = 0;
+			geometry.reset();
+			bvh.clear();
+			selectedMesh = -1;
+			revision++;
 		}
 	};
 
@@ -903,6 +1101,11 @@ namespace TDModelView
 		float ambientLightBlend = 1.0f;
 		float aoStrength = 1.0f;
 		bool cullBackfaces = false;
+		bool frustumCulling = true;
+		bool occlusionCulling = false;// also skip draws hidden behind last frame's depth, see OcclusionCuller
+		bool clusterCulling = true;// cull meshes with meshlets a cluster at a time (classic path only)
+		bool levelOfDetail = true;// draw meshes with generated LODs at the coarsest level that looks the same
+		float lodPixelError = 1.0f;// screen space error, in pixels, a level of detail may show
 		float reflectionStrength = 1.0f;
 		glm::vec2 resolution = glm::vec2(0.0);
 		bool useBumpMaps = false;
@@ -912,33 +1115,206 @@ namespace TDModelView
 		std::shared_ptr<Texture> hdr_irradiance_tx = nullptr;
 		std::shared_ptr<Texture> hdr_prefilt_tx = nullptr;
 		std::shared_ptr<Texture> lut_tx = nullptr;
+		unsigned int culledMeshes = 0;
+		unsigned int occludedMeshes = 0;// draws dropped by occlusion culling, out of those left after frustum culling
+		unsigned int culledClusters = 0;// meshlets of drawn meshes rejected by frustum, normal cone or occlusion
+		unsigned int drawCalls = 0;
+		unsigned int drawnTriangles = 0;// submitted last frame, after level of detail selection and occlusion culling
+		unsigned int stateChanges = 0;// texture, material and VAO binds issued last frame
+		bool indirectDraw = false;// submit the scene with glMultiDrawElementsIndirect, see renderIndirect()
+		bool depthPrepass = false;// lay down depth first so only the visible fragment of each pixel is shaded
+		GpuProfiler profiler;
+		bool indirectSupported = false;
+		bool occlusionSupported = false;
 		~Renderer() {
 			hdr_tx->clear();
 			lut_tx->clear();
-			if (shader->ID)
-				glDeleteProgram(shader->ID);
+			for (auto& v : variants) {
+				if (v.second.shader->ID)
+					glDeleteProgram(v.second.shader->ID);
+				delete v.second.shader;
+			}
+			if (drawDataBuffer)
+				glDeleteBuffers(1, &drawDataBuffer);
+			if (commandBuffer)
+				glDeleteBuffers(1, &commandBuffer);
 		}
 		void init() {
-			shader = defaultShader();
+			// Permutations for the scene's materials are compiled by prepareVariants(); the plainest ones are built now
+			// so errors in the shader source surface at startup.
+			variant(0);
+			indirectSupported = hasExtension("GL_ARB_shader_draw_parameters") && hasExtension("GL_ARB_multi_draw_indirect");
+			if (indirectSupported)
+				variant(SHADER_INDIRECT);
+			occlusionSupported = occlusion.init();
 #ifdef _DEBUG
 			checkError("After loading shaders.");
 #endif
 		}
 		void Render();
+		size_t shaderVariants() const { return variants.size(); }
 
 	private:
-		Shader* shader = nullptr;
-		Shader* defaultShader();
+		static const int NUM_TEXTURE_UNITS = 21;
+		struct DrawItem
+		{
+			uint64_t key;// texture set, then vertex format and index type, then material
+			Mesh* mesh;
+			uint32_t meshIndex;
+		};
+
+		// Per-draw values for the indirect shader, indexed by gl_DrawID. std430 layout of DrawData in ShaderText.cpp.
+		struct DrawData
+		{
+			glm::mat4 modelMatrix;
+			glm::mat4 normalMatrix;// upper 3x3 used
+			glm::vec4 positionOffset;
+			glm::vec4 positionScale;
+			uint32_t materialIndex;
+			uint32_t compactVertices;
+			uint32_t instanced;
+			uint32_t pad;
+		};
+		static_assert(sizeof(DrawData) == 176, "DrawData must match the std430 layout in ShaderText.cpp");
+
+		// Layout fixed by glMultiDrawElementsIndirect.
+		struct DrawCommand
+		{
+			GLuint count;
+			GLuint instanceCount;
+			GLuint firstIndex;
+			GLint baseVertex;
+			GLuint baseInstance;
+		};
+
+		// The meshlets of a queued draw in the cluster arrays.
+		struct ClusterRange
+		{
+			uint32_t first;
+			uint32_t count;
+		};
+
+		// A run of queued draws sharing textures, VAO and index type, submitted with one indirect call.
+		struct DrawBatch
+		{
+			uint32_t first;
+			uint32_t count;
+			GLuint vao;
+			GLenum indexType;
+			bool alphaTested;// some material in the batch discards fragments
+			bool translucent;// every material in the batch is, see buildCommands()
+		};
+
+		// GL bindings made so far this frame, so draws only issue the binds that actually change something.
+		struct BoundState
+		{
+			GLint activeUnit = -1;
+			std::array<GLint, NUM_TEXTURE_UNITS> textures;
+			GLint vao = -1;
+			GLint program = -1;
+			int material = -2;
+			void reset() { activeUnit = -1; textures.fill(-1); vao = -1; program = -1; material = -2; }
+		};
+
+		// Handles of the per-draw uniforms, looked up once per program.
+		struct DrawUniforms
+		{
+			int viewProjection = -1;
+			int drawOffset = -1;
+			int modelMatrix = -1;
+			int modelViewProjection = -1;
+			int normalMatrix = -1;
+			int compactVertices = -1;
+			int positionOffset = -1;
+			int positionScale = -1;
+			int instanced = -1;
+			void init(const Shader* s) {
+				viewProjection = s->uniform("viewProjection");
+				drawOffset = s->uniform("drawOffset");
+				modelMatrix = s->uniform("modelMatrix");
+				modelViewProjection = s->uniform("modelViewProjection");
+				normalMatrix = s->uniform("normalMatrix");
+				compactVertices = s->uniform("compactVertices");
+				positionOffset = s->uniform("positionOffset");
+				positionScale = s->uniform("positionScale");
+				instanced = s->uniform("instanced");
+			}
+		};
+
+		// A compiled permutation of the default shader.
+		struct ShaderVariant
+		{
+			Shader* shader = nullptr;
+			DrawUniforms uniforms;
+			unsigned int frame = 0;// last frame its per-frame uniforms were set
+		};
+
+		std::unordered_map<uint32_t, ShaderVariant> variants;// by feature bits
+		unsigned int frameNumber = 0;
+		uint32_t preparedSettings = 0;// variantSettings() when prepareVariants() last ran
+		std::vector<DrawItem> drawQueue;
+		BoxArray drawBounds;// world space bounds of each queued draw
+		std::vector<uint8_t> drawVisible;
+		std::vector<uint8_t> drawLevel;// level of detail of each queued draw this frame
+		std::vector<uint8_t> meshVisible;
+		std::vector<ClusterRange> drawClusters;// per queued draw; empty range for meshes drawn whole
+		BoxArray clusterBounds;// world space bounds of every cluster's bounding sphere
+		std::vector<glm::vec4> clusterCones;// world space normal cone axis and cutoff
+		std::vector<uint8_t> clusterVisible;
+		std::vector<uint8_t> occlusionVisible;// draws then clusters, for culling both in one pass
+		unsigned int drawQueueRevision = 0;
+		BoundState bound;
+		GLuint drawDataBuffer = 0;
+		GLuint commandBuffer = 0;
+		std::vector<DrawCommand> commands;// one per queued draw, in queue order
+		std::vector<DrawBatch> batches;
+		bool commandsDirty = true;
+		bool commandsOccluded = false;// occlusion culling zeroed instance counts in the GPU copy of 'commands'
+		unsigned int commandGeometryRevision = 0;
+		OcclusionCuller occlusion;
+		void bindTexture(int unit, GLuint id);
+		void bindMaterial(Material* material);
+		void bindMaterialTextures(Material* material);
+		void buildDrawQueue();
+		void buildCommands();
+		void captureDepth();
+		void cullClusters(const Frustum& frustum);
+		void renderDepthPrepass(GLenum mode);
+		void renderIndirect(GLenum mode);
+		void selectLevels();
+		void setDrawUniforms(Shader* s, const DrawUniforms& u, Mesh* m);
+		void setFrameUniforms(Shader* s);
+		void prepareVariants();
+		void shadeDraw(size_t d, GLenum mode);
+		uint32_t shaderFeatures(Material* material, uint32_t pass) const;
+		unsigned int submitDraw(size_t d, GLenum mode);
+		ShaderVariant& useVariant(uint32_t features);
+		ShaderVariant& variant(uint32_t features);
+		uint32_t variantSettings() const;
+		Shader* defaultShader(uint32_t features);
 	};
 
+	class ModelLoader;
+
 	struct EngineBase{
 		bool isPopupHovered = false;
 		bool silenceErrors = false;
+		bool keepGeometry = false;
+		bool buildMeshlets = false;
+		bool generateLODs = false;
+		bool optimizeMeshes = false;
+		bool preserveInstances = false;
+		bool splitLargeMeshes = false;
+		bool reduceOverdraw = false;
+		bool useCompactVertices = false;
+		bool useModelCache = true;
 		bool windowClose = false;
 		std::string working_directory = "";
 		std::shared_ptr<Renderer> render = nullptr;
+		std::shared_ptr<ModelLoader> loader = nullptr;
 		std::shared_ptr<Scene> scene = nullptr;
 		std::shared_ptr<TextureBank> textureBank = nullptr;
+		std::shared_ptr<ThreadPool> threadPool = nullptr;
 		std::shared_ptr<UI> ui = nullptr;
 		GLFWwindow* window = nullptr;
 		
@@ -992,8 +1368,13 @@ namespace TDModelView
 			WriteToLogFile("START 3D MODEL VIEWER LOG\r\n==========================\r\n");
 			working_directory = std::filesystem::current_path().string() + '\\';
 			WriteToLogFile("working directory: " + working_directory);
+			threadPool = std::make_shared<ThreadPool>();
+			WriteToLogFile("Worker threads: " + std::to_string(threadPool->size()));
 			eng->render = std::make_shared<Renderer>();
 			eng->render->init();
+			int fbWidth = 0, fbHeight = 0;
+			glfwGetFramebufferSize(window, &fbWidth, &fbHeight);
+			eng->render->resolution = glm::vec2(fbWidth, fbHeight);// until the first resize
 			ui = std::make_shared<UI>();
 			ui->desktop_width = w;
 			ui->desktop_height = h;
@@ -1012,6 +1393,8 @@ namespace TDModelView
 		}
 
 		void shutdown() {
+			if (loader)
+				loader.reset();// cancels and joins any load still in flight
 			if (textureBank) {
 				textureBank->clear();
 				textureBank.reset();
@@ -1020,6 +1403,8 @@ namespace TDModelView
 				render.reset();
 			if (scene)
 				scene.reset();
+			if (threadPool)
+				threadPool.reset();
 			if (ui)
 				eng->ui->terminate();
 			glfwTerminate();
@@ -0,0 +1,20 @@
+/**	Tangents.hpp
+*
+*	Tangent space generation for meshes imported without tangents. Each vertex gets the area-weighted average of the
+*	UV-space tangent and bitangent of the triangles using it, orthonormalized against its normal.
+*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace TDModelView
+{
+	struct Vertex;
+	class ThreadPool;
+
+	// Overwrite the tangent and bitangent of every vertex. 'indices' holds numIndices / 3 triangles; pass nullptr to
+	// treat consecutive vertices as triangles. With a pool, large meshes are split into triangle ranges that are
+	// accumulated in parallel and reduced per vertex without locks; the result doesn't depend on the thread count.
+	void generateTangents(Vertex* vertices, size_t numVertices, const uint32_t* indices, size_t numIndices, ThreadPool* pool);
+}
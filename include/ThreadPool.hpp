@@ -0,0 +1,74 @@
+/**	ThreadPool.hpp
+*
+*	Work-stealing task pool used for CPU-heavy import work. Each worker owns a deque of tasks, pushing and popping
+*	its own work from the front while idle workers steal from the back of the other queues. Threads that block on
+*	a result (including the main thread) help run pending tasks instead of sleeping, so tasks may safely wait on
+*	subtasks they submit themselves.
+*/
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace TDModelView
+{
+	class ThreadPool
+	{
+	public:
+		ThreadPool(unsigned int numThreads = 0);
+		~ThreadPool();
+
+		// Queue a callable and get a future for its result. Tasks submitted from a worker go to that worker's own queue.
+		template<class F>
+		auto submit(F&& f) -> std::future<decltype(f())>
+		{
+			using R = decltype(f());
+			auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+			std::future<R> result = task->get_future();
+			push([task]() { (*task)(); });
+			return result;
+		}
+
+		// Block until 'f' is ready, running queued tasks on this thread in the meantime.
+		template<class T>
+		T wait(std::future<T>& f)
+		{
+			while (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+				if (!runPendingTask())
+					f.wait_for(std::chrono::microseconds(100));
+			}
+			return f.get();
+		}
+
+		// Run a single queued task on the calling thread, if any is available. Returns false if all queues were empty.
+		bool runPendingTask();
+		unsigned int size() const { return (unsigned int)workers.size(); }
+
+	private:
+		struct WorkQueue
+		{
+			std::mutex mutex;
+			std::deque<std::function<void()>> tasks;
+		};
+
+		std::vector<std::thread> workers;
+		std::vector<std::unique_ptr<WorkQueue>> queues;
+		std::atomic<unsigned int> nextQueue{ 0 };
+		std::atomic<int> pendingTasks{ 0 };
+		std::atomic<bool> stopping{ false };
+		std::mutex sleepMutex;
+		std::condition_variable wake;
+
+		void push(std::function<void()> task);
+		bool pop(unsigned int queueIdx, std::function<void()>& task);
+		bool steal(unsigned int thiefIdx, std::function<void()>& task);
+		void workerLoop(unsigned int idx);
+	};
+}
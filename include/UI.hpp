@@ -36,7 +36,7 @@ namespace TDModelView
         int window_height = 720;
 
         // Progress bar values.
-        ImVec2 progressBarSize = ImVec2(400.0, 50.0);
+        ImVec2 progressBarSize = ImVec2(400.0, 110.0);
         ImVec2 progressBarPosition = ImVec2(0.0, 0.0);
 
 
@@ -55,6 +55,7 @@ namespace TDModelView
         ImVec2 fileDialogSize = ImVec2(800, 600);
         int fileLoadFlags = 0;
         void FileDialogModalPopup();
+        void LoadProgressPopup();
 
         // Misc functions.
         static void cursorCallback(GLFWwindow* window, double xpos, double ypos);
@@ -67,5 +68,6 @@ namespace TDModelView
 
     private:
         void renderUIHelper();
+        void pickMesh();
     };
 }
\ No newline at end of file
@@ -15,6 +15,7 @@ namespace TDModelView
     std::string getFilename(std::string str);
     std::vector<std::string> tokenize(std::string toTokenize, std::string token);
     bool checkError(std::string details);
+    bool hasExtension(std::string name);// for the current GL context
     void WriteToLogFile(std::string str);
     std::string getDateTime();
     std::string checkFilepath(std::string filepath, std::string local_directory = "");
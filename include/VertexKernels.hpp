@@ -0,0 +1,39 @@
+/**	VertexKernels.hpp
+*
+*	Bulk operations over strided streams of float3 positions (e.g. the position member of an array of Vertex). Each
+*	kernel has scalar, SSE2 and AVX versions; the widest one the CPU and OS support is picked on first use.
+*/
+
+#pragma once
+#include <glm/glm.hpp>
+#include <cstddef>
+
+namespace TDModelView
+{
+	enum class SimdLevel
+	{
+		SCALAR = 0,
+		SSE2,
+		AVX
+	};
+
+	SimdLevel detectSimdLevel();
+	SimdLevel simdLevel();
+	void setSimdLevel(SimdLevel level);// clamped to what the CPU supports
+	const char* simdLevelName(SimdLevel level);
+
+	// Min/max over 'count' positions starting at 'positions', 'stride' bytes apart. Leaves the outputs unchanged if
+	// count is 0.
+	void positionBounds(const float* positions, size_t count, size_t stride, glm::vec3& outMin, glm::vec3& outMax);
+
+	// p = p * scale + offset, in place.
+	void scalePositions(float* positions, size_t count, size_t stride, float scale, const glm::vec3& offset);
+
+	// p = (M * vec4(p, 1)).xyz, in place. M is assumed affine.
+	void transformPositions(float* positions, size_t count, size_t stride, const glm::mat4& M);
+
+	// Gram-Schmidt 'count' tangent frames stored as separate x, y and z arrays, in place: t becomes unit length and
+	// perpendicular to n, b perpendicular to both, and t is negated where (n x t) . b < 0, as in Vertex::Orthonormalize.
+	// A tangent with nothing left after projection is replaced by an arbitrary unit vector perpendicular to n.
+	void orthonormalizeTangents(const float* const n[3], float* const t[3], float* const b[3], size_t count);
+}
@@ -1,6 +1,8 @@
 #include "ASSIMPio.hpp"
 #include "stdafx.h"
 #include "structs.hpp"
+#include "SceneCache.hpp"
+#include "ModelLoader.hpp"
 #include <filesystem>
 #include <assimp/IOSystem.hpp>
 #include <assimp/pbrmaterial.h>
@@ -13,9 +15,24 @@
 #include <assimp/scene.h>
 #include <assimp/Exporter.hpp>
 #include <assimp/postprocess.h>
+#include <assimp/ProgressHandler.hpp>
 
 namespace TDModelView 
 {
+    // Forwards Assimp's parse progress to the loader and aborts ReadFile() when the load is cancelled.
+    class ImportProgressHandler : public Assimp::ProgressHandler
+    {
+    public:
+        ImportProgressHandler(ModelLoader* loader) : loader(loader) {}
+        bool Update(float percentage) override {
+            if (percentage >= 0.0f)
+                loader->setProgress(glm::clamp(percentage, 0.0f, 1.0f));
+            return !loader->isCancelled();
+        }
+    private:
+        ModelLoader* loader = nullptr;
+    };
+
     ASSIMPreader::~ASSIMPreader() {
         if (scene != nullptr) {
             scene->clear();
@@ -111,9 +128,17 @@ namespace TDModelView
     }
 
     std::shared_ptr<Mesh> ImportMeshAsync(aiMesh* m, std::shared_ptr<Scene> scene,
-        std::shared_ptr<Material> mat, std::string mesh_name, std::string scene_filepath){
-        std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>();
+        std::shared_ptr<Material> mat, std::string mesh_name, std::string scene_filepath, Arena* arena){
+        std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>(arena);
         mesh->material = mat;
+
+        // Size both arrays exactly up front so they're allocated once from the arena and never regrow.
+        size_t numIndices = 0;
+        for (unsigned int i = 0; i < m->mNumFaces; i++) {
+            unsigned int n = m->mFaces[i].mNumIndices;
+            numIndices += n == 3 ? 3 : (n > 3 ? size_t(n - 2) * 3 : 0);
+        }
+        mesh->Reserve(m->mNumVertices, numIndices);
         if (m->mNumVertices > 0){
             for (unsigned int i = 0; i < m->mNumVertices; i++){
                 Vertex vertex;
@@ -139,16 +164,12 @@ namespace TDModelView
                 mesh->AddIndex(m->mFaces[i].mIndices[1]);
                 mesh->AddIndex(m->mFaces[i].mIndices[2]);
             }
-            else {// Handle polygonal faces.
-                std::vector<unsigned int> idx;
-                for (int k = 0; k < m->mFaces[i].mNumIndices; ++k)
-                    idx.push_back(m->mFaces[i].mIndices[k]);                
-                if (idx.size() > 3) {
-                    for (int k = 0; k < idx.size() - 2; k++) {
-                        mesh->AddIndex(idx[k + 0]);
-                        mesh->AddIndex(idx[k + 1]);
-                        mesh->AddIndex(idx[k + 2]);
-                    }
+            else if (m->mFaces[i].mNumIndices > 3) {// Handle polygonal faces as a fan around the first corner.
+                const unsigned int* idx = m->mFaces[i].mIndices;
+                for (unsigned int k = 0; k < m->mFaces[i].mNumIndices - 2; k++) {
+                    mesh->AddIndex(idx[0]);
+                    mesh->AddIndex(idx[k + 1]);
+                    mesh->AddIndex(idx[k + 2]);
                 }
             }
         }
@@ -157,88 +178,147 @@ namespace TDModelView
         mesh->recalcBounds();
         return mesh;
     }
+    // Gather the world transform of every node reference to each mesh.
+    static void CollectMeshInstances(const aiNode* node, const aiMatrix4x4& parent,
+        std::vector<std::vector<glm::mat4>>& instances){
+        aiMatrix4x4 world = parent * node->mTransformation;
+        for (unsigned int i = 0; i < node->mNumMeshes; i++) {
+            if (node->mMeshes[i] < instances.size())
+                instances[node->mMeshes[i]].push_back(AIToGLMMat4(world));
+        }
+        for (unsigned int i = 0; i < node->mNumChildren; i++)
+            CollectMeshInstances(node->mChildren[i], world, instances);
+    }
     void ASSIMPreader::ImportMeshes(){
         if (!aiscene->HasMeshes())
             return;
 
-//#ifndef _DEBUG  // TO DO: add back in the openMP impl here, which causes errors and failures
-//#pragma omp parallel for
-//#endif
-        for (int n = 0; n < aiscene->mNumMeshes; n++){
-            std::string msh_name = aiscene->mMeshes[n]->mName.length > 0 ? std::string(aiscene->mMeshes[n]->mName.C_Str()) : "";
-            mesh_load_data.emplace(n, ImportMeshAsync(aiscene->mMeshes[n],scene, scene->materials[aiscene->mMeshes[n]->mMaterialIndex],msh_name,this->filepath));
+        // Without aiProcess_PreTransformVertices each aiMesh is stored once however many nodes use it. Meshes used once
+        // get their node transform baked in; meshes used more than once keep one transform per use and are drawn
+        // instanced. Meshes no node uses aren't drawn.
+        std::vector<std::vector<glm::mat4>> instances;
+        if (preserveInstances && aiscene->mRootNode) {
+            instances.resize(aiscene->mNumMeshes);
+            CollectMeshInstances(aiscene->mRootNode, aiMatrix4x4(), instances);
+        }
+
+        // Each mesh is converted on the engine's task pool and writes only its own slot, so no locking is needed.
+        mesh_load_data.assign(aiscene->mNumMeshes, nullptr);
+        mesh_tasks.clear();
+        mesh_tasks.reserve(aiscene->mNumMeshes);
+        meshes_requested = 0;
+        for (unsigned int n = 0; n < aiscene->mNumMeshes; n++)
+            meshes_requested += (instances.empty() || instances[n].size()) ? 1 : 0;
+        for (unsigned int n = 0; n < aiscene->mNumMeshes; n++){
+            aiMesh* m = aiscene->mMeshes[n];
+            std::vector<glm::mat4> transforms;
+            if (instances.size()) {
+                if (instances[n].empty())
+                    continue;
+                transforms.swap(instances[n]);
+            }
+            std::string msh_name = m->mName.length > 0 ? std::string(m->mName.C_Str()) : "";
+            std::shared_ptr<Material> mat = scene->materials[m->mMaterialIndex];
+            mesh_tasks.push_back(eng->threadPool->submit([this, n, m, mat, msh_name, transforms]() {
+                if (loader->isCancelled())
+                    return;
+                std::shared_ptr<Mesh> mesh = ImportMeshAsync(m, scene, mat, msh_name, filepath, &arena);
+                if (transforms.size() == 1)
+                    mesh->bakeTransform(transforms[0]);
+                else if (transforms.size() > 1)
+                    mesh->instances = transforms;
+                mesh_load_data[n] = mesh;
+                loader->setProgress(float(++meshes_done) / float(meshes_requested));
+            }));
         }
     }
     void ASSIMPreader::ImportMaterials(){
         if (!aiscene->HasMaterials())
             return;
         for (unsigned int i = 0; i < aiscene->mNumMaterials; i++){
-#ifdef _DEBUG
-            checkError(std::string("Before loading textures for material: ") + std::string(aiscene->mMaterials[i]->GetName().C_Str()));
-#endif
             auto newMaterial = ImportMaterial(aiscene->mMaterials[i]);
             ImportMaterialTextures(aiscene->mMaterials[i], newMaterial);
             scene->materials.push_back(newMaterial);
-#ifdef _DEBUG
-            checkError(std::string("After loading textures for material: ") + std::string(aiscene->mMaterials[i]->GetName().C_Str()));
-#endif
+            loader->setProgress(float(i + 1) / float(aiscene->mNumMaterials));
+        }
+    }
+    std::shared_ptr<Texture> ASSIMPreader::GetTexture(std::string fpath){
+        // Textures are deduplicated on their resolved path before any decoding starts. Each new file is decoded on
+        // the thread pool and queued for upload on the GL thread, which fills in the returned texture's id.
+        std::string resolved = checkFilepath(fpath, directory);
+        auto it = texture_cache.find(resolved);
+        if (it != texture_cache.end())
+            return it->second;
+        bool created = false;
+        std::shared_ptr<Texture> tx = eng->textureBank->acquire(resolved, &created);
+        texture_cache[resolved] = tx;
+        if (!created)
+            return tx;// already in the bank, so there's nothing to decode
+
+        textures_requested++;
+        texture_load_data.push_back(tx);
+        texture_tasks.push_back(eng->threadPool->submit([this, tx]() {
+            if (loader->isCancelled())
+                return false;
+            std::shared_ptr<TextureData> data = std::make_shared<TextureData>(Texture::decode(tx->filepath, directory));
+            loader->setProgress(float(++textures_done) / float(textures_requested));
+            if (data->empty())
+                return false;
+            loader->queueTexture(tx, data);
+            return true;
+        }));
+        return tx;
+    }
+    bool ASSIMPreader::GetMaterialTexturePath(aiMaterial* mMaterial, aiTextureType& texType, aiString& texPath){
+        bool usePBR = extension == ".gltf" || extension == ".glb";// this type of model will use PBR workflow textures.
+        bool hMapToNormal = extension == ".obj"; // for whatever reason, ASSIMP registers obj normal maps as 'height maps'
+
+        // Check to see if this texture type is present in the material.
+        if (!(mMaterial->GetTexture(aiTextureType(texType), 0, &texPath) == AI_SUCCESS))
+            return false;
+
+        // Interpret material texture data according to filetype.
+        if (usePBR && ((texType == aiTextureType_DIFFUSE ||
+            texType == aiTextureType_BASE_COLOR) && mMaterial->Get(AI_MATKEY_TEXTURE(
+                aiTextureType_DIFFUSE, 1), texPath) == AI_SUCCESS)) {
+            texType = aiTextureType_BASE_COLOR;
         }
+        else if (texType == aiTextureType_HEIGHT && hMapToNormal)
+            texType = aiTextureType_NORMALS;
+        return true;
     }
     void ASSIMPreader::ImportTextures(){
+        // Collect every unique texture file referenced by the scene's materials and start decoding them all at once,
+        // instead of one after another as each material is imported.
         for (int i = 0; i < aiscene->mNumMaterials; ++i) {
+            if (loader->isCancelled())
+                break;
             aiMaterial* material = aiscene->mMaterials[i];
-            aiString texture_file;
-            for (int j = 1; j<int(aiTextureType_UNKNOWN); ++j) {
-                if (material->mNumProperties == 0 || material->Get(AI_MATKEY_TEXTURE(aiTextureType(j), 0), texture_file) == AI_FAILURE)                
-                    continue;                
-
-                // If loading a .gltf file, specific ASSIMP texture keys may be used for PBR textures.
-                if ((extension == ".gltf" || extension == ".glb") &&
-                    ((j == int(aiTextureType_DIFFUSE) || j == int(aiTextureType_BASE_COLOR)) &&
-                        material->Get(AI_MATKEY_TEXTURE(aiTextureType_DIFFUSE, 0), texture_file) == AI_SUCCESS)
-
-                    ||
-
-                    ((j == int(aiTextureType_METALNESS) ||
-                        j == int(aiTextureType_DIFFUSE_ROUGHNESS) ||
-                        j == int(aiTextureType_AMBIENT_OCCLUSION)) &&
-                        material->Get(AI_MATKEY_TEXTURE(aiTextureType_UNKNOWN, 0), texture_file) == AI_SUCCESS)
-                    )
-                {
-                    // Material is loaded with texture_file path to proper PBR texture file.
-                }
-                else {
-                    material->GetTexture(aiTextureType(j), 0, &texture_file);
-                }
+            for (int j = 1; j <= int(aiTextureType_UNKNOWN); ++j) {
+                aiTextureType texType = aiTextureType(j);
+                aiString texPath;
+                if (!GetMaterialTexturePath(material, texType, texPath))
+                    continue;
+                if (std::string(texPath.C_Str()).rfind("*") != std::string::npos)
+                    continue;// embedded
 
-                if(texture_file.length > 0)
-                    eng->textureBank->add(Texture(checkFilepath(std::string(texture_file.C_Str()), directory), directory));
+                std::string fpath = checkFilepath(getDirectory(filepath) + std::string(texPath.data), directory);
+                if (std::filesystem::is_regular_file(fpath))
+                    GetTexture(fpath);
             }
         }
+        waitForTextureThreadsToFinish();
     }
     void ASSIMPreader::ImportMaterialTextures(aiMaterial* mMaterial, std::shared_ptr<Material> material){
 
         bool usePBR = extension == ".gltf" || extension == ".glb";// this type of model will use PBR workflow textures.
-        bool hMapToNormal = extension == ".obj"; // for whatever reason, ASSIMP registers obj normal maps as 'height maps'
 
         for (int i = 1; i <= int(aiTextureType_UNKNOWN); i++){
             aiTextureType texType = aiTextureType(i);
-            unsigned int useChannel = 0;
             aiString texPath;
-            // Check to see if this texture type is present in the material. If this isn't a valid file (ie getExtension finds no file extension), skip.
-            if (!(mMaterial->GetTexture(aiTextureType(texType), 0, &texPath) == AI_SUCCESS))
+            if (!GetMaterialTexturePath(mMaterial, texType, texPath))
                 continue;
 
-
-            // Interpret material texture data according to filetype.
-            if (usePBR && ((texType == aiTextureType_DIFFUSE ||
-                texType == aiTextureType_BASE_COLOR) && mMaterial->Get(AI_MATKEY_TEXTURE(
-                    aiTextureType_DIFFUSE, 1), texPath) == AI_SUCCESS)) {
-                texType = aiTextureType_BASE_COLOR;
-            }
-            else if (texType == aiTextureType_HEIGHT && hMapToNormal)
-                texType = aiTextureType_NORMALS;
-
             // Check if this is a reference to an embedded texture. If so, find the necessary texture in the scene array. If not, load normally.
             if (std::string(texPath.C_Str()).rfind("*") != std::string::npos) {
                 for (int n = 0; n < embedded_textures.size(); ++n) {
@@ -256,91 +336,286 @@ namespace TDModelView
                 if (!std::filesystem::is_regular_file(fpath))
                     continue;
 
-                if (!eng->textureBank->exists(fpath))                
-                    eng->textureBank->add(Texture(fpath,directory));                                                   
-
-                material->AddTexture(eng->textureBank->getPtr(fpath), texType);
+                std::shared_ptr<Texture> tx = GetTexture(fpath);
+                if (tx == nullptr)
+                    continue;
+                material->AddTexture(tx, texType);
                 if (usePBR && texType == aiTextureType_UNKNOWN)
                 {
                     if(!material->HasTexture(aiTextureType_DIFFUSE_ROUGHNESS))
-                        material->AddTexture(eng->textureBank->getPtr(fpath), aiTextureType_DIFFUSE_ROUGHNESS);
+                        material->AddTexture(tx, aiTextureType_DIFFUSE_ROUGHNESS);
                     if (!material->HasTexture(aiTextureType_AMBIENT_OCCLUSION))
-                        material->AddTexture(eng->textureBank->getPtr(fpath), aiTextureType_AMBIENT_OCCLUSION);
+                        material->AddTexture(tx, aiTextureType_AMBIENT_OCCLUSION);
                     if (!material->HasTexture(aiTextureType_METALNESS))
-                        material->AddTexture(eng->textureBank->getPtr(fpath), aiTextureType_METALNESS);
+                        material->AddTexture(tx, aiTextureType_METALNESS);
                 }
             }
         }
     }
+    void ASSIMPreader::waitForTextureThreadsToFinish(){
+        // Join all decode tasks. Files that failed to decode are dropped from the cache and from any material that
+        // already references them, so they're never bound.
+        std::unordered_set<Texture*> failed;
+        for (unsigned int i = 0; i < texture_tasks.size(); ++i){
+            bool decoded = false;
+            try {
+                decoded = eng->threadPool->wait(texture_tasks[i]);
+            }
+            catch (std::exception e1) {
+                ErrorMessageBox("ERROR! Could not decode texture " + texture_load_data[i]->filepath + ". " + std::string(e1.what()));
+            }
+            if (!decoded) {
+                texture_cache[texture_load_data[i]->filepath] = nullptr;
+                failed.insert(texture_load_data[i].get());
+            }
+        }
+        texture_tasks.clear();
+        texture_load_data.clear();
+
+        if (scene == nullptr || failed.empty())
+            return;
+        for (auto& m : scene->materials) {
+            for (auto& t : m->textures) {
+                if (failed.count(t.get()))
+                    t = nullptr;
+            }
+        }
+    }
     void ASSIMPreader::waitForMeshThreadsToFinish(){
-        this->scene->meshes.resize(mesh_load_data.size());
-        for (auto it = mesh_load_data.begin(); it != mesh_load_data.end(); ++it){
-            this->scene->meshes[it->first] = it->second;
+        // Join all import tasks, helping to run queued work on this thread while waiting.
+        for (unsigned int i = 0; i < mesh_tasks.size(); ++i){
+            try {
+                eng->threadPool->wait(mesh_tasks[i]);
+            }
+            catch (std::exception e1) {
+                ErrorMessageBox("ERROR! Could not import mesh " + std::to_string(i) + ". " + std::string(e1.what()));
+            }
+        }
+        mesh_tasks.clear();
+
+        this->scene->meshes.clear();
+        this->scene->meshes.reserve(mesh_load_data.size());
+        for (auto& m : mesh_load_data){
+            if (m != nullptr)
+                this->scene->meshes.push_back(m);
         }
+        mesh_load_data.clear();
     }
-    void ASSIMPreader::ImportScene(){
-        checkError(std::string("Before importing scene: ") + filepath);
-        WriteToLogFile("Loading model " + this->filepath);
+    bool ASSIMPreader::ImportScene(){
         scene = std::make_shared<Scene>();
         scene->materials.clear();
 
         // Do importing.
+        loader->setStage(LoadStage::TEXTURES);
         ImportTextures();
+        if (loader->isCancelled())
+            return false;
+        loader->setStage(LoadStage::MATERIALS);
         ImportMaterials();
+        if (loader->isCancelled())
+            return false;
+        loader->setStage(LoadStage::MESHES);
         ImportMeshes();
         waitForMeshThreadsToFinish();
+        if (loader->isCancelled())
+            return false;
 
         // Do final sanity checks.
-        if (scene->meshes.size() != aiscene->mNumMeshes)
+        if (scene->meshes.size() != meshes_requested)
             ErrorMessageBox("ERROR! Meshes not loaded properly.");
         if (scene->materials.size() != aiscene->mNumMaterials)
             ErrorMessageBox("ERROR! Materials not loaded properly.");
 
-#ifdef _DEBUG
-        checkError(std::string("After importing scene: ") + filepath);
-#endif
-        WriteToLogFile("Finished loading model file");
+        WriteToLogFile("Finished loading model file (" + std::to_string(arena.bytesUsed() / (1024 * 1024)) +
+            " MB of mesh data in " + std::to_string(arena.numBlocks()) + " arena blocks)");
+        return true;
+    }
+    void ASSIMPreader::OptimizeMeshes(){
+        std::vector<size_t> before(scene->meshes.size(), 0), after(scene->meshes.size(), 0), tris(scene->meshes.size(), 0);
+        std::vector<std::future<void>> tasks;
+        for (size_t i = 0; i < scene->meshes.size(); ++i) {
+            tasks.push_back(eng->threadPool->submit([this, i, &before, &after, &tris]() {
+                if (!loader->isCancelled())
+                    tris[i] = scene->meshes[i]->optimize(reduceOverdraw, before[i], after[i]);
+            }));
+        }
+        for (auto& t : tasks)
+            eng->threadPool->wait(t);
+
+        for (size_t i = 0; i < scene->meshes.size(); ++i) {
+            scene->cacheMissesBefore += before[i];
+            scene->cacheMissesAfter += after[i];
+            scene->optimizedTriangles += (unsigned int)tris[i];
+        }
+        if (scene->optimizedTriangles > 0)
+            WriteToLogFile("Vertex cache ACMR " + std::to_string(float(scene->cacheMissesBefore) / scene->optimizedTriangles) +
+                " -> " + std::to_string(float(scene->cacheMissesAfter) / scene->optimizedTriangles));
     }
-    ASSIMPreader::ASSIMPreader(std::string filepath){
-        eng->scene->clear();
+    void ASSIMPreader::SplitLargeMeshes(){
+        std::vector<std::shared_ptr<Mesh>> meshes;
+        meshes.reserve(scene->meshes.size());
+        size_t splitCount = 0;
+        for (auto& m : scene->meshes) {
+            std::vector<std::shared_ptr<Mesh>> chunks = m->splitForShortIndices();
+            if (chunks.empty()) {
+                meshes.push_back(m);
+                continue;
+            }
+            meshes.insert(meshes.end(), chunks.begin(), chunks.end());
+            splitCount++;
+        }
+        if (splitCount > 0)
+            WriteToLogFile("Split " + std::to_string(splitCount) + " meshes into 16-bit indexed chunks (" +
+                std::to_string(scene->meshes.size()) + " -> " + std::to_string(meshes.size()) + " meshes)");
+        scene->meshes.swap(meshes);
+    }
+    void ASSIMPreader::GenerateLODs(){
+        // Four halvings take a mesh down to 1/16 of its triangles. The error cap keeps the coarsest levels from
+        // losing the mesh's shape; they are only drawn when it covers a few pixels anyway.
+        static const size_t MAX_LOD_LEVELS = 4;
+        static const float MAX_LOD_ERROR = 0.05f;
+        std::vector<size_t> levels(scene->meshes.size(), 0);
+        std::vector<std::future<void>> tasks;
+        for (size_t i = 0; i < scene->meshes.size(); ++i) {
+            tasks.push_back(eng->threadPool->submit([this, i, &levels]() {
+                if (!loader->isCancelled())
+                    levels[i] = scene->meshes[i]->buildLODs(MAX_LOD_LEVELS, MAX_LOD_ERROR);
+            }));
+        }
+        for (auto& t : tasks)
+            eng->threadPool->wait(t);
+
+        for (size_t n : levels) {
+            scene->lodMeshes += n ? 1 : 0;
+            scene->lodLevels += (unsigned int)n;
+        }
+        if (scene->lodMeshes > 0)
+            WriteToLogFile("Built " + std::to_string(scene->lodLevels) + " levels of detail for " +
+                std::to_string(scene->lodMeshes) + " of " + std::to_string(scene->meshes.size()) + " meshes");
+    }
+    void ASSIMPreader::BuildMeshlets(){
+        std::vector<size_t> clusters(scene->meshes.size(), 0), before(scene->meshes.size(), 0), after(scene->meshes.size(), 0);
+        std::vector<std::future<void>> tasks;
+        for (size_t i = 0; i < scene->meshes.size(); ++i) {
+            tasks.push_back(eng->threadPool->submit([this, i, &clusters, &before, &after]() {
+                if (!loader->isCancelled())
+                    clusters[i] = scene->meshes[i]->buildMeshlets(optimizeMeshes, before[i], after[i]);
+            }));
+        }
+        for (auto& t : tasks)
+            eng->threadPool->wait(t);
+
+        size_t split = 0;
+        for (size_t i = 0; i < clusters.size(); ++i) {
+            scene->meshletCount += (unsigned int)clusters[i];
+            split += clusters[i] ? 1 : 0;
+            // Clusters are drawn in their own cache order now, so report that one.
+            scene->cacheMissesAfter += after[i];
+            scene->cacheMissesAfter -= before[i];
+        }
+        if (split > 0)
+            WriteToLogFile("Split " + std::to_string(split) + " meshes into " + std::to_string(scene->meshletCount) + " meshlets");
+        if (optimizeMeshes && split > 0 && scene->optimizedTriangles > 0)
+            WriteToLogFile("Vertex cache ACMR after clustering " +
+                std::to_string(float(scene->cacheMissesAfter) / scene->optimizedTriangles));
+    }
+    ASSIMPreader::ASSIMPreader(std::string filepath, ModelLoader* loader){
         this->filepath = filepath;
+        this->loader = loader;
+        compactVertices = eng->useCompactVertices;
+        keepGeometry = eng->keepGeometry;
+        optimizeMeshes = eng->optimizeMeshes;
+        reduceOverdraw = eng->reduceOverdraw;
+        splitLargeMeshes = eng->splitLargeMeshes;
+        preserveInstances = eng->preserveInstances;
+        generateLODs = eng->generateLODs;
+        buildMeshlets = eng->buildMeshlets;
         directory = getDirectory(filepath);
         extension = getExtension(filepath);
-        Assimp::Importer importer;
-        try {
-            aiscene = (aiScene*)importer.ReadFile(filepath,
-                aiProcess_CalcTangentSpace |
-                aiProcess_JoinIdenticalVertices |
-                aiProcess_Triangulate |
-                aiProcess_GenUVCoords | 
-                aiProcess_SortByPType |
-                aiProcess_FixInfacingNormals |
-                aiProcess_PreTransformVertices |
-                aiProcess_TransformUVCoords |
-                aiProcess_FindDegenerates | 
-                aiProcess_GenNormals
-                //aiProcess_GenSmoothNormals
-            );
-        }
-        catch (std::exception e1) {
-            ErrorMessageBox("ERROR! Could not load file. " + std::string(e1.what()));
-        }
-        if (!aiscene) {
-            ErrorMessageBox("ERROR! Could not load file. " + std::string(importer.GetErrorString()));
-            return;
+        flags = aiProcess_CalcTangentSpace |
+            aiProcess_JoinIdenticalVertices |
+            aiProcess_Triangulate |
+            aiProcess_GenUVCoords |
+            aiProcess_SortByPType |
+            aiProcess_FixInfacingNormals |
+            aiProcess_TransformUVCoords |
+            aiProcess_FindDegenerates |
+            aiProcess_GenNormals;
+            //aiProcess_GenSmoothNormals
+        if (!preserveInstances)
+            flags |= aiProcess_PreTransformVertices;
+    }
+    bool ASSIMPreader::Import(){
+        WriteToLogFile("Loading model " + this->filepath);
+        loader->setStage(LoadStage::PARSING);
+
+        // Skip Assimp entirely if this exact file has been imported with the same flags before.
+        SceneCache cache(filepath, flags);
+        if (eng->useModelCache) {
+            scene = cache.load([this](const std::string& fpath) { return GetTexture(fpath); });
+            waitForTextureThreadsToFinish();
+        }
+
+        if (scene == nullptr) {
+            Assimp::Importer importer;
+            importer.SetProgressHandler(new ImportProgressHandler(loader));// importer takes ownership
+            try {
+                aiscene = (aiScene*)importer.ReadFile(filepath, flags);
+            }
+            catch (std::exception e1) {
+                ErrorMessageBox("ERROR! Could not load file. " + std::string(e1.what()));
+            }
+            if (!aiscene) {
+                if (!loader->isCancelled())
+                    ErrorMessageBox("ERROR! Could not load file. " + std::string(importer.GetErrorString()));
+                return false;
+            }
+            bool imported = ImportScene();
+            try {
+                importer.FreeScene();
+                aiscene = nullptr;
+            }
+            catch (std::exception e1) {
+                ErrorMessageBox("ERROR! Could not free aiScene. " + std::string(e1.what()));
+            }
+            if (!imported)
+                return false;
+            if (eng->useModelCache)
+                cache.save(scene);
         }
-        ImportScene();
-        try {
-            importer.FreeScene();     
-            eng->scene->copyToOutput(this->scene);
-            eng->scene->m_Camera.position = eng->scene->bbox.center();
-            eng->scene->m_Camera.position.z -= (eng->scene->bbox.extent().z * 2.5f);
-            eng->scene->m_Camera.movementSpeed = glm::length(eng->scene->bbox.extent()) * 0.25f;
-            eng->scene->m_Camera.Update();
-            glfwSetWindowTitle(eng->window, getFilename(filepath).c_str());
+        if (loader->isCancelled())
+            return false;
+
+        // Hand finished meshes to the GL thread, which uploads them a batch at a time.
+        scene->normalize();
+        if (optimizeMeshes)
+            OptimizeMeshes();
+        if (splitLargeMeshes)
+            SplitLargeMeshes();
+        if (generateLODs)
+            GenerateLODs();
+        if (buildMeshlets)
+            BuildMeshlets();
+
+        // Spill the final geometry to a mapped file before it's uploaded, since Mesh::Load() discards the vectors.
+        if (keepGeometry) {
+            std::shared_ptr<GeometryStore> store = std::make_shared<GeometryStore>(filepath);
+            std::vector<int> ids;
+            for (auto& m : scene->meshes)
+                ids.push_back(m->WriteTo(*store));
+            if (store->finalize()) {
+                for (size_t i = 0; i < scene->meshes.size(); ++i) {
+                    scene->meshes[i]->store = ids[i] >= 0 ? store : nullptr;
+                    scene->meshes[i]->storeIndex = ids[i];
+                }
+                scene->geometry = store;
+            }
         }
-        catch (std::exception e1) {
-            ErrorMessageBox("ERROR! Could not free aiScene. " + std::string(e1.what()));
+        loader->setStage(LoadStage::UPLOADING);
+        for (auto& m : scene->meshes) {
+            m->compact = compactVertices;
+            loader->queueMesh(m);
         }
+        return true;
     }
-}
\ No newline at end of file
+}
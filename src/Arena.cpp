@@ -0,0 +1,29 @@
+#include "Arena.hpp"
+
+namespace TDModelView
+{
+	void* Arena::allocate(size_t bytes, size_t alignment)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t pad = (alignment - (uintptr_t(head) & (alignment - 1))) & (alignment - 1);
+		if (head == nullptr || pad + bytes > remaining) {
+			// Oversized requests get a block of their own so the current block's tail isn't wasted.
+			size_t size = bytes + alignment > blockSize ? bytes + alignment : blockSize;
+			blocks.push_back(std::unique_ptr<uint8_t[]>(new uint8_t[size]));
+			reserved += size;
+			uint8_t* block = blocks.back().get();
+			pad = (alignment - (uintptr_t(block) & (alignment - 1))) & (alignment - 1);
+			if (size != blockSize) {
+				used += bytes;
+				return block + pad;
+			}
+			head = block;
+			remaining = size;
+		}
+		uint8_t* p = head + pad;
+		head += pad + bytes;
+		remaining -= pad + bytes;
+		used += bytes;
+		return p;
+	}
+}
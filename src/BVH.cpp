@@ -0,0 +1,275 @@
+#include "BVH.hpp"
+#include <algorithm>
+#include <limits>
+
+namespace TDModelView
+{
+	static float surfaceArea(const glm::vec3& bboxMin, const glm::vec3& bboxMax)
+	{
+		glm::vec3 e = glm::max(bboxMax - bboxMin, glm::vec3(0.0f));
+		return e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+
+	void BVH::build(const std::vector<glm::vec3>& bboxMin, const std::vector<glm::vec3>& bboxMax)
+	{
+		clear();
+		uint32_t n = (uint32_t)bboxMin.size();
+		if (n == 0)
+			return;
+		boxMin = bboxMin;
+		boxMax = bboxMax;
+		centroid.resize(n);
+		items.resize(n);
+		for (uint32_t i = 0; i < n; ++i) {
+			centroid[i] = (boxMin[i] + boxMax[i]) * 0.5f;
+			items[i] = i;
+		}
+
+		nodes.reserve(2 * n - 1);
+		Node rootNode;
+		rootNode.leftFirst = 0;
+		rootNode.count = n;
+		nodes.push_back(rootNode);
+		updateBounds(0);
+		subdivide(0);
+
+		// Item boxes are kept for exact leaf tests; centroids are only needed while building.
+		std::vector<glm::vec3>().swap(centroid);
+	}
+
+	void BVH::updateBounds(uint32_t n)
+	{
+		Node& node = nodes[n];
+		node.bboxMin = glm::vec3(std::numeric_limits<float>::max());
+		node.bboxMax = glm::vec3(-std::numeric_limits<float>::max());
+		for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; ++i) {
+			node.bboxMin = glm::min(node.bboxMin, boxMin[items[i]]);
+			node.bboxMax = glm::max(node.bboxMax, boxMax[items[i]]);
+		}
+	}
+
+	void BVH::subdivide(uint32_t n)
+	{
+		// Iterative to keep deep, unbalanced trees from overflowing the stack.
+		std::vector<uint32_t> stack;
+		stack.push_back(n);
+		while (!stack.empty()) {
+			uint32_t idx = stack.back();
+			stack.pop_back();
+			Node& node = nodes[idx];
+			if (node.count <= MAX_LEAF_ITEMS)
+				continue;
+
+			glm::vec3 cMin(std::numeric_limits<float>::max());
+			glm::vec3 cMax(-std::numeric_limits<float>::max());
+			for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; ++i) {
+				cMin = glm::min(cMin, centroid[items[i]]);
+				cMax = glm::max(cMax, centroid[items[i]]);
+			}
+
+			// Pick the axis and bin boundary with the lowest surface area heuristic cost.
+			int bestAxis = -1;
+			int bestSplit = 0;
+			float bestCost = std::numeric_limits<float>::max();
+			for (int axis = 0; axis < 3; ++axis) {
+				float extent = cMax[axis] - cMin[axis];
+				if (extent <= 0.0f)
+					continue;
+				glm::vec3 binMin[NUM_BINS], binMax[NUM_BINS];
+				uint32_t binCount[NUM_BINS] = { 0 };
+				for (int b = 0; b < NUM_BINS; ++b) {
+					binMin[b] = glm::vec3(std::numeric_limits<float>::max());
+					binMax[b] = glm::vec3(-std::numeric_limits<float>::max());
+				}
+				float scale = NUM_BINS / extent;
+				for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; ++i) {
+					uint32_t item = items[i];
+					int b = std::min(NUM_BINS - 1, (int)((centroid[item][axis] - cMin[axis]) * scale));
+					binCount[b]++;
+					binMin[b] = glm::min(binMin[b], boxMin[item]);
+					binMax[b] = glm::max(binMax[b], boxMax[item]);
+				}
+
+				// Sweep from both ends to get the area and count on each side of every boundary.
+				float leftArea[NUM_BINS - 1], rightArea[NUM_BINS - 1];
+				uint32_t leftCount[NUM_BINS - 1], rightCount[NUM_BINS - 1];
+				glm::vec3 lMin(std::numeric_limits<float>::max()), lMax(-std::numeric_limits<float>::max());
+				glm::vec3 rMin(std::numeric_limits<float>::max()), rMax(-std::numeric_limits<float>::max());
+				uint32_t lSum = 0, rSum = 0;
+				for (int b = 0; b < NUM_BINS - 1; ++b) {
+					lSum += binCount[b];
+					lMin = glm::min(lMin, binMin[b]);
+					lMax = glm::max(lMax, binMax[b]);
+					leftCount[b] = lSum;
+					leftArea[b] = lSum ? surfaceArea(lMin, lMax) : 0.0f;
+					int rb = NUM_BINS - 1 - b;
+					rSum += binCount[rb];
+					rMin = glm::min(rMin, binMin[rb]);
+					rMax = glm::max(rMax, binMax[rb]);
+					rightCount[rb - 1] = rSum;
+					rightArea[rb - 1] = rSum ? surfaceArea(rMin, rMax) : 0.0f;
+				}
+				for (int b = 0; b < NUM_BINS - 1; ++b) {
+					float cost = leftCount[b] * leftArea[b] + rightCount[b] * rightArea[b];
+					if (leftCount[b] && rightCount[b] && cost < bestCost) {
+						bestCost = cost;
+						bestAxis = axis;
+						bestSplit = b;
+					}
+				}
+			}
+			if (bestAxis < 0)
+				continue;// all centroids coincide
+			if (bestCost >= node.count * surfaceArea(node.bboxMin, node.bboxMax) && node.count <= 2 * MAX_LEAF_ITEMS)
+				continue;// splitting doesn't pay off
+
+			// Partition items in place around the chosen boundary.
+			float scale = NUM_BINS / (cMax[bestAxis] - cMin[bestAxis]);
+			uint32_t* first = &items[node.leftFirst];
+			uint32_t* last = first + node.count;
+			uint32_t* mid = std::partition(first, last, [&](uint32_t item) {
+				int b = std::min(NUM_BINS - 1, (int)((centroid[item][bestAxis] - cMin[bestAxis]) * scale));
+				return b <= bestSplit;
+			});
+			uint32_t leftCount = (uint32_t)(mid - first);
+			if (leftCount == 0 || leftCount == node.count)
+				continue;
+
+			uint32_t leftChild = (uint32_t)nodes.size();
+			Node left, right;
+			left.leftFirst = node.leftFirst;
+			left.count = leftCount;
+			right.leftFirst = node.leftFirst + leftCount;
+			right.count = node.count - leftCount;
+			node.leftFirst = leftChild;
+			node.count = 0;
+			nodes.push_back(left);// invalidates 'node'
+			nodes.push_back(right);
+			updateBounds(leftChild);
+			updateBounds(leftChild + 1);
+			stack.push_back(leftChild + 1);
+			stack.push_back(leftChild);
+		}
+	}
+
+	// -1 if the box is outside the frustum, 1 if it's entirely inside, 0 if it straddles a plane.
+	static int classifyBox(const Frustum& frustum, const glm::vec3& bboxMin, const glm::vec3& bboxMax)
+	{
+		glm::vec3 c = (bboxMax + bboxMin) * 0.5f;
+		glm::vec3 e = (bboxMax - bboxMin) * 0.5f;
+		int result = 1;
+		for (int p = 0; p < 6; ++p) {
+			const glm::vec4& pl = frustum.planes[p];
+			float dist = pl.x * c.x + pl.y * c.y + pl.z * c.z + pl.w;
+			float radius = glm::abs(pl.x) * e.x + glm::abs(pl.y) * e.y + glm::abs(pl.z) * e.z;
+			if (dist + radius < 0.0f)
+				return -1;
+			if (dist - radius < 0.0f)
+				result = 0;
+		}
+		return result;
+	}
+
+	unsigned int BVH::cull(const Frustum& frustum, std::vector<uint8_t>& visible) const
+	{
+		std::fill(visible.begin(), visible.end(), 0);
+		if (nodes.empty())
+			return 0;
+
+		// Stack entries carry a flag for subtrees already known to be fully inside, which skip the plane tests.
+		unsigned int count = 0;
+		std::vector<std::pair<uint32_t, bool>> stack;
+		stack.reserve(64);
+		stack.push_back({ 0, false });
+		while (!stack.empty()) {
+			uint32_t idx = stack.back().first;
+			bool inside = stack.back().second;
+			stack.pop_back();
+			const Node& node = nodes[idx];
+			if (!inside) {
+				int c = classifyBox(frustum, node.bboxMin, node.bboxMax);
+				if (c < 0)
+					continue;
+				inside = c > 0;
+			}
+			if (node.isLeaf()) {
+				for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; ++i) {
+					uint32_t item = items[i];
+					if (inside || classifyBox(frustum, boxMin[item], boxMax[item]) >= 0) {
+						visible[item] = 1;
+						count++;
+					}
+				}
+			}
+			else {
+				stack.push_back({ node.leftFirst + 1, inside });
+				stack.push_back({ node.leftFirst, inside });
+			}
+		}
+		return count;
+	}
+
+	// Slab test. Returns the entry distance, or a negative value on a miss.
+	static float intersectBox(const glm::vec3& origin, const glm::vec3& invDir, const glm::vec3& bboxMin, const glm::vec3& bboxMax, float tMax)
+	{
+		glm::vec3 t0 = (bboxMin - origin) * invDir;
+		glm::vec3 t1 = (bboxMax - origin) * invDir;
+		glm::vec3 tNear = glm::min(t0, t1);
+		glm::vec3 tFar = glm::max(t0, t1);
+		float tEnter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+		float tExit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, tMax));
+		return tEnter <= tExit ? tEnter : -1.0f;
+	}
+
+	int BVH::raycast(const glm::vec3& origin, const glm::vec3& dir, float& tHit) const
+	{
+		return raycast(origin, dir, tHit, nullptr);
+	}
+
+	int BVH::raycast(const glm::vec3& origin, const glm::vec3& dir, float& tHit, const ItemTest& intersectItem) const
+	{
+		int hit = -1;
+		tHit = std::numeric_limits<float>::max();
+		if (nodes.empty())
+			return hit;
+		glm::vec3 invDir = 1.0f / dir;
+
+		// Visit the nearer child first and prune anything further away than the best hit so far.
+		std::vector<uint32_t> stack;
+		stack.reserve(64);
+		stack.push_back(0);
+		while (!stack.empty()) {
+			const Node& node = nodes[stack.back()];
+			stack.pop_back();
+			if (intersectBox(origin, invDir, node.bboxMin, node.bboxMax, tHit) < 0.0f)
+				continue;
+			if (node.isLeaf()) {
+				for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; ++i) {
+					float t = intersectBox(origin, invDir, boxMin[items[i]], boxMax[items[i]], tHit);
+					if (t < 0.0f || t >= tHit || (intersectItem && !intersectItem(items[i], t)))
+						continue;
+					if (t < tHit) {
+						tHit = t;
+						hit = (int)items[i];
+					}
+				}
+				continue;
+			}
+			const Node& a = nodes[node.leftFirst];
+			const Node& b = nodes[node.leftFirst + 1];
+			float ta = intersectBox(origin, invDir, a.bboxMin, a.bboxMax, tHit);
+			float tb = intersectBox(origin, invDir, b.bboxMin, b.bboxMax, tHit);
+			if (ta >= 0.0f && tb >= 0.0f && tb < ta) {
+				stack.push_back(node.leftFirst);
+				stack.push_back(node.leftFirst + 1);
+			}
+			else {
+				if (tb >= 0.0f)
+					stack.push_back(node.leftFirst + 1);
+				if (ta >= 0.0f)
+					stack.push_back(node.leftFirst);
+			}
+		}
+		return hit;
+	}
+}
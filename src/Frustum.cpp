@@ -0,0 +1,100 @@
+#include "Frustum.hpp"
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <xmmintrin.h>
+#define FRUSTUM_USE_SSE
+#endif
+
+namespace TDModelView
+{
+	void Frustum::extract(const glm::mat4& VP)
+	{
+		// glm is column-major, so row i of VP is (VP[0][i], VP[1][i], VP[2][i], VP[3][i]).
+		glm::vec4 row0(VP[0][0], VP[1][0], VP[2][0], VP[3][0]);
+		glm::vec4 row1(VP[0][1], VP[1][1], VP[2][1], VP[3][1]);
+		glm::vec4 row2(VP[0][2], VP[1][2], VP[2][2], VP[3][2]);
+		glm::vec4 row3(VP[0][3], VP[1][3], VP[2][3], VP[3][3]);
+		planes[0] = row3 + row0;
+		planes[1] = row3 - row0;
+		planes[2] = row3 + row1;
+		planes[3] = row3 - row1;
+		planes[4] = row3 + row2;
+		planes[5] = row3 - row2;
+	}
+
+	void BoxArray::clear()
+	{
+		cx.clear(); cy.clear(); cz.clear();
+		ex.clear(); ey.clear(); ez.clear();
+	}
+
+	void BoxArray::push(const glm::vec3& bboxMin, const glm::vec3& bboxMax)
+	{
+		glm::vec3 c = (bboxMax + bboxMin) * 0.5f;
+		glm::vec3 e = (bboxMax - bboxMin) * 0.5f;
+		cx.push_back(c.x); cy.push_back(c.y); cz.push_back(c.z);
+		ex.push_back(e.x); ey.push_back(e.y); ez.push_back(e.z);
+	}
+
+	void BoxArray::append(const BoxArray& other)
+	{
+		cx.insert(cx.end(), other.cx.begin(), other.cx.end());
+		cy.insert(cy.end(), other.cy.begin(), other.cy.end());
+		cz.insert(cz.end(), other.cz.begin(), other.cz.end());
+		ex.insert(ex.end(), other.ex.begin(), other.ex.end());
+		ey.insert(ey.end(), other.ey.begin(), other.ey.end());
+		ez.insert(ez.end(), other.ez.begin(), other.ez.end());
+	}
+
+	unsigned int cullBoxes(const Frustum& frustum, const BoxArray& boxes, uint8_t* visible)
+	{
+		return cullBoxes(frustum, boxes, visible, 0, boxes.size());
+	}
+
+	unsigned int cullBoxes(const Frustum& frustum, const BoxArray& boxes, uint8_t* visible, size_t first, size_t count)
+	{
+		// A box is outside if, for any plane, its center is further behind the plane than its projected radius.
+		size_t n = first + count;
+		size_t i = first;
+		unsigned int numVisible = 0;
+#ifdef FRUSTUM_USE_SSE
+		const __m128 signMask = _mm_set1_ps(-0.0f);
+		for (; i + 4 <= n; i += 4) {
+			__m128 cx = _mm_loadu_ps(&boxes.cx[i]);
+			__m128 cy = _mm_loadu_ps(&boxes.cy[i]);
+			__m128 cz = _mm_loadu_ps(&boxes.cz[i]);
+			__m128 ex = _mm_loadu_ps(&boxes.ex[i]);
+			__m128 ey = _mm_loadu_ps(&boxes.ey[i]);
+			__m128 ez = _mm_loadu_ps(&boxes.ez[i]);
+			__m128 outside = _mm_setzero_ps();
+			for (int p = 0; p < 6; ++p) {
+				const glm::vec4& pl = frustum.planes[p];
+				__m128 px = _mm_set1_ps(pl.x);
+				__m128 py = _mm_set1_ps(pl.y);
+				__m128 pz = _mm_set1_ps(pl.z);
+				__m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, cx), _mm_mul_ps(py, cy)),
+					_mm_add_ps(_mm_mul_ps(pz, cz), _mm_set1_ps(pl.w)));
+				__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(signMask, px), ex),
+					_mm_mul_ps(_mm_andnot_ps(signMask, py), ey)), _mm_mul_ps(_mm_andnot_ps(signMask, pz), ez));
+				outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(dist, radius), _mm_setzero_ps()));
+			}
+			int mask = _mm_movemask_ps(outside);
+			for (int k = 0; k < 4; ++k) {
+				visible[i + k] = (mask >> k) & 1 ? 0 : 1;
+				numVisible += visible[i + k];
+			}
+		}
+#endif
+		for (; i < n; ++i) {
+			bool inside = true;
+			for (int p = 0; p < 6 && inside; ++p) {
+				const glm::vec4& pl = frustum.planes[p];
+				float dist = pl.x * boxes.cx[i] + pl.y * boxes.cy[i] + pl.z * boxes.cz[i] + pl.w;
+				float radius = glm::abs(pl.x) * boxes.ex[i] + glm::abs(pl.y) * boxes.ey[i] + glm::abs(pl.z) * boxes.ez[i];
+				inside = dist + radius >= 0.0f;
+			}
+			visible[i] = inside ? 1 : 0;
+			numVisible += visible[i];
+		}
+		return numVisible;
+	}
+}
@@ -0,0 +1,347 @@
+#include "GeometryBuffer.hpp"
+#include "structs.hpp"
+#include <algorithm>
+
+namespace TDModelView
+{
+	static const uint64_t MIN_VERTEX_CAPACITY = 1 << 16;
+	static const uint64_t MIN_INDEX_CAPACITY = 1 << 18;// words
+	static const uint64_t MIN_INSTANCE_CAPACITY = 1 << 10;
+	static const GLsizei INSTANCE_STRIDE = 16 * sizeof(float);
+
+	static GLsizei vertexStride(VertexFormat format)
+	{
+		return format == VertexFormat::COMPACT ? sizeof(PackedVertex) : sizeof(Vertex);
+	}
+
+	// Capacity for a buffer that has to fit 'size' more units. Grows by half so streaming a model in resizes rarely.
+	static uint64_t grownCapacity(const RangeAllocator& r, uint64_t size, uint64_t minimum)
+	{
+		return std::max({ r.capacity() + r.capacity() / 2, r.used() + size, minimum });
+	}
+
+	// A live range to be moved by packRanges(), in the units of its buffer.
+	struct MovedRange
+	{
+		uint64_t offset;
+		uint64_t length;
+		GeometryBuffer::Allocation* owner;
+	};
+
+	// Copy 'ranges' from buffer 'from' into 'to', packed from the start in their current order, and update each
+	// range's offset to where it ended up. Runs that are already contiguous are moved with a single copy. Returns the
+	// number of units now in use.
+	static uint64_t packRanges(GLuint from, GLuint to, std::vector<MovedRange>& ranges, uint64_t unit)
+	{
+		std::sort(ranges.begin(), ranges.end(), [](const MovedRange& a, const MovedRange& b) { return a.offset < b.offset; });
+		uint64_t packed = 0, runSrc = 0, runDst = 0, runLength = 0;
+		for (auto& r : ranges) {
+			if (runLength && r.offset != runSrc + runLength) {
+				glCopyNamedBufferSubData(from, to, runSrc * unit, runDst * unit, runLength * unit);
+				runLength = 0;
+			}
+			if (!runLength) {
+				runSrc = r.offset;
+				runDst = packed;
+			}
+			runLength += r.length;
+			r.offset = packed;
+			packed += r.length;
+		}
+		if (runLength)
+			glCopyNamedBufferSubData(from, to, runSrc * unit, runDst * unit, runLength * unit);
+		return packed;
+	}
+
+	static GLuint createBuffer(uint64_t bytes)
+	{
+		GLuint buffer = 0;
+		glCreateBuffers(1, &buffer);
+		glNamedBufferData(buffer, bytes, nullptr, GL_STATIC_DRAW);
+		return buffer;
+	}
+
+	void RangeAllocator::reset(uint64_t capacity, uint64_t used)
+	{
+		freeRanges.clear();
+		total = capacity;
+		inUse = used;
+		if (used < capacity)
+			freeRanges[used] = capacity - used;
+	}
+
+	uint64_t RangeAllocator::allocate(uint64_t size)
+	{
+		if (size == 0)
+			return 0;
+		for (auto it = freeRanges.begin(); it != freeRanges.end(); ++it) {
+			if (it->second < size)
+				continue;
+			uint64_t offset = it->first;
+			uint64_t rest = it->second - size;
+			freeRanges.erase(it);
+			if (rest)
+				freeRanges[offset + size] = rest;
+			inUse += size;
+			return offset;
+		}
+		return INVALID;
+	}
+
+	void RangeAllocator::free(uint64_t offset, uint64_t size)
+	{
+		if (size == 0)
+			return;
+		inUse -= size;
+		auto next = freeRanges.lower_bound(offset);
+		if (next != freeRanges.begin()) {
+			auto prev = std::prev(next);
+			if (prev->first + prev->second == offset) {
+				offset = prev->first;
+				size += prev->second;
+				freeRanges.erase(prev);
+			}
+		}
+		if (next != freeRanges.end() && offset + size == next->first) {
+			size += next->second;
+			freeRanges.erase(next);
+		}
+		freeRanges[offset] = size;
+	}
+
+	int GeometryBuffer::add(VertexFormat format, const void* vertices, uint64_t numVertices, const void* indices, uint64_t indexBytes,
+		const float* instances, uint64_t numInstances)
+	{
+		VertexPool& pool = pools[(int)format];
+		GLsizei stride = vertexStride(format);
+		if (!pool.VAO)
+			createVAO(format);
+
+		Allocation a;
+		a.format = format;
+		a.numVertices = numVertices;
+		a.indexBytes = indexBytes;
+		a.numInstances = numInstances;
+		a.live = true;
+		a.firstVertex = pool.ranges.allocate(numVertices);
+		if (a.firstVertex == RangeAllocator::INVALID) {
+			resizeVertices(format, grownCapacity(pool.ranges, numVertices, MIN_VERTEX_CAPACITY));
+			a.firstVertex = pool.ranges.allocate(numVertices);
+		}
+		uint64_t indexWords = (indexBytes + 3) / 4;
+		uint64_t word = indexRanges.allocate(indexWords);
+		if (word == RangeAllocator::INVALID) {
+			resizeIndices(grownCapacity(indexRanges, indexWords, MIN_INDEX_CAPACITY));
+			word = indexRanges.allocate(indexWords);
+		}
+		a.indexOffset = word * 4;
+		a.firstInstance = instanceRanges.allocate(numInstances);
+		if (a.firstInstance == RangeAllocator::INVALID) {
+			resizeInstances(grownCapacity(instanceRanges, numInstances, MIN_INSTANCE_CAPACITY));
+			a.firstInstance = instanceRanges.allocate(numInstances);
+		}
+
+		if (numVertices)
+			glNamedBufferSubData(pool.VBO, a.firstVertex * stride, numVertices * stride, vertices);
+		if (indexBytes)
+			glNamedBufferSubData(EBO, a.indexOffset, indexBytes, indices);
+		if (numInstances)
+			glNamedBufferSubData(instanceBuffer, a.firstInstance * INSTANCE_STRIDE, numInstances * INSTANCE_STRIDE, instances);
+
+		int handle = 0;
+		if (freeHandles.size()) {
+			handle = freeHandles.back();
+			freeHandles.pop_back();
+			allocations[handle] = a;
+		}
+		else {
+			handle = (int)allocations.size();
+			allocations.push_back(a);
+		}
+		liveCount++;
+		return handle;
+	}
+
+	void GeometryBuffer::free(int handle)
+	{
+		if (handle < 0 || handle >= (int)allocations.size() || !allocations[handle].live)
+			return;
+		Allocation& a = allocations[handle];
+		pools[(int)a.format].ranges.free(a.firstVertex, a.numVertices);
+		indexRanges.free(a.indexOffset / 4, (a.indexBytes + 3) / 4);
+		instanceRanges.free(a.firstInstance, a.numInstances);
+		a.live = false;
+		freeHandles.push_back(handle);
+		// Nothing left to draw, so hand the memory back rather than keeping the last model's high-water mark.
+		if (--liveCount == 0)
+			release();
+	}
+
+	void GeometryBuffer::reserve(VertexFormat format, uint64_t numVertices, uint64_t indexBytes)
+	{
+		VertexPool& pool = pools[(int)format];
+		if (!pool.VAO)
+			createVAO(format);
+		if (pool.ranges.used() + numVertices > pool.ranges.capacity())
+			resizeVertices(format, std::max(pool.ranges.used() + numVertices, MIN_VERTEX_CAPACITY));
+		uint64_t indexWords = (indexBytes + 3) / 4;
+		if (indexRanges.used() + indexWords > indexRanges.capacity())
+			resizeIndices(std::max(indexRanges.used() + indexWords, MIN_INDEX_CAPACITY));
+	}
+
+	void GeometryBuffer::compact()
+	{
+		for (int f = 0; f < (int)VertexFormat::COUNT; ++f) {
+			const RangeAllocator& r = pools[f].ranges;
+			if (r.capacity() > MIN_VERTEX_CAPACITY && r.used() < r.capacity() / 2) {
+				resizeVertices(VertexFormat(f), std::max(r.used() + r.used() / 2, MIN_VERTEX_CAPACITY));
+				numCompactions++;
+			}
+		}
+		if (indexRanges.capacity() > MIN_INDEX_CAPACITY && indexRanges.used() < indexRanges.capacity() / 2) {
+			resizeIndices(std::max(indexRanges.used() + indexRanges.used() / 2, MIN_INDEX_CAPACITY));
+			numCompactions++;
+		}
+		if (instanceRanges.capacity() > MIN_INSTANCE_CAPACITY && instanceRanges.used() < instanceRanges.capacity() / 2) {
+			resizeInstances(std::max(instanceRanges.used() + instanceRanges.used() / 2, MIN_INSTANCE_CAPACITY));
+			numCompactions++;
+		}
+	}
+
+	void GeometryBuffer::release()
+	{
+		for (auto& pool : pools) {
+			if (pool.VAO)
+				glDeleteVertexArrays(1, &pool.VAO);
+			if (pool.VBO)
+				glDeleteBuffers(1, &pool.VBO);
+			pool.VAO = pool.VBO = 0;
+			pool.ranges.reset(0);
+		}
+		if (EBO)
+			glDeleteBuffers(1, &EBO);
+		if (instanceBuffer)
+			glDeleteBuffers(1, &instanceBuffer);
+		EBO = instanceBuffer = 0;
+		indexRanges.reset(0);
+		instanceRanges.reset(0);
+		allocations.clear();
+		freeHandles.clear();
+		liveCount = 0;
+	}
+
+	size_t GeometryBuffer::capacityBytes() const
+	{
+		size_t bytes = indexRanges.capacity() * 4 + instanceRanges.capacity() * INSTANCE_STRIDE;
+		for (int f = 0; f < (int)VertexFormat::COUNT; ++f)
+			bytes += pools[f].ranges.capacity() * vertexStride(VertexFormat(f));
+		return bytes;
+	}
+
+	size_t GeometryBuffer::usedBytes() const
+	{
+		size_t bytes = indexRanges.used() * 4 + instanceRanges.used() * INSTANCE_STRIDE;
+		for (int f = 0; f < (int)VertexFormat::COUNT; ++f)
+			bytes += pools[f].ranges.used() * vertexStride(VertexFormat(f));
+		return bytes;
+	}
+
+	void GeometryBuffer::createVAO(VertexFormat format)
+	{
+		// Every draw reads an instance transform, even ones the shader then ignores, so binding 1 always needs a buffer.
+		if (!instanceBuffer)
+			resizeInstances(MIN_INSTANCE_CAPACITY);
+		GLuint& VAO = pools[(int)format].VAO;
+		glCreateVertexArrays(1, &VAO);
+		auto attribute = [VAO](GLuint index, GLint size, GLenum type, GLboolean normalized, size_t offset, GLuint binding) {
+			glEnableVertexArrayAttrib(VAO, index);
+			glVertexArrayAttribFormat(VAO, index, size, type, normalized, (GLuint)offset);
+			glVertexArrayAttribBinding(VAO, index, binding);
+		};
+		if (format == VertexFormat::COMPACT) {
+			attribute(0, 4, GL_UNSIGNED_SHORT, GL_TRUE, offsetof(PackedVertex, position), 0);
+			attribute(1, 2, GL_HALF_FLOAT, GL_FALSE, offsetof(PackedVertex, uv), 0);
+			attribute(2, 2, GL_SHORT, GL_TRUE, offsetof(PackedVertex, normal), 0);
+			attribute(3, 2, GL_SHORT, GL_TRUE, offsetof(PackedVertex, tangent), 0);
+		}
+		else {
+			attribute(0, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, position), 0);
+			attribute(1, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, uv), 0);
+			attribute(2, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, normal), 0);
+			attribute(3, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, tangent), 0);
+			attribute(4, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, bitangent), 0);
+		}
+		for (GLuint c = 0; c < 4; ++c)
+			attribute(5 + c, 4, GL_FLOAT, GL_FALSE, c * 4 * sizeof(float), 1);
+		glVertexArrayBindingDivisor(VAO, 1, 1);
+		glVertexArrayVertexBuffer(VAO, 1, instanceBuffer, 0, INSTANCE_STRIDE);
+		if (pools[(int)format].VBO)
+			glVertexArrayVertexBuffer(VAO, 0, pools[(int)format].VBO, 0, vertexStride(format));
+		if (EBO)
+			glVertexArrayElementBuffer(VAO, EBO);
+	}
+
+	void GeometryBuffer::resizeVertices(VertexFormat format, uint64_t capacity)
+	{
+		VertexPool& pool = pools[(int)format];
+		GLsizei stride = vertexStride(format);
+		std::vector<MovedRange> ranges;
+		for (auto& a : allocations)
+			if (a.live && a.format == format && a.numVertices)
+				ranges.push_back({ a.firstVertex, a.numVertices, &a });
+		GLuint buffer = createBuffer(capacity * stride);
+		uint64_t packed = packRanges(pool.VBO, buffer, ranges, stride);
+		for (auto& r : ranges)
+			r.owner->firstVertex = r.offset;
+
+		if (pool.VBO)
+			glDeleteBuffers(1, &pool.VBO);
+		pool.VBO = buffer;
+		pool.ranges.reset(capacity, packed);
+		layoutRevision++;
+		if (pool.VAO)
+			glVertexArrayVertexBuffer(pool.VAO, 0, pool.VBO, 0, stride);
+	}
+
+	void GeometryBuffer::resizeIndices(uint64_t capacity)
+	{
+		std::vector<MovedRange> ranges;
+		for (auto& a : allocations)
+			if (a.live && a.indexBytes)
+				ranges.push_back({ a.indexOffset / 4, (a.indexBytes + 3) / 4, &a });
+		GLuint buffer = createBuffer(capacity * 4);
+		uint64_t packed = packRanges(EBO, buffer, ranges, 4);
+		for (auto& r : ranges)
+			r.owner->indexOffset = r.offset * 4;
+
+		if (EBO)
+			glDeleteBuffers(1, &EBO);
+		EBO = buffer;
+		indexRanges.reset(capacity, packed);
+		layoutRevision++;
+		for (auto& pool : pools)
+			if (pool.VAO)
+				glVertexArrayElementBuffer(pool.VAO, EBO);
+	}
+
+	void GeometryBuffer::resizeInstances(uint64_t capacity)
+	{
+		std::vector<MovedRange> ranges;
+		for (auto& a : allocations)
+			if (a.live && a.numInstances)
+				ranges.push_back({ a.firstInstance, a.numInstances, &a });
+		GLuint buffer = createBuffer(capacity * INSTANCE_STRIDE);
+		uint64_t packed = packRanges(instanceBuffer, buffer, ranges, INSTANCE_STRIDE);
+		for (auto& r : ranges)
+			r.owner->firstInstance = r.offset;
+
+		if (instanceBuffer)
+			glDeleteBuffers(1, &instanceBuffer);
+		instanceBuffer = buffer;
+		instanceRanges.reset(capacity, packed);
+		layoutRevision++;
+		for (auto& pool : pools)
+			if (pool.VAO)
+				glVertexArrayVertexBuffer(pool.VAO, 1, instanceBuffer, 0, INSTANCE_STRIDE);
+	}
+}
@@ -0,0 +1,77 @@
+#include "GeometryStore.hpp"
+#include "structs.hpp"
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <sstream>
+
+namespace TDModelView
+{
+	static const uint64_t STORE_ALIGNMENT = 16;
+
+	GeometryStore::GeometryStore(const std::string& name)
+	{
+		static std::atomic<unsigned int> counter{ 0 };
+		std::error_code ec;
+		std::filesystem::path dir = std::filesystem::temp_directory_path(ec);
+		if (ec)
+			dir = std::filesystem::path(eng->working_directory);
+		std::stringstream ss;
+		ss << "tdmv_" << getFilename(name) << "_" << std::hex
+			<< std::chrono::steady_clock::now().time_since_epoch().count() << "_" << counter++ << ".geom";
+		filepath = (dir / ss.str()).string();
+		out.open(filepath, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!out.is_open())
+			WriteToLogFile("Could not create geometry store " + filepath);
+	}
+
+	GeometryStore::~GeometryStore()
+	{
+		// Unmap before deleting, Windows won't remove a file that is still mapped.
+		file.close();
+		if (out.is_open())
+			out.close();
+		std::error_code ec;
+		std::filesystem::remove(filepath, ec);
+	}
+
+	void GeometryStore::writeAligned(const void* data, uint64_t size)
+	{
+		static const char zeros[STORE_ALIGNMENT] = { 0 };
+		out.write((const char*)data, size);
+		offset += size;
+		uint64_t aligned = (offset + STORE_ALIGNMENT - 1) & ~(STORE_ALIGNMENT - 1);
+		out.write(zeros, aligned - offset);
+		offset = aligned;
+	}
+
+	int GeometryStore::add(const Vertex* vertices, size_t numVertices, const uint32_t* indices, size_t numIndices)
+	{
+		if (!out.is_open() || !out.good())
+			return -1;
+		Range r;
+		r.numVertices = (uint32_t)numVertices;
+		r.numIndices = (uint32_t)numIndices;
+		r.vertexOffset = offset;
+		writeAligned(vertices, numVertices * sizeof(Vertex));
+		r.indexOffset = offset;
+		writeAligned(indices, numIndices * sizeof(uint32_t));
+		if (!out.good())
+			return -1;
+		ranges.push_back(r);
+		return (int)ranges.size() - 1;
+	}
+
+	bool GeometryStore::finalize()
+	{
+		if (!out.is_open())
+			return false;
+		bool ok = out.good();
+		out.close();
+		if (!ok || offset == 0 || !file.open(filepath)) {
+			WriteToLogFile("Could not map geometry store " + filepath);
+			return false;
+		}
+		return true;
+	}
+}
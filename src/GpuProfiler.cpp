@@ -0,0 +1,108 @@
+#include "GpuProfiler.hpp"
+
+namespace TDModelView
+{
+	GLuint GpuProfiler::nextQuery(Frame& f)
+	{
+		if (f.used == f.queries.size()) {
+			GLuint q = 0;
+			glGenQueries(1, &q);
+			f.queries.push_back(q);
+		}
+		return f.queries[f.used++];
+	}
+
+	void GpuProfiler::collect(Frame& f)
+	{
+		// Timestamps land in order, so once the last one is available they all are.
+		GLint available = 0;
+		if (f.last)
+			glGetQueryObjectiv(f.last, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			std::vector<float> total(results.size(), 0.0f);
+			for (auto& m : f.markers) {
+				GLuint64 start = 0, stop = 0;
+				glGetQueryObjectui64v(m.start, GL_QUERY_RESULT, &start);
+				glGetQueryObjectui64v(m.stop, GL_QUERY_RESULT, &stop);
+				total[m.section] += float(double(stop - start) * 1e-6);
+			}
+			// A section may run more than once per frame; smooth the per-frame sum.
+			std::vector<bool> seen(results.size(), false);
+			for (auto& m : f.markers)
+				seen[m.section] = true;
+			for (size_t i = 0; i < results.size(); ++i) {
+				if (!seen[i])
+					continue;
+				results[i].milliseconds = measured[i] ? results[i].milliseconds * 0.9f + total[i] * 0.1f : total[i];
+				measured[i] = true;
+			}
+		}
+		// Anything still unavailable is dropped rather than waited for.
+		f.markers.clear();
+		f.used = 0;
+		f.last = 0;
+		f.pending = false;
+	}
+
+	void GpuProfiler::beginFrame()
+	{
+		Frame& f = frames[current];
+		if (f.pending)
+			collect(f);
+		open.clear();
+	}
+
+	void GpuProfiler::begin(const std::string& name)
+	{
+		int section = -1;
+		for (size_t i = 0; i < results.size() && section < 0; ++i) {
+			if (results[i].name == name)
+				section = (int)i;
+		}
+		if (section < 0) {
+			section = (int)results.size();
+			results.push_back(Section{ name, 0.0f });
+			measured.push_back(false);
+		}
+		Frame& f = frames[current];
+		Marker m = { section, nextQuery(f), 0 };
+		glQueryCounter(m.start, GL_TIMESTAMP);
+		open.push_back((int)f.markers.size());
+		f.markers.push_back(m);
+	}
+
+	void GpuProfiler::end()
+	{
+		if (open.empty())
+			return;
+		Frame& f = frames[current];
+		Marker& m = f.markers[open.back()];
+		open.pop_back();
+		m.stop = nextQuery(f);
+		glQueryCounter(m.stop, GL_TIMESTAMP);
+		f.last = m.stop;
+	}
+
+	void GpuProfiler::endFrame()
+	{
+		while (!open.empty())
+			end();
+		Frame& f = frames[current];
+		f.pending = !f.markers.empty();
+		current = (current + 1) % FRAMES_IN_FLIGHT;
+	}
+
+	void GpuProfiler::release()
+	{
+		for (auto& f : frames) {
+			if (!f.queries.empty())
+				glDeleteQueries((GLsizei)f.queries.size(), f.queries.data());
+			f.queries.clear();
+			f.markers.clear();
+			f.used = 0;
+			f.last = 0;
+			f.pending = false;
+		}
+		open.clear();
+	}
+}
@@ -0,0 +1,248 @@
+#include "MeshOptimizer.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace TDModelView
+{
+	size_t countCacheMisses(const uint32_t* indices, size_t numIndices, size_t numVertices, unsigned int cacheSize)
+	{
+		// cached[v] holds the miss count at which v entered the cache; it has been evicted once that many more
+		// misses have happened.
+		std::vector<size_t> cached(numVertices, 0);
+		size_t misses = 0;
+		for (size_t i = 0; i < numIndices; ++i) {
+			uint32_t v = indices[i];
+			if (cached[v] == 0 || misses - cached[v] >= cacheSize) {
+				misses++;
+				cached[v] = misses;
+			}
+		}
+		return misses;
+	}
+
+	// Forsyth's scoring: vertices near the front of a simulated LRU cache score higher, with the three most recent
+	// slightly penalized so strips don't get stuck, and vertices with few remaining triangles get a boost so they are
+	// finished off rather than left stranded.
+	static const int SCORE_CACHE_SIZE = 32;
+
+	static float vertexScore(int cachePos, unsigned int liveTriangles)
+	{
+		static float cacheScores[SCORE_CACHE_SIZE];
+		static float valenceScores[64];
+		static bool initialized = [] {
+			for (int i = 0; i < SCORE_CACHE_SIZE; ++i)
+				cacheScores[i] = i < 3 ? 0.75f : std::pow(1.0f - float(i - 3) / float(SCORE_CACHE_SIZE - 3), 1.5f);
+			for (int i = 1; i < 64; ++i)
+				valenceScores[i] = 2.0f / std::sqrt(float(i));
+			return true;
+		}();
+		(void)initialized;
+		if (liveTriangles == 0)
+			return -1.0f;
+		float score = cachePos >= 0 ? cacheScores[cachePos] : 0.0f;
+		return score + (liveTriangles < 64 ? valenceScores[liveTriangles] : 2.0f / std::sqrt(float(liveTriangles)));
+	}
+
+	void optimizeVertexCache(uint32_t* indices, size_t numIndices, size_t numVertices)
+	{
+		size_t numTris = numIndices / 3;
+		if (numTris < 2)
+			return;
+
+		// Triangles using each vertex (CSR), shrunk as triangles are emitted.
+		std::vector<uint32_t> liveCount(numVertices, 0);
+		for (size_t i = 0; i < numTris * 3; ++i)
+			liveCount[indices[i]]++;
+		std::vector<uint32_t> adjOffset(numVertices + 1, 0);
+		for (size_t v = 0; v < numVertices; ++v)
+			adjOffset[v + 1] = adjOffset[v] + liveCount[v];
+		std::vector<uint32_t> adj(adjOffset[numVertices]);
+		{
+			std::vector<uint32_t> fill(adjOffset.begin(), adjOffset.end() - 1);
+			for (size_t i = 0; i < numTris * 3; ++i)
+				adj[fill[indices[i]]++] = uint32_t(i / 3);
+		}
+
+		std::vector<int> cachePos(numVertices, -1);
+		std::vector<float> vScore(numVertices);
+		for (size_t v = 0; v < numVertices; ++v)
+			vScore[v] = vertexScore(-1, liveCount[v]);
+		std::vector<float> tScore(numTris);
+		for (size_t t = 0; t < numTris; ++t)
+			tScore[t] = vScore[indices[t * 3]] + vScore[indices[t * 3 + 1]] + vScore[indices[t * 3 + 2]];
+
+		std::vector<uint8_t> emitted(numTris, 0);
+		std::vector<uint32_t> output;
+		output.reserve(numTris * 3);
+		std::vector<uint32_t> cache, newCache;
+		cache.reserve(SCORE_CACHE_SIZE + 3);
+		newCache.reserve(SCORE_CACHE_SIZE + 3);
+		size_t scanPos = 0;
+		int64_t best = -1;
+
+		for (size_t n = 0; n < numTris; ++n) {
+			if (best < 0) {
+				// Dead end: nothing in the cache has triangles left, so continue from the next unused one in input order.
+				while (emitted[scanPos])
+					scanPos++;
+				best = (int64_t)scanPos;
+			}
+			uint32_t t = (uint32_t)best;
+			emitted[t] = 1;
+			const uint32_t* tri = indices + size_t(t) * 3;
+			output.insert(output.end(), tri, tri + 3);
+
+			// Drop the triangle from its vertices' adjacency lists.
+			for (int k = 0; k < 3; ++k) {
+				uint32_t v = tri[k];
+				uint32_t* list = &adj[adjOffset[v]];
+				uint32_t count = liveCount[v];
+				for (uint32_t j = 0; j < count; ++j) {
+					if (list[j] == t) {
+						list[j] = list[count - 1];
+						break;
+					}
+				}
+				liveCount[v]--;
+			}
+
+			// Move the triangle's vertices to the front of the cache.
+			newCache.assign(tri, tri + 3);
+			for (uint32_t v : cache) {
+				if (v != tri[0] && v != tri[1] && v != tri[2])
+					newCache.push_back(v);
+			}
+			for (size_t i = SCORE_CACHE_SIZE; i < newCache.size(); ++i)
+				cachePos[newCache[i]] = -1;
+			// Vertices pushed out still need their scores refreshed below, so keep them in the list for now.
+			for (size_t i = 0; i < newCache.size() && i < (size_t)SCORE_CACHE_SIZE; ++i)
+				cachePos[newCache[i]] = (int)i;
+
+			// Rescore affected vertices and their remaining triangles, and pick the best of those to emit next.
+			best = -1;
+			float bestScore = -1.0f;
+			for (uint32_t v : newCache) {
+				float s = vertexScore(cachePos[v], liveCount[v]);
+				float delta = s - vScore[v];
+				vScore[v] = s;
+				const uint32_t* list = &adj[adjOffset[v]];
+				for (uint32_t j = 0; j < liveCount[v]; ++j) {
+					uint32_t lt = list[j];
+					tScore[lt] += delta;
+					if (tScore[lt] > bestScore) {
+						bestScore = tScore[lt];
+						best = lt;
+					}
+				}
+			}
+			if (newCache.size() > (size_t)SCORE_CACHE_SIZE)
+				newCache.resize(SCORE_CACHE_SIZE);
+			cache.swap(newCache);
+		}
+		std::copy(output.begin(), output.end(), indices);
+	}
+
+	void optimizeOverdraw(uint32_t* indices, size_t numIndices, const float* positions, size_t stride, size_t numVertices)
+	{
+		// Clusters never shorter than this, so the extra cache misses at cluster boundaries stay small.
+		static const size_t MIN_CLUSTER_TRIANGLES = 128;
+		size_t numTris = numIndices / 3;
+		if (numTris < 2 * MIN_CLUSTER_TRIANGLES)
+			return;
+		auto pos = [&](uint32_t v) { return (const float*)((const char*)positions + size_t(v) * stride); };
+
+		// Split where the cache order had to jump: a triangle that misses on all three vertices starts a new cluster.
+		std::vector<size_t> clusterStart{ 0 };
+		{
+			std::vector<size_t> cached(numVertices, 0);
+			size_t misses = 0;
+			for (size_t t = 0; t < numTris; ++t) {
+				int triMisses = 0;
+				for (int k = 0; k < 3; ++k) {
+					uint32_t v = indices[t * 3 + k];
+					if (cached[v] == 0 || misses - cached[v] >= ACMR_CACHE_SIZE) {
+						misses++;
+						cached[v] = misses;
+						triMisses++;
+					}
+				}
+				if (triMisses == 3 && t - clusterStart.back() >= MIN_CLUSTER_TRIANGLES)
+					clusterStart.push_back(t);
+			}
+		}
+		size_t numClusters = clusterStart.size();
+		if (numClusters < 2)
+			return;
+		clusterStart.push_back(numTris);
+
+		// Area-weighted centroid and normal of each cluster and of the whole mesh.
+		std::vector<float> centroid(numClusters * 3, 0.0f), normal(numClusters * 3, 0.0f);
+		float meshCentroid[3] = { 0.0f, 0.0f, 0.0f };
+		float meshArea = 0.0f;
+		for (size_t c = 0; c < numClusters; ++c) {
+			float area = 0.0f;
+			for (size_t t = clusterStart[c]; t < clusterStart[c + 1]; ++t) {
+				const float* a = pos(indices[t * 3]);
+				const float* b = pos(indices[t * 3 + 1]);
+				const float* d = pos(indices[t * 3 + 2]);
+				float e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+				float e2[3] = { d[0] - a[0], d[1] - a[1], d[2] - a[2] };
+				float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+				float w = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+				for (int k = 0; k < 3; ++k) {
+					centroid[c * 3 + k] += (a[k] + b[k] + d[k]) * (w / 3.0f);
+					normal[c * 3 + k] += n[k];
+				}
+				area += w;
+			}
+			for (int k = 0; k < 3; ++k)
+				meshCentroid[k] += centroid[c * 3 + k];
+			if (area > 0.0f) {
+				for (int k = 0; k < 3; ++k)
+					centroid[c * 3 + k] /= area;
+			}
+			meshArea += area;
+		}
+		if (!(meshArea > 0.0f))
+			return;
+		for (int k = 0; k < 3; ++k)
+			meshCentroid[k] /= meshArea;
+
+		// Clusters facing away from the middle of the mesh are likely to occlude the rest, so draw them first.
+		std::vector<float> sortKey(numClusters);
+		for (size_t c = 0; c < numClusters; ++c) {
+			const float* n = &normal[c * 3];
+			float len = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+			float key = 0.0f;
+			for (int k = 0; k < 3; ++k)
+				key += (centroid[c * 3 + k] - meshCentroid[k]) * n[k];
+			sortKey[c] = len > 0.0f ? key / len : 0.0f;
+		}
+		std::vector<uint32_t> order(numClusters);
+		for (size_t c = 0; c < numClusters; ++c)
+			order[c] = (uint32_t)c;
+		std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return sortKey[a] > sortKey[b]; });
+
+		std::vector<uint32_t> output;
+		output.reserve(numTris * 3);
+		for (uint32_t c : order)
+			output.insert(output.end(), indices + clusterStart[c] * 3, indices + clusterStart[c + 1] * 3);
+		std::copy(output.begin(), output.end(), indices);
+	}
+
+	void buildFetchRemap(uint32_t* indices, size_t numIndices, size_t numVertices, std::vector<uint32_t>& remap)
+	{
+		remap.assign(numVertices, UINT32_MAX);
+		uint32_t next = 0;
+		for (size_t i = 0; i < numIndices; ++i) {
+			uint32_t& r = remap[indices[i]];
+			if (r == UINT32_MAX)
+				r = next++;
+			indices[i] = r;
+		}
+		for (size_t v = 0; v < numVertices; ++v) {
+			if (remap[v] == UINT32_MAX)
+				remap[v] = next++;
+		}
+	}
+}
@@ -0,0 +1,194 @@
+#include "Meshlets.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace TDModelView
+{
+	static const float* vertexPosition(const float* positions, size_t stride, uint32_t v)
+	{
+		return (const float*)((const char*)positions + v * stride);
+	}
+
+	// Bounding sphere around the cluster's vertices and the cone of its triangle normals.
+	static void computeBounds(Meshlet& m, const uint32_t* indices, const float* positions, size_t stride)
+	{
+		float lo[3] = { INFINITY, INFINITY, INFINITY }, hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+		for (uint32_t i = 0; i < m.indexCount; ++i) {
+			const float* p = vertexPosition(positions, stride, indices[m.firstIndex + i]);
+			for (int k = 0; k < 3; ++k) {
+				lo[k] = std::min(lo[k], p[k]);
+				hi[k] = std::max(hi[k], p[k]);
+			}
+		}
+		float radius2 = 0.0f;
+		for (int k = 0; k < 3; ++k)
+			m.center[k] = (lo[k] + hi[k]) * 0.5f;
+		for (uint32_t i = 0; i < m.indexCount; ++i) {
+			const float* p = vertexPosition(positions, stride, indices[m.firstIndex + i]);
+			float d[3] = { p[0] - m.center[0], p[1] - m.center[1], p[2] - m.center[2] };
+			radius2 = std::max(radius2, d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+		}
+		m.radius = std::sqrt(radius2);
+
+		// The cone axis is the mean of the unit triangle normals; its spread is the widest angle to any of them.
+		std::vector<float> normals;
+		normals.reserve(m.indexCount);
+		float axis[3] = { 0.0f, 0.0f, 0.0f };
+		for (uint32_t i = 0; i < m.indexCount; i += 3) {
+			const float* a = vertexPosition(positions, stride, indices[m.firstIndex + i]);
+			const float* b = vertexPosition(positions, stride, indices[m.firstIndex + i + 1]);
+			const float* c = vertexPosition(positions, stride, indices[m.firstIndex + i + 2]);
+			float e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+			float e2[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+			float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+			float len = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+			if (len <= 0.0f)
+				continue;
+			for (int k = 0; k < 3; ++k) {
+				normals.push_back(n[k] / len);
+				axis[k] += n[k] / len;
+			}
+		}
+		float len = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+		m.coneCutoff = 1.0f;
+		if (len <= 0.0f) {
+			m.coneAxis[0] = m.coneAxis[1] = 0.0f;
+			m.coneAxis[2] = 1.0f;
+			return;
+		}
+		float minDot = 1.0f;
+		for (int k = 0; k < 3; ++k)
+			m.coneAxis[k] = axis[k] / len;
+		for (size_t i = 0; i < normals.size(); i += 3)
+			minDot = std::min(minDot, normals[i] * m.coneAxis[0] + normals[i + 1] * m.coneAxis[1] + normals[i + 2] * m.coneAxis[2]);
+		// Past about 84 degrees the cone can't reject anything worth the test.
+		if (minDot > 0.1f)
+			m.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+	}
+
+	size_t buildMeshlets(uint32_t* indices, size_t numIndices, const float* positions, size_t stride, size_t numVertices,
+		size_t maxVertices, size_t maxTriangles, std::vector<Meshlet>& meshlets)
+	{
+		meshlets.clear();
+		size_t numTriangles = numIndices / 3;
+		if (numTriangles == 0 || maxVertices < 3 || maxTriangles == 0)
+			return 0;
+
+		// Triangles around each vertex (CSR).
+		std::vector<uint32_t> adjOffset(numVertices + 1, 0), adj(numTriangles * 3);
+		for (size_t i = 0; i < numTriangles * 3; ++i)
+			adjOffset[indices[i] + 1]++;
+		for (size_t v = 0; v < numVertices; ++v)
+			adjOffset[v + 1] += adjOffset[v];
+		{
+			std::vector<uint32_t> fill(adjOffset.begin(), adjOffset.end() - 1);
+			for (size_t i = 0; i < numTriangles * 3; ++i)
+				adj[fill[indices[i]]++] = uint32_t(i / 3);
+		}
+
+		std::vector<uint8_t> emitted(numTriangles, 0);
+		std::vector<uint32_t> clusterOf(numVertices, UINT32_MAX);// last cluster each vertex was added to
+		std::vector<uint32_t> clusterVertices;
+		std::vector<uint32_t> reordered;
+		reordered.reserve(numTriangles * 3);
+		float centroid[3] = { 0.0f, 0.0f, 0.0f };// of the current cluster's vertices
+		uint32_t cluster = 0;
+		size_t nextSeed = 0;
+
+		// The unemitted triangle around 'verts' adding the fewest new vertices to the current cluster, nearest to its
+		// centroid on ties, that still fits. UINT32_MAX if there is none.
+		auto bestAdjacent = [&](const uint32_t* verts, size_t count) {
+			uint32_t best = UINT32_MAX;
+			unsigned int bestNew = 4;
+			float bestDist = INFINITY;
+			for (size_t j = 0; j < count; ++j) {
+				uint32_t v = verts[j];
+				for (uint32_t k = adjOffset[v]; k < adjOffset[v + 1]; ++k) {
+					uint32_t t = adj[k];
+					if (emitted[t])
+						continue;
+					unsigned int added = 0;
+					float c[3] = { 0.0f, 0.0f, 0.0f };
+					for (int e = 0; e < 3; ++e) {
+						uint32_t w = indices[t * 3 + e];
+						added += clusterOf[w] != cluster;
+						const float* p = vertexPosition(positions, stride, w);
+						c[0] += p[0]; c[1] += p[1]; c[2] += p[2];
+					}
+					if (clusterVertices.size() + added > maxVertices || added > bestNew)
+						continue;
+					float d[3] = { c[0] / 3.0f - centroid[0], c[1] / 3.0f - centroid[1], c[2] / 3.0f - centroid[2] };
+					float dist = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+					if (added < bestNew || dist < bestDist) {
+						best = t;
+						bestNew = added;
+						bestDist = dist;
+					}
+				}
+			}
+			return best;
+		};
+
+		size_t clusterTriangles = 0;
+		auto finishCluster = [&]() {
+			if (clusterTriangles) {
+				Meshlet m = {};
+				m.indexCount = uint32_t(clusterTriangles * 3);
+				m.firstIndex = uint32_t(reordered.size()) - m.indexCount;
+				meshlets.push_back(m);
+			}
+			cluster++;
+			clusterTriangles = 0;
+			clusterVertices.clear();
+		};
+
+		uint32_t last = UINT32_MAX;
+		while (reordered.size() < numTriangles * 3) {
+			// Grow from the triangle just added, then from anywhere on the cluster.
+			uint32_t t = UINT32_MAX;
+			if (clusterTriangles < maxTriangles) {
+				if (last != UINT32_MAX)
+					t = bestAdjacent(&indices[last * 3], 3);
+				if (t == UINT32_MAX && !clusterVertices.empty())
+					t = bestAdjacent(clusterVertices.data(), clusterVertices.size());
+			}
+			// Once nothing fits, start the next cluster beside this one so neighbouring clusters are also close in the
+			// index buffer, or at the first unused triangle if this one is closed off.
+			if (t == UINT32_MAX) {
+				std::vector<uint32_t> previous;
+				previous.swap(clusterVertices);
+				finishCluster();
+				if (!previous.empty())
+					t = bestAdjacent(previous.data(), previous.size());
+				if (t == UINT32_MAX) {
+					while (emitted[nextSeed])
+						nextSeed++;
+					t = (uint32_t)nextSeed;
+				}
+				centroid[0] = centroid[1] = centroid[2] = 0.0f;
+			}
+
+			emitted[t] = 1;
+			clusterTriangles++;
+			for (int e = 0; e < 3; ++e) {
+				uint32_t w = indices[t * 3 + e];
+				reordered.push_back(w);
+				if (clusterOf[w] == cluster)
+					continue;
+				clusterOf[w] = cluster;
+				clusterVertices.push_back(w);
+				const float* p = vertexPosition(positions, stride, w);
+				float n = (float)clusterVertices.size();
+				for (int k = 0; k < 3; ++k)
+					centroid[k] += (p[k] - centroid[k]) / n;
+			}
+			last = t;
+		}
+		finishCluster();
+
+		std::copy(reordered.begin(), reordered.end(), indices);
+		for (auto& m : meshlets)
+			computeBounds(m, indices, positions, stride);
+		return meshlets.size();
+	}
+}
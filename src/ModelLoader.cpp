@@ -0,0 +1,225 @@
+#include "ModelLoader.hpp"
+#include "ASSIMPio.hpp"
+
+namespace TDModelView
+{
+	ModelLoader::~ModelLoader()
+	{
+		cancel();
+		join();
+		reader.reset();
+	}
+
+	std::string ModelLoader::stageName() const
+	{
+		switch (stage()) {
+		case LoadStage::PARSING:
+			return "Parsing";
+		case LoadStage::TEXTURES:
+			return "Decoding textures";
+		case LoadStage::MATERIALS:
+			return "Loading materials";
+		case LoadStage::MESHES:
+			return "Converting meshes";
+		case LoadStage::UPLOADING:
+			return "Uploading";
+		case LoadStage::DONE:
+			return "Done";
+		case LoadStage::CANCELLED:
+			return "Cancelled";
+		case LoadStage::FAILED:
+			return "Failed";
+		default:
+			return "";
+		}
+	}
+
+	void ModelLoader::load(std::string filepath)
+	{
+		if (active) {
+			cancel();
+			join();
+			finish();
+		}
+
+		// Hold on to the outgoing model's textures so files shared with the new one aren't decoded again.
+		std::vector<std::shared_ptr<Texture>> previousTextures = eng->textureBank->handles();
+		eng->scene->clear();
+		this->filepath = filepath;
+		cancelRequested = false;
+		workerDone = false;
+		workerFailed = false;
+		materialsAdded = false;
+		queuedMeshes = 0;
+		uploadedMeshes = 0;
+		reservedMeshes = 0;
+		setStage(LoadStage::PARSING);
+		reader = std::make_shared<ASSIMPreader>(filepath, this);
+		reader->retained_textures = previousTextures;
+		active = true;
+		worker = std::thread(&ModelLoader::run, this);
+	}
+
+	void ModelLoader::cancel()
+	{
+		if (active)
+			cancelRequested = true;
+	}
+
+	void ModelLoader::setStage(LoadStage s, float fraction)
+	{
+		currentStage = (int)s;
+		stageProgress = fraction;
+	}
+
+	void ModelLoader::queueTexture(std::shared_ptr<Texture> tx, std::shared_ptr<TextureData> data)
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		pendingTextures.push_back({ tx, data });
+	}
+
+	void ModelLoader::queueMesh(std::shared_ptr<Mesh> mesh)
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		pendingMeshes.push_back(mesh);
+		queuedMeshes++;
+	}
+
+	void ModelLoader::run()
+	{
+		try {
+			if (!reader->Import())
+				workerFailed = true;
+		}
+		catch (std::exception e1) {
+			ErrorMessageBox("ERROR! Could not load file. " + std::string(e1.what()));
+			workerFailed = true;
+		}
+		workerDone = true;
+	}
+
+	void ModelLoader::join()
+	{
+		if (worker.joinable())
+			worker.join();
+	}
+
+	void ModelLoader::update()
+	{
+		if (!active)
+			return;
+
+		// Textures first, so meshes never show up before the maps they reference.
+		int textureBudget = maxTexturesPerFrame;
+		while (textureBudget-- > 0) {
+			PendingTexture pt;
+			{
+				std::lock_guard<std::mutex> lock(queueMutex);
+				if (pendingTextures.empty())
+					break;
+				pt = pendingTextures.front();
+				pendingTextures.pop_front();
+			}
+			if (cancelRequested)
+				continue;
+			pt.texture->upload(*pt.data);
+		}
+
+		// Stream meshes in bounded batches once all queued textures are resident.
+		bool texturesPending = false;
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			texturesPending = !pendingTextures.empty();
+		}
+		if (!texturesPending && !cancelRequested) {
+			// Size the shared GPU buffers for everything queued so far whenever more has arrived, so they grow once
+			// per batch rather than repeatedly while meshes trickle in.
+			std::vector<Mesh*> batch;
+			{
+				std::lock_guard<std::mutex> lock(queueMutex);
+				if (queuedMeshes != reservedMeshes) {
+					for (auto& m : pendingMeshes)
+						batch.push_back(m.get());
+					reservedMeshes = queuedMeshes;
+				}
+			}
+			if (batch.size())
+				eng->scene->reserveMeshes(batch);
+
+			int meshBudget = maxMeshesPerFrame;
+			unsigned int vertexBudget = maxVerticesPerFrame;
+			while (meshBudget > 0 && vertexBudget > 0) {
+				std::shared_ptr<Mesh> mesh;
+				{
+					std::lock_guard<std::mutex> lock(queueMutex);
+					if (pendingMeshes.empty())
+						break;
+					mesh = pendingMeshes.front();
+					pendingMeshes.pop_front();
+				}
+				if (!materialsAdded) {
+					// Materials are complete before the first mesh is queued.
+					for (auto& m : reader->scene->materials)
+						eng->scene->materials.push_back(m);
+					eng->scene->buildMaterialBuffer();
+					materialsAdded = true;
+				}
+				unsigned int nv = mesh->vertexCount();
+				eng->scene->addMesh(mesh);
+				uploadedMeshes++;
+				meshBudget--;
+				vertexBudget = nv >= vertexBudget ? 0 : vertexBudget - nv;
+			}
+			if (stage() == LoadStage::UPLOADING && queuedMeshes > 0)
+				setProgress(float(uploadedMeshes) / float(queuedMeshes));
+#ifdef _DEBUG
+			checkError("After uploading model data: " + filepath);
+#endif
+		}
+
+		if (!workerDone)
+			return;
+		bool queuesEmpty = false;
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			queuesEmpty = pendingTextures.empty() && pendingMeshes.empty();
+		}
+		if (queuesEmpty || cancelRequested || workerFailed)
+			finish();
+	}
+
+	void ModelLoader::finish()
+	{
+		join();
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			pendingTextures.clear();
+			pendingMeshes.clear();
+		}
+
+		if (cancelRequested || workerFailed) {
+			eng->scene->clear();
+			setStage(cancelRequested ? LoadStage::CANCELLED : LoadStage::FAILED);
+			WriteToLogFile((cancelRequested ? "Cancelled loading model " : "Failed loading model ") + filepath);
+		}
+		else {
+			eng->scene->geometry = reader->scene->geometry;
+			eng->scene->cacheMissesBefore = reader->scene->cacheMissesBefore;
+			eng->scene->cacheMissesAfter = reader->scene->cacheMissesAfter;
+			eng->scene->optimizedTriangles = reader->scene->optimizedTriangles;
+			eng->scene->lodMeshes = reader->scene->lodMeshes;
+			eng->scene->lodLevels = reader->scene->lodLevels;
+			eng->scene->meshletCount = reader->scene->meshletCount;
+			eng->scene->buildBVH();
+			eng->scene->recalcBounds();
+			eng->scene->fitCamera(eng->scene->bbox);
+			glfwSetWindowTitle(eng->window, getFilename(filepath).c_str());
+			setStage(LoadStage::DONE, 1.0f);
+			WriteToLogFile("Finished uploading model " + filepath);
+		}
+
+		// The reader is released here on the GL thread, since it may hold the last reference to GL resources.
+		reader.reset();
+		active = false;
+	}
+}
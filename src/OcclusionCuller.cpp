@@ -0,0 +1,336 @@
+#include "OcclusionCuller.hpp"
+#include "structs.hpp"
+#include <algorithm>
+
+namespace TDModelView
+{
+	static const GLuint HIZ_TEXTURE_UNIT = 21;// above the units the renderer binds material and IBL textures to
+	static const GLuint BOUNDS_BINDING = 2;
+	static const GLuint VISIBILITY_BINDING = 3;
+	static const GLuint COMMAND_BINDING = 4;
+	static const GLuint STATS_BINDING = 5;
+
+	// Halve a depth image, keeping the farthest depth of each 2x2 block. The last row and column also take the
+	// leftover texel of an odd source size, so every source texel is covered.
+	static const char* reduceSource =
+		"#version 430\n"
+		"layout(local_size_x = 8, local_size_y = 8) in;\n"
+		"layout(binding = 21) uniform sampler2D source;\n"
+		"layout(r32f, binding = 0) writeonly uniform image2D destination;\n"
+		"uniform int sourceLevel = 0;\n"
+		"uniform ivec2 sourceSize;\n"
+		"void main() {\n"
+		"	ivec2 size = imageSize(destination);\n"
+		"	ivec2 p = ivec2(gl_GlobalInvocationID.xy);\n"
+		"	if (p.x >= size.x || p.y >= size.y)\n"
+		"		return;\n"
+		"	ivec2 first = min(p * 2, sourceSize - 1);\n"
+		"	ivec2 last = min(p * 2 + 1, sourceSize - 1);\n"
+		"	if (p.x == size.x - 1)\n"
+		"		last.x = sourceSize.x - 1;\n"
+		"	if (p.y == size.y - 1)\n"
+		"		last.y = sourceSize.y - 1;\n"
+		"	float depth = 0.0;\n"
+		"	for (int y = first.y; y <= last.y; ++y)\n"
+		"		for (int x = first.x; x <= last.x; ++x)\n"
+		"			depth = max(depth, texelFetch(source, ivec2(x, y), sourceLevel).r);\n"
+		"	imageStore(destination, p, vec4(depth));\n"
+		"}\n";
+
+	// One invocation per draw. Pyramid level L holds depth pixels >> (L + 1), and the level is picked so the box's
+	// screen rectangle spans at most 4x4 of its texels. A 2x2 footprint would do with one level coarser, but those
+	// texels reach far past a large box and rarely let it be culled.
+	static const char* cullSource =
+		"#version 430\n"
+		"layout(local_size_x = 64) in;\n"
+		"struct DrawBounds { vec4 center; vec4 extent; };\n"
+		"layout(std430, binding = 2) readonly buffer BoundsBuffer { DrawBounds bounds[]; };\n"
+		"layout(std430, binding = 3) buffer VisibilityBuffer { uint visible[]; };\n"
+		"layout(std430, binding = 4) buffer CommandBuffer { uint commands[]; };\n"// 5 uints per DrawElementsIndirectCommand
+		"layout(std430, binding = 5) buffer StatsBuffer { uint culled; uint culledTriangles; };\n"
+		"layout(binding = 21) uniform sampler2D hiZ;\n"
+		"uniform mat4 viewProjection;\n"
+		"uniform uint numDraws;\n"
+		"uniform ivec2 depthSize;\n"
+		"uniform int hiZLevels;\n"
+		"uniform bool patchCommands = false;\n"
+		"bool occluded(vec3 c, vec3 e) {\n"
+		"	vec2 ndcMin = vec2(1.0), ndcMax = vec2(-1.0);\n"
+		"	float zMin = 1.0;\n"
+		"	for (int i = 0; i < 8; ++i) {\n"
+		"		vec3 s = vec3((i & 1) != 0 ? 1.0 : -1.0, (i & 2) != 0 ? 1.0 : -1.0, (i & 4) != 0 ? 1.0 : -1.0);\n"
+		"		vec4 p = viewProjection * vec4(c + e * s, 1.0);\n"
+		"		if (p.w <= 1e-5)\n"
+		"			return false;\n"// reaches behind the camera
+		"		vec3 ndc = p.xyz / p.w;\n"
+		"		ndcMin = min(ndcMin, ndc.xy);\n"
+		"		ndcMax = max(ndcMax, ndc.xy);\n"
+		"		zMin = min(zMin, ndc.z);\n"
+		"	}\n"
+		"	ivec2 pMin = min(ivec2(clamp(ndcMin * 0.5 + 0.5, 0.0, 1.0) * vec2(depthSize)), depthSize - 1);\n"
+		"	ivec2 pMax = min(ivec2(clamp(ndcMax * 0.5 + 0.5, 0.0, 1.0) * vec2(depthSize)), depthSize - 1);\n"
+		"	ivec2 d = pMax - pMin;\n"
+		"	int level = clamp(findMSB(max(d.x, d.y)) - 1, 0, hiZLevels - 1);\n"
+		"	ivec2 size = max(textureSize(hiZ, 0) >> level, ivec2(1));\n"// textureSize() with a per-invocation lod is wrong on llvmpipe
+		"	ivec2 a = min(pMin >> (level + 1), size - 1);\n"
+		"	ivec2 b = min(pMax >> (level + 1), size - 1);\n"
+		"	float nearest = max(zMin, -1.0) * 0.5 + 0.5;\n"
+		"	for (int y = a.y; y <= b.y; ++y)\n"
+		"		for (int x = a.x; x <= b.x; ++x)\n"
+		"			if (nearest <= texelFetch(hiZ, ivec2(x, y), level).r)\n"
+		"				return false;\n"
+		"	return true;\n"
+		"}\n"
+		"void main() {\n"
+		"	uint i = gl_GlobalInvocationID.x;\n"
+		"	if (i >= numDraws || visible[i] == 0u)\n"
+		"		return;\n"
+		"	if (!occluded(bounds[i].center.xyz, bounds[i].extent.xyz))\n"
+		"		return;\n"
+		"	atomicAdd(culled, 1u);\n"
+		"	if (patchCommands) {\n"
+		"		atomicAdd(culledTriangles, commands[i * 5u] / 3u * commands[i * 5u + 1u]);\n"
+		"		commands[i * 5u + 1u] = 0u;\n"
+		"	}\n"
+		"	else\n"
+		"		visible[i] = 0u;\n"
+		"}\n";
+
+	static Shader* compileCompute(const char* source, const std::string& handle)
+	{
+		char infoLog[1024];
+		GLuint id = glCreateShader(GL_COMPUTE_SHADER);
+		glShaderSource(id, 1, &source, NULL);
+		glCompileShader(id);
+		int success;
+		glGetShaderiv(id, GL_COMPILE_STATUS, &success);
+		if (!success) {
+			glGetShaderInfoLog(id, 1024, NULL, infoLog);
+			ErrorMessageBox(std::string(infoLog) + "\n" + handle);
+			glDeleteShader(id);
+			return nullptr;
+		}
+		Shader* shader = new Shader();
+		shader->handle = handle;
+		shader->ID = glCreateProgram();
+		glAttachShader(shader->ID, id);
+		glLinkProgram(shader->ID);
+		glDeleteShader(id);
+		glGetProgramiv(shader->ID, GL_LINK_STATUS, &success);
+		if (!success) {
+			shader->checkCompileErrors(shader->ID, handle);
+			glDeleteProgram(shader->ID);
+			delete shader;
+			return nullptr;
+		}
+		shader->cacheUniforms();
+		return shader;
+	}
+
+	// Depth format matching the depth buffer of 'framebuffer', as glBlitFramebuffer requires. 0 if it has none.
+	static GLenum depthFormatOf(GLuint framebuffer)
+	{
+		GLenum attachment = framebuffer ? GL_DEPTH_ATTACHMENT : GL_DEPTH;
+		GLint objectType = GL_NONE, depthBits = 0, stencilBits = 0, type = 0;
+		glGetNamedFramebufferAttachmentParameteriv(framebuffer, attachment, GL_FRAMEBUFFER_ATTACHMENT_OBJECT_TYPE, &objectType);
+		if (objectType == GL_NONE)
+			return 0;
+		glGetNamedFramebufferAttachmentParameteriv(framebuffer, attachment, GL_FRAMEBUFFER_ATTACHMENT_DEPTH_SIZE, &depthBits);
+		glGetNamedFramebufferAttachmentParameteriv(framebuffer, attachment, GL_FRAMEBUFFER_ATTACHMENT_STENCIL_SIZE, &stencilBits);
+		glGetNamedFramebufferAttachmentParameteriv(framebuffer, attachment, GL_FRAMEBUFFER_ATTACHMENT_COMPONENT_TYPE, &type);
+		if (depthBits == 0)
+			return 0;
+		if (type == GL_FLOAT)
+			return stencilBits ? GL_DEPTH32F_STENCIL8 : GL_DEPTH_COMPONENT32F;
+		if (depthBits <= 16)
+			return GL_DEPTH_COMPONENT16;
+		if (depthBits <= 24)
+			return stencilBits ? GL_DEPTH24_STENCIL8 : GL_DEPTH_COMPONENT24;
+		return GL_DEPTH_COMPONENT32;
+	}
+
+	bool OcclusionCuller::init()
+	{
+		if (supported())
+			return true;
+		if (!hasExtension("GL_ARB_compute_shader") || !hasExtension("GL_ARB_shader_storage_buffer_object"))
+			return false;
+		reduceShader = compileCompute(reduceSource, "hiZReduceShader");
+		cullShader = compileCompute(cullSource, "occlusionCullShader");
+		return supported();
+	}
+
+	void OcclusionCuller::resize(int w, int h, GLenum format)
+	{
+		if (depthTexture)
+			glDeleteTextures(1, &depthTexture);
+		if (pyramid)
+			glDeleteTextures(1, &pyramid);
+		if (!depthFBO)
+			glCreateFramebuffers(1, &depthFBO);
+
+		width = w;
+		height = h;
+		depthFormat = format;
+		glCreateTextures(GL_TEXTURE_2D, 1, &depthTexture);
+		glTextureStorage2D(depthTexture, 1, format, w, h);
+		glTextureParameteri(depthTexture, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTextureParameteri(depthTexture, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		bool hasStencil = format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8;
+		glNamedFramebufferTexture(depthFBO, hasStencil ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT, depthTexture, 0);
+
+		int w0 = std::max(w / 2, 1), h0 = std::max(h / 2, 1);
+		levels = 1;
+		while ((std::max(w0, h0) >> levels) > 0)
+			levels++;
+		glCreateTextures(GL_TEXTURE_2D, 1, &pyramid);
+		glTextureStorage2D(pyramid, levels, GL_R32F, w0, h0);
+		glTextureParameteri(pyramid, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTextureParameteri(pyramid, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
+
+	void OcclusionCuller::capture(GLuint framebuffer)
+	{
+		if (!supported())
+			return;
+		GLint viewport[4];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		GLenum format = depthFormatOf(framebuffer);
+		if (viewport[2] <= 0 || viewport[3] <= 0 || format == 0) {
+			pyramidValid = false;
+			return;
+		}
+		if (viewport[2] != width || viewport[3] != height || format != depthFormat)
+			resize(viewport[2], viewport[3], format);
+
+		// A multisampled depth buffer is resolved by the blit, which keeps one sample per pixel.
+		glBlitNamedFramebuffer(framebuffer, depthFBO, viewport[0], viewport[1], viewport[0] + width, viewport[1] + height,
+			0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+
+		reduceShader->use();
+		static int UsourceLevel = reduceShader->uniform("sourceLevel");
+		static int UsourceSize = reduceShader->uniform("sourceSize");
+		glm::ivec2 size(width, height);
+		for (int level = 0; level < levels; ++level) {
+			glBindTextureUnit(HIZ_TEXTURE_UNIT, level == 0 ? depthTexture : pyramid);
+			reduceShader->setInt(UsourceLevel, level == 0 ? 0 : level - 1);
+			reduceShader->setIvec2(UsourceSize, size);
+			glBindImageTexture(0, pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+			size = glm::max(size / 2, glm::ivec2(1));
+			glDispatchCompute((size.x + 7) / 8, (size.y + 7) / 8, 1);
+			glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+		}
+		glBindTextureUnit(HIZ_TEXTURE_UNIT, 0);
+		pyramidValid = true;
+	}
+
+	void OcclusionCuller::setBounds(const BoxArray& boxes)
+	{
+		std::vector<glm::vec4> data(boxes.size() * 2);
+		for (size_t i = 0; i < boxes.size(); ++i) {
+			data[i * 2] = glm::vec4(boxes.cx[i], boxes.cy[i], boxes.cz[i], 0.0f);
+			data[i * 2 + 1] = glm::vec4(boxes.ex[i], boxes.ey[i], boxes.ez[i], 0.0f);
+		}
+		if (!boundsBuffer)
+			glCreateBuffers(1, &boundsBuffer);
+		if (!visibilityBuffer)
+			glCreateBuffers(1, &visibilityBuffer);
+		GLsizeiptr n = (GLsizeiptr)std::max<size_t>(boxes.size(), 1);
+		glNamedBufferData(boundsBuffer, n * 2 * sizeof(glm::vec4), data.size() ? data.data() : nullptr, GL_STATIC_DRAW);
+		glNamedBufferData(visibilityBuffer, n * sizeof(uint32_t), nullptr, GL_DYNAMIC_DRAW);
+		numBounds = boxes.size();
+	}
+
+	unsigned int OcclusionCuller::cull(const glm::mat4& VP, uint8_t* visible, size_t count, GLuint commandBuffer)
+	{
+		if (!supported() || !pyramidValid || count == 0 || count > numBounds)
+			return 0;
+
+		// Pick up the counters of the last indirect cull if the GPU is done with them; otherwise drop that sample
+		// rather than wait, since the buffer is about to be reused.
+		if (statsFence) {
+			GLenum status = glClientWaitSync(statsFence, 0, 0);
+			if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+				uint32_t stats[2];
+				glGetNamedBufferSubData(statsBuffer, 0, sizeof(stats), stats);
+				lastCulled = stats[0];
+				lastCulledTriangles = stats[1];
+			}
+			glDeleteSync(statsFence);
+			statsFence = 0;
+		}
+		if (!statsBuffer) {
+			glCreateBuffers(1, &statsBuffer);
+			glNamedBufferData(statsBuffer, 2 * sizeof(uint32_t), nullptr, GL_DYNAMIC_READ);
+		}
+
+		flags.assign(visible, visible + count);
+		glNamedBufferSubData(visibilityBuffer, 0, count * sizeof(uint32_t), flags.data());
+		glClearNamedBufferData(statsBuffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+
+		cullShader->use();
+		static int UviewProjection = cullShader->uniform("viewProjection");
+		static int UnumDraws = cullShader->uniform("numDraws");
+		static int UdepthSize = cullShader->uniform("depthSize");
+		static int UhiZLevels = cullShader->uniform("hiZLevels");
+		static int UpatchCommands = cullShader->uniform("patchCommands");
+		cullShader->setMat4(UviewProjection, VP);
+		cullShader->setUint(UnumDraws, (unsigned int)count);
+		cullShader->setIvec2(UdepthSize, glm::ivec2(width, height));
+		cullShader->setInt(UhiZLevels, levels);
+		cullShader->setBool(UpatchCommands, commandBuffer != 0);
+		glBindTextureUnit(HIZ_TEXTURE_UNIT, pyramid);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BOUNDS_BINDING, boundsBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VISIBILITY_BINDING, visibilityBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, COMMAND_BINDING, commandBuffer ? commandBuffer : visibilityBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, STATS_BINDING, statsBuffer);
+		glDispatchCompute(GLuint((count + 63) / 64), 1, 1);
+		glBindTextureUnit(HIZ_TEXTURE_UNIT, 0);
+
+		if (commandBuffer) {
+			glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+			statsFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			return lastCulled;
+		}
+
+		// The classic path needs the answer on the CPU, which waits for the dispatch to finish.
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		glGetNamedBufferSubData(visibilityBuffer, 0, count * sizeof(uint32_t), flags.data());
+		lastCulled = 0;
+		for (size_t i = 0; i < count; ++i) {
+			lastCulled += visible[i] && !flags[i];
+			visible[i] = (uint8_t)flags[i];
+		}
+		return lastCulled;
+	}
+
+	void OcclusionCuller::release()
+	{
+		for (Shader** s : { &reduceShader, &cullShader }) {
+			if (*s && (*s)->ID)
+				glDeleteProgram((*s)->ID);
+			delete *s;
+			*s = nullptr;
+		}
+		if (statsFence)
+			glDeleteSync(statsFence);
+		if (depthFBO)
+			glDeleteFramebuffers(1, &depthFBO);
+		for (GLuint* t : { &depthTexture, &pyramid }) {
+			if (*t)
+				glDeleteTextures(1, t);
+			*t = 0;
+		}
+		for (GLuint* b : { &boundsBuffer, &visibilityBuffer, &statsBuffer }) {
+			if (*b)
+				glDeleteBuffers(1, b);
+			*b = 0;
+		}
+		statsFence = 0;
+		depthFBO = 0;
+		depthFormat = 0;
+		width = height = levels = 0;
+		numBounds = 0;
+		pyramidValid = false;
+	}
+}
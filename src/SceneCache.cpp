@@ -0,0 +1,363 @@
+#include "SceneCache.hpp"
+#include "MappedFile.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace TDModelView
+{
+	// On-disk layout. All sections start on 16 byte boundaries so arrays can be used directly from a mapped view.
+	struct CacheHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t sourceSize;
+		int64_t sourceTime;
+		uint32_t importFlags;
+		uint32_t vertexSize;
+		uint32_t numMaterials;
+		uint32_t numMeshes;
+		uint32_t numStrings;
+		uint32_t pad;
+		uint64_t stringsOffset;
+		uint64_t materialsOffset;
+		uint64_t meshesOffset;
+	};
+
+	struct CacheMaterial
+	{
+		int32_t useBumpMap;
+		int32_t parallaxCrop;
+		int32_t parallaxSamples;
+		int32_t pad;
+		float alphaCutoff;
+		float bumpMultiplier;
+		float displacementMapBias;
+		float heightMultiplier;
+		float emissiveMultiplier;
+		float lightmapMultiplier;
+		float ambientocclusionMultiplier;
+		float opacity;
+		float roughness;
+		float shininessStrength;
+		float specularFactor;
+		float metalness;
+		float ior;
+		float ambient[3];
+		float diffuse[3];
+		float specular[3];
+		float emissive[3];
+		float transparent[3];
+		int32_t textures[int(aiTextureType_UNKNOWN) + 1];// index into string table, -1 if unused
+	};
+
+	struct CacheMesh
+	{
+		uint32_t materialIndex;
+		uint32_t numVertices;
+		uint32_t numIndices;
+		uint32_t numInstances;
+		float bboxMin[3];
+		float bboxMax[3];
+		uint64_t vertexOffset;
+		uint64_t indexOffset;
+		uint64_t instanceOffset;
+	};
+
+	static const uint64_t CACHE_ALIGNMENT = 16;
+
+	static uint64_t alignOffset(uint64_t offset)
+	{
+		return (offset + CACHE_ALIGNMENT - 1) & ~(CACHE_ALIGNMENT - 1);
+	}
+
+	static void writePadding(std::ofstream& ofs, uint64_t& offset)
+	{
+		static const char zeros[CACHE_ALIGNMENT] = { 0 };
+		uint64_t aligned = alignOffset(offset);
+		ofs.write(zeros, aligned - offset);
+		offset = aligned;
+	}
+
+	static void writeBytes(std::ofstream& ofs, uint64_t& offset, const void* data, uint64_t size)
+	{
+		ofs.write((const char*)data, size);
+		offset += size;
+	}
+
+	SceneCache::SceneCache(std::string sourcePath, unsigned int importFlags)
+	{
+		this->sourcePath = sourcePath;
+		this->importFlags = importFlags;
+
+		std::error_code ec;
+		std::filesystem::path src(sourcePath);
+		sourceSize = std::filesystem::file_size(src, ec);
+		hasSource = !ec;
+		if (hasSource)
+			sourceTime = (int64_t)std::filesystem::last_write_time(src, ec).time_since_epoch().count();
+		hasSource &= !ec;
+
+		// Name cache files after the model plus a hash of its full path so same-named models don't collide.
+		std::stringstream ss;
+		ss << getFilename(sourcePath) << "_" << std::hex << std::hash<std::string>{}(sourcePath) << ".tdmv";
+		cachePath = (std::filesystem::path(eng->working_directory) / "cache" / ss.str()).string();
+	}
+
+	std::shared_ptr<Scene> SceneCache::load(TextureResolver resolveTexture)
+	{
+		if (!hasSource || !std::filesystem::is_regular_file(cachePath))
+			return nullptr;
+
+		MappedFile file(cachePath);
+		if (!file.isOpen() || file.size() < sizeof(CacheHeader))
+			return nullptr;
+
+		const uint8_t* base = file.data();
+		const CacheHeader* header = (const CacheHeader*)base;
+		if (memcmp(header->magic, "TDMV", 4) != 0 || header->version != VERSION ||
+			header->vertexSize != sizeof(Vertex) || header->importFlags != importFlags ||
+			header->sourceSize != sourceSize || header->sourceTime != sourceTime)
+		{
+			WriteToLogFile("Model cache is out of date: " + cachePath);
+			return nullptr;
+		}
+
+		auto inBounds = [&](uint64_t offset, uint64_t size) { return offset <= file.size() && size <= file.size() - offset; };
+		if (!inBounds(header->materialsOffset, uint64_t(header->numMaterials) * sizeof(CacheMaterial)) ||
+			!inBounds(header->meshesOffset, uint64_t(header->numMeshes) * sizeof(CacheMesh)))
+		{
+			WriteToLogFile("Model cache is corrupt: " + cachePath);
+			return nullptr;
+		}
+
+		// Read string table. The first entry is always the source model path.
+		std::vector<std::string> strings;
+		uint64_t offset = header->stringsOffset;
+		for (uint32_t i = 0; i < header->numStrings; ++i) {
+			uint32_t len = 0;
+			if (!inBounds(offset, sizeof(uint32_t)))
+				return nullptr;
+			memcpy(&len, base + offset, sizeof(uint32_t));
+			offset += sizeof(uint32_t);
+			if (!inBounds(offset, len))
+				return nullptr;
+			strings.push_back(std::string((const char*)base + offset, len));
+			offset += len;
+		}
+		if (strings.empty() || strings[0] != sourcePath)
+			return nullptr;
+
+		std::shared_ptr<Scene> scene = std::make_shared<Scene>();
+
+		// Materials.
+		const CacheMaterial* cmats = (const CacheMaterial*)(base + header->materialsOffset);
+		for (uint32_t i = 0; i < header->numMaterials; ++i) {
+			const CacheMaterial& cm = cmats[i];
+			std::shared_ptr<Material> material = std::make_shared<Material>();
+			material->useBumpMap = cm.useBumpMap != 0;
+			material->parallaxCrop = cm.parallaxCrop != 0;
+			material->parallaxSamples = cm.parallaxSamples;
+			material->alphaCutoff = cm.alphaCutoff;
+			material->bumpMultiplier = cm.bumpMultiplier;
+			material->displacementMapBias = cm.displacementMapBias;
+			material->heightMultiplier = cm.heightMultiplier;
+			material->emissiveMultiplier = cm.emissiveMultiplier;
+			material->lightmapMultiplier = cm.lightmapMultiplier;
+			material->ambientocclusionMultiplier = cm.ambientocclusionMultiplier;
+			material->opacity = cm.opacity;
+			material->roughness = cm.roughness;
+			material->shininessStrength = cm.shininessStrength;
+			material->specularFactor = cm.specularFactor;
+			material->metalness = cm.metalness;
+			material->ior = cm.ior;
+			material->ambient = glm::vec3(cm.ambient[0], cm.ambient[1], cm.ambient[2]);
+			material->diffuse = glm::vec3(cm.diffuse[0], cm.diffuse[1], cm.diffuse[2]);
+			material->specular = glm::vec3(cm.specular[0], cm.specular[1], cm.specular[2]);
+			material->emissive = glm::vec3(cm.emissive[0], cm.emissive[1], cm.emissive[2]);
+			material->transparent = glm::vec3(cm.transparent[0], cm.transparent[1], cm.transparent[2]);
+			for (int t = 0; t <= int(aiTextureType_UNKNOWN); ++t) {
+				int32_t idx = cm.textures[t];
+				if (idx <= 0 || idx >= (int32_t)strings.size())
+					continue;
+				const std::string& fpath = strings[idx];
+				if (!std::filesystem::is_regular_file(fpath))
+					continue;
+				std::shared_ptr<Texture> tx = resolveTexture(fpath);
+				if (tx)
+					material->AddTexture(tx, aiTextureType(t));
+			}
+			scene->materials.push_back(material);
+		}
+
+		// Meshes, copied straight out of the mapped vertex/index arrays.
+		const CacheMesh* cmeshes = (const CacheMesh*)(base + header->meshesOffset);
+		for (uint32_t i = 0; i < header->numMeshes; ++i) {
+			const CacheMesh& cm = cmeshes[i];
+			if (!inBounds(cm.vertexOffset, uint64_t(cm.numVertices) * sizeof(Vertex)) ||
+				!inBounds(cm.indexOffset, uint64_t(cm.numIndices) * sizeof(GLuint)) ||
+				!inBounds(cm.instanceOffset, uint64_t(cm.numInstances) * sizeof(glm::mat4)))
+			{
+				WriteToLogFile("Model cache is corrupt: " + cachePath);
+				return nullptr;
+			}
+			std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>();
+			if (cm.materialIndex < scene->materials.size())
+				mesh->material = scene->materials[cm.materialIndex];
+			const Vertex* verts = (const Vertex*)(base + cm.vertexOffset);
+			const GLuint* inds = (const GLuint*)(base + cm.indexOffset);
+			mesh->vertices.assign(verts, verts + cm.numVertices);
+			mesh->indices.assign(inds, inds + cm.numIndices);
+			const glm::mat4* insts = (const glm::mat4*)(base + cm.instanceOffset);
+			mesh->instances.assign(insts, insts + cm.numInstances);
+			mesh->bbox.bboxMin = glm::vec3(cm.bboxMin[0], cm.bboxMin[1], cm.bboxMin[2]);
+			mesh->bbox.bboxMax = glm::vec3(cm.bboxMax[0], cm.bboxMax[1], cm.bboxMax[2]);
+			scene->meshes.push_back(mesh);
+		}
+
+		WriteToLogFile("Loaded model from cache " + cachePath);
+		return scene;
+	}
+
+	bool SceneCache::save(std::shared_ptr<Scene> scene)
+	{
+		if (!hasSource || scene == nullptr)
+			return false;
+
+		std::error_code ec;
+		std::filesystem::create_directories(std::filesystem::path(cachePath).parent_path(), ec);
+
+		// Build string table and on-disk material records.
+		std::vector<std::string> strings{ sourcePath };
+		std::vector<CacheMaterial> cmats(scene->materials.size());
+		for (size_t i = 0; i < scene->materials.size(); ++i) {
+			const Material& m = *scene->materials[i];
+			CacheMaterial& cm = cmats[i];
+			memset(&cm, 0, sizeof(CacheMaterial));
+			cm.useBumpMap = m.useBumpMap;
+			cm.parallaxCrop = m.parallaxCrop;
+			cm.parallaxSamples = m.parallaxSamples;
+			cm.alphaCutoff = m.alphaCutoff;
+			cm.bumpMultiplier = m.bumpMultiplier;
+			cm.displacementMapBias = m.displacementMapBias;
+			cm.heightMultiplier = m.heightMultiplier;
+			cm.emissiveMultiplier = m.emissiveMultiplier;
+			cm.lightmapMultiplier = m.lightmapMultiplier;
+			cm.ambientocclusionMultiplier = m.ambientocclusionMultiplier;
+			cm.opacity = m.opacity;
+			cm.roughness = m.roughness;
+			cm.shininessStrength = m.shininessStrength;
+			cm.specularFactor = m.specularFactor;
+			cm.metalness = m.metalness;
+			cm.ior = m.ior;
+			for (int c = 0; c < 3; ++c) {
+				cm.ambient[c] = m.ambient[c];
+				cm.diffuse[c] = m.diffuse[c];
+				cm.specular[c] = m.specular[c];
+				cm.emissive[c] = m.emissive[c];
+				cm.transparent[c] = m.transparent[c];
+			}
+			for (int t = 0; t <= int(aiTextureType_UNKNOWN); ++t) {
+				cm.textures[t] = -1;
+				if (m.textures[t] == nullptr || m.textures[t]->filepath.empty())
+					continue;
+				cm.textures[t] = (int32_t)strings.size();
+				strings.push_back(m.textures[t]->filepath);
+			}
+		}
+
+		// Lay out the file: header, strings, materials, mesh records, then raw vertex/index arrays.
+		CacheHeader header;
+		memset(&header, 0, sizeof(CacheHeader));
+		memcpy(header.magic, "TDMV", 4);
+		header.version = VERSION;
+		header.sourceSize = sourceSize;
+		header.sourceTime = sourceTime;
+		header.importFlags = importFlags;
+		header.vertexSize = sizeof(Vertex);
+		header.numMaterials = (uint32_t)cmats.size();
+		header.numMeshes = (uint32_t)scene->meshes.size();
+		header.numStrings = (uint32_t)strings.size();
+
+		uint64_t offset = alignOffset(sizeof(CacheHeader));
+		header.stringsOffset = offset;
+		for (auto& s : strings)
+			offset += sizeof(uint32_t) + s.size();
+		offset = alignOffset(offset);
+		header.materialsOffset = offset;
+		offset = alignOffset(offset + cmats.size() * sizeof(CacheMaterial));
+		header.meshesOffset = offset;
+		offset = alignOffset(offset + scene->meshes.size() * sizeof(CacheMesh));
+
+		std::vector<CacheMesh> cmeshes(scene->meshes.size());
+		for (size_t i = 0; i < scene->meshes.size(); ++i) {
+			const Mesh& m = *scene->meshes[i];
+			CacheMesh& cm = cmeshes[i];
+			memset(&cm, 0, sizeof(CacheMesh));
+			cm.materialIndex = UINT32_MAX;
+			for (size_t j = 0; j < scene->materials.size(); ++j) {
+				if (scene->materials[j] == m.material) {
+					cm.materialIndex = (uint32_t)j;
+					break;
+				}
+			}
+			cm.numVertices = (uint32_t)m.vertices.size();
+			cm.numIndices = (uint32_t)m.indices.size();
+			cm.numInstances = (uint32_t)m.instances.size();
+			for (int c = 0; c < 3; ++c) {
+				cm.bboxMin[c] = m.bbox.bboxMin[c];
+				cm.bboxMax[c] = m.bbox.bboxMax[c];
+			}
+			cm.vertexOffset = offset;
+			offset = alignOffset(offset + m.vertices.size() * sizeof(Vertex));
+			cm.indexOffset = offset;
+			offset = alignOffset(offset + m.indices.size() * sizeof(GLuint));
+			cm.instanceOffset = offset;
+			offset = alignOffset(offset + m.instances.size() * sizeof(glm::mat4));
+		}
+
+		// Write to a temporary file first so an interrupted save never leaves a half-written cache behind.
+		std::string tmpPath = cachePath + ".tmp";
+		std::ofstream ofs(tmpPath, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!ofs.is_open()) {
+			WriteToLogFile("Could not write model cache " + cachePath);
+			return false;
+		}
+		offset = 0;
+		writeBytes(ofs, offset, &header, sizeof(CacheHeader));
+		writePadding(ofs, offset);
+		for (auto& s : strings) {
+			uint32_t len = (uint32_t)s.size();
+			writeBytes(ofs, offset, &len, sizeof(uint32_t));
+			writeBytes(ofs, offset, s.data(), len);
+		}
+		writePadding(ofs, offset);
+		writeBytes(ofs, offset, cmats.data(), cmats.size() * sizeof(CacheMaterial));
+		writePadding(ofs, offset);
+		writeBytes(ofs, offset, cmeshes.data(), cmeshes.size() * sizeof(CacheMesh));
+		writePadding(ofs, offset);
+		for (auto& m : scene->meshes) {
+			writeBytes(ofs, offset, m->vertices.data(), m->vertices.size() * sizeof(Vertex));
+			writePadding(ofs, offset);
+			writeBytes(ofs, offset, m->indices.data(), m->indices.size() * sizeof(GLuint));
+			writePadding(ofs, offset);
+			writeBytes(ofs, offset, m->instances.data(), m->instances.size() * sizeof(glm::mat4));
+			writePadding(ofs, offset);
+		}
+		bool ok = ofs.good();
+		ofs.close();
+
+		if (ok) {
+			std::filesystem::rename(tmpPath, cachePath, ec);
+			ok = !ec;
+		}
+		if (!ok) {
+			std::filesystem::remove(tmpPath, ec);
+			WriteToLogFile("Could not write model cache " + cachePath);
+			return false;
+		}
+		WriteToLogFile("Wrote model cache " + cachePath);
+		return true;
+	}
+}
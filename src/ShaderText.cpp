@@ -1,21 +1,125 @@
 #include "structs.hpp"
 
+// Per-material parameters, read from the scene's material uniform buffer (see Scene::buildMaterialBuffer), or with
+// INDIRECT_DRAW from the material storage buffer at MATERIAL_INDEX. The layout must match MaterialBlock in Structs.hpp.
+// The has*Map flags are bits of the permutation's TEXTURE_MASK indexed by aiTextureType, constant at compile time, so
+// code for maps a material doesn't have is compiled out. Keep the list in sync with SHADER_MAPS in Structs.hpp.
+#define MATERIAL_FIELDS \
+	"	vec3 diffuse;\n" \
+	"	float specularFactor;\n" \
+	"	vec3 specular;\n" \
+	"	float roughness;\n" \
+	"	vec3 ambient;\n" \
+	"	float opacity;\n" \
+	"	vec3 emissive;\n" \
+	"	float ior;\n" \
+	"	vec3 transparent;\n" \
+	"	float metalness;\n" \
+	"	float displacementMapAmplitude;\n" \
+	"	float displacementMapBias;\n" \
+	"	float heightMapAmplitude;\n" \
+	"	float lightmapMultiplier;\n" \
+	"	float emissiveMapAmplitude;\n" \
+	"	float ambientocclusionMapAmplitude;\n" \
+	"	float alphaCutoff;\n" \
+	"	int parallaxSamples;\n" \
+	"	int useBumpMap;\n" \
+	"	uint textureMask;\n"
+
+#define MATERIAL_BLOCK \
+	"#ifdef INDIRECT_DRAW\n" \
+	"struct MaterialData {\n" \
+	MATERIAL_FIELDS \
+	"};\n" \
+	"layout(std430, binding = 1) readonly buffer MaterialBuffer { MaterialData materials[]; };\n" \
+	"#define material materials[MATERIAL_INDEX]\n" \
+	"#else\n" \
+	"layout(std140) uniform MaterialBlock {\n" \
+	MATERIAL_FIELDS \
+	"} material;\n" \
+	"#endif\n" \
+	"#define HAS_MAP(type) ((TEXTURE_MASK & (1u << type)) != 0u)\n" \
+	"#define hasDiffuseMap HAS_MAP(1)\n" \
+	"#define hasSpecularMap HAS_MAP(2)\n" \
+	"#define hasEmissiveMap HAS_MAP(4)\n" \
+	"#define hasHeightMap HAS_MAP(5)\n" \
+	"#define hasNormalMap HAS_MAP(6)\n" \
+	"#define hasShininessMap HAS_MAP(7)\n" \
+	"#define hasOpacityMap HAS_MAP(8)\n" \
+	"#define hasDisplacementMap HAS_MAP(9)\n" \
+	"#define hasAlbedoMap HAS_MAP(12)\n" \
+	"#define hasEmissiveColorMap HAS_MAP(14)\n" \
+	"#define hasMetalnessMap HAS_MAP(15)\n" \
+	"#define hasRoughnessMap HAS_MAP(16)\n" \
+	"#define hasAmbientOcclusionMap HAS_MAP(17)\n" \
+	"#define displacementMapAmplitude material.displacementMapAmplitude\n" \
+	"#define displacementMapBias material.displacementMapBias\n" \
+	"#define heightMapAmplitude material.heightMapAmplitude\n" \
+	"#define alphaCutoff material.alphaCutoff\n" \
+	"#define parallaxSamples material.parallaxSamples\n"
+
 namespace TDModelView 
 {
-	Shader* Renderer::defaultShader() 
+	Shader* Renderer::defaultShader(uint32_t features) 
 	{
 		Shader* shader = new Shader();
+		// Every permutation is the source below compiled with its feature bits as #defines (see SHADER_* in
+		// Structs.hpp). The indirect variant reads per-draw values from the draw storage buffer at gl_DrawID instead
+		// of uniforms. Depth-only variants for the pre-pass skip shading; with ALPHA_TEST they still discard like the
+		// full shader.
+		std::string header = (features & SHADER_INDIRECT) ?
+			"#version 450\n"
+			"#extension GL_ARB_shader_draw_parameters : require\n"
+			"#define INDIRECT_DRAW\n" :
+			"#version 330\n";
+		if (features & SHADER_DEPTH_ONLY)
+			header += "#define DEPTH_ONLY\n";
+		if (features & SHADER_ALPHA_TEST)
+			header += "#define ALPHA_TEST\n";
+		header += "#define TEXTURE_MASK " + std::to_string(features & SHADER_TEXTURE_MASK) + "u\n";
+		if (features & SHADER_BUMP_MAP)
+			header += "#define BUMP_MAP\n";
 		const char* vert =
-			"#version 330\n"
 			"precision highp float;"
-			"layout(location = 0) in vec3 vertexPosition;\n"
+			"layout(location = 0) in vec4 vertexPosition;\n"
 			"layout(location = 1) in vec3 vertexTexCoord;\n"
 			"layout(location = 2) in vec3 vertexNormal;\n"
 			"layout(location = 3) in vec3 vertexTangent;\n"
 			"layout(location = 4) in vec3 vertexBitangent;\n"
+			"layout(location = 5) in mat4 instanceMatrix;\n"// per instance, see GeometryBuffer
+			"invariant gl_Position;\n"// the shading pass must land on the pre-pass depth exactly for GL_EQUAL
+			"#ifdef INDIRECT_DRAW\n"
+			"struct DrawData {\n"// layout must match Renderer::DrawData
+			"	mat4 model;\n"
+			"	mat4 normalMat;\n"
+			"	vec4 offset;\n"
+			"	vec4 scale;\n"
+			"	uint materialIndex;\n"
+			"	uint compact;\n"
+			"	uint instanced;\n"
+			"};\n"
+			"layout(std430, binding = 0) readonly buffer DrawBuffer { DrawData draws[]; };\n"
+			"uniform uint drawOffset = 0u;\n"// first draw of the current glMultiDrawElementsIndirect call
+			"uniform mat4 viewProjection;\n"
+			"#define DRAW draws[drawOffset + uint(gl_DrawIDARB)]\n"
+			"#define modelMatrix DRAW.model\n"
+			"#define normalMatrix mat3(DRAW.normalMat)\n"
+			"#define modelViewProjection (viewProjection * DRAW.model)\n"
+			"#define compactVertices (DRAW.compact != 0u)\n"
+			"#define instanced (DRAW.instanced != 0u)\n"
+			"#define positionOffset DRAW.offset.xyz\n"
+			"#define positionScale DRAW.scale.xyz\n"
+			"#define MATERIAL_INDEX DRAW.materialIndex\n"
+			"flat out uint drawMaterial;\n"
+			"#else\n"
 			"uniform mat3 normalMatrix;\n"
 			"uniform mat4 modelMatrix;\n"
 			"uniform mat4 modelViewProjection;\n"
+			"uniform bool compactVertices = false;\n"// PackedVertex layout, see Mesh::packVertices
+			"uniform bool instanced = false;\n"// apply instanceMatrix before modelMatrix
+			"uniform vec3 positionOffset = vec3(0);\n"
+			"uniform vec3 positionScale = vec3(1);\n"
+			"#endif\n"
 			"out Vertex{\n"
 			"	vec3 position;\n"
 			"	vec3 texCoord;\n"
@@ -26,30 +130,14 @@ namespace TDModelView
 			"	vec3 TangentFragPos;\n"
 			"	vec3 TangentLightDir;\n"
 			"};\n"
-			"uniform struct Material {\n"
-			"	vec3 diffuse;\n"
-			"	vec3 specular;\n"
-			"	vec3 ambient;\n"
-			"	vec3 emissive;\n"
-			"	vec3 transparent;\n"
-			"	float specularFactor;\n"
-			"	float roughness;\n"
-			"	float opacity;\n"
-			"	float ior;\n"
-			"	float metalness;\n"
-			"} material;\n"
+			MATERIAL_BLOCK
 			"layout(binding = 5) uniform sampler2D heightMap;\n"
-			"uniform bool hasHeightMap = false;\n"
 			"uniform vec3 heightMapTranslation = vec3(0);\n"
 			"uniform vec3 heightMapScale = vec3(1);\n"
-			"uniform float heightMapAmplitude = 1.0;\n"
 			"uniform int heightMapUseChannel = 0;\n"
-			"uniform bool hasNormalMap = false;\n"
 			"layout(binding = 9) uniform sampler2D displacementMap;\n"
-			"uniform bool hasDisplacementMap = false;\n"
 			"uniform vec3 displacementMapTranslation = vec3(0);\n"
 			"uniform vec3 displacementMapScale = vec3(1);\n"
-			"uniform float displacementMapAmplitude = 1.f;\n"
 			"uniform int displacementMapUseChannel = 0;\n"
 			"uniform vec3 cameraPosition;\n"
 			"uniform vec4 lightVec;\n"
@@ -57,24 +145,46 @@ namespace TDModelView
 			"	vec4 v2 = M * vec4(v,1.0);\n"
 			"	return v2.xyz / v2.w;"
 			"}\n"
+			"vec3 octDecode(vec2 e){\n"
+			"	vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));\n"
+			"	if (v.z < 0.0)\n"
+			"		v.xy = (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);\n"
+			"	return normalize(v);\n"
+			"}\n"
 			"void main() {\n"
-			"	vec4 vertexPos = vec4(vertexPosition, 1.0);\n"
+			"	mat4 world = modelMatrix;\n"
+			"	mat3 worldNormal = normalMatrix;\n"
+			"	mat4 clip = modelViewProjection;\n"
+			"	if (instanced) {\n"
+			"		world = modelMatrix * instanceMatrix;\n"
+			"		worldNormal = transpose(inverse(mat3(world)));\n"
+			"		clip = modelViewProjection * instanceMatrix;\n"
+			"	}\n"
+			"	vec3 inNormal = vertexNormal;\n"
+			"	vec3 inTangent = vertexTangent;\n"
+			"	vec3 inBitangent = vertexBitangent;\n"
+			"	if (compactVertices) {\n"
+			"		inNormal = octDecode(vertexNormal.xy);\n"
+			"		inTangent = octDecode(vertexTangent.xy);\n"
+			"		inBitangent = (vertexPosition.w > 0.5 ? 1.0 : -1.0) * cross(inNormal, inTangent);\n"
+			"	}\n"
+			"	vec4 vertexPos = vec4(positionOffset + positionScale * vertexPosition.xyz, 1.0);\n"
 			"	if (hasHeightMap) {\n"
 			"		float heightVal = texture(heightMap, vertexTexCoord.xy).r;\n"
 			"		heightVal = heightVal * 2.0 - 1.0;\n"//scale [0,1] ==> [-1,1]
 			"		heightVal *= heightMapAmplitude;\n"
-			"		vertexPos.xyz += heightVal * vertexNormal;\n"
+			"		vertexPos.xyz += heightVal * inNormal;\n"
 			"	}\n"
-			"	position = vec3(modelMatrix * vertexPos);\n"
+			"	position = vec3(world * vertexPos);\n"
 			"	texCoord = vertexTexCoord;\n"
-			"	normal = normalize(mat3(modelMatrix) * vertexNormal.rgb);\n"
-			"	tangent = normalize(mat3(modelMatrix) * vertexTangent.rgb);\n"
-			"	bitangent = normalize(mat3(modelMatrix) * vertexBitangent.rgb);\n"
+			"	normal = normalize(mat3(world) * inNormal);\n"
+			"	tangent = normalize(mat3(world) * inTangent);\n"
+			"	bitangent = normalize(mat3(world) * inBitangent);\n"
 			"	if(hasNormalMap){"
-			"	normal = normalize(normalMatrix* vertexNormal.rgb);\n"
-			"	tangent = normalize(normalMatrix* vertexTangent.rgb);\n"
+			"	normal = normalize(worldNormal* inNormal);\n"
+			"	tangent = normalize(worldNormal* inTangent);\n"
 			"	tangent = normalize(tangent - dot(tangent, normal) * normal);\n"
-			"	float handedness_fix = (dot(vertexNormal.rgb, cross(vertexTangent.rgb, vertexBitangent.rgb)) > 0.0f) ? 1.0f : -1.0f;\n"
+			"	float handedness_fix = (dot(inNormal, cross(inTangent, inBitangent)) > 0.0f) ? 1.0f : -1.0f;\n"
 			"	bitangent = normalize(handedness_fix * cross(normal,tangent));\n"
 			"	}"
 			//"	if (hasDisplacementMap) {\n"
@@ -83,11 +193,13 @@ namespace TDModelView
 			"		TangentFragPos = TBN * position;\n"
 			"		TangentLightDir = TBN * lightVec.rgb;\n"
 			//"	}\n"
-			"	gl_Position = modelViewProjection * vertexPos;\n"
+			"	gl_Position = clip * vertexPos;\n"
+			"#ifdef INDIRECT_DRAW\n"
+			"	drawMaterial = MATERIAL_INDEX;\n"
+			"#endif\n"
 			"}\n";
 
 		const char* frag =
-			"#version 330\n"
 			"precision highp float;"
 			"out vec4 fragColor;\n"
 			"in Vertex{\n"
@@ -103,54 +215,28 @@ namespace TDModelView
 			"uniform mat3 normalMatrix;\n"
 			"uniform mat4 modelMatrix;\n"
 			"uniform mat4 modelViewProjection;\n"
-			"uniform struct Material {\n"
-			"	vec3 diffuse;\n"
-			"	vec3 specular;\n"
-			"	vec3 ambient;\n"
-			"	vec3 emissive;\n"
-			"	vec3 transparent;\n"
-			"	float specularFactor;\n"
-			"	float roughness;\n"
-			"	float opacity;\n"
-			"	float ior;\n"
-			"	float metalness;\n"
-			"} material;\n"
+			"#ifdef INDIRECT_DRAW\n"
+			"flat in uint drawMaterial;\n"
+			"#define MATERIAL_INDEX drawMaterial\n"
+			"#endif\n"
+			MATERIAL_BLOCK
 			"layout(binding = 1) uniform sampler2D diffuseMap;\n"
-			"uniform bool hasDiffuseMap = false;\n"
 			"layout(binding = 2) uniform sampler2D specularMap;\n"
-			"uniform bool hasSpecularMap = false;\n"
 			"layout(binding = 3) uniform sampler2D ambientMap;\n"
-			"uniform bool hasAmbientMap = false;\n"
 			"layout(binding = 4) uniform sampler2D emissiveMap;\n"
-			"uniform bool hasEmissiveMap = false;\n"
 			"layout(binding = 6) uniform sampler2D normalsMap;\n"
-			"uniform bool hasNormalMap = false;\n"
-			"uniform bool useBumpMap = false;\n"
 			"layout(binding = 7) uniform sampler2D shininessMap;\n"
-			"uniform bool hasShininessMap = false;\n"
 			"layout(binding = 8) uniform sampler2D opacityMap;\n"
-			"uniform bool hasOpacityMap = false;\n"
 			"layout(binding = 9) uniform sampler2D displacementMap;\n"
-			"uniform bool hasDisplacementMap = false;\n"
-			"uniform float displacementMapAmplitude = 1.f;\n"
-			"uniform float displacementMapBias = 0.f;\n"
 			"layout(binding = 11) uniform sampler2D reflectionMap;\n"
-			"uniform bool hasReflectionMap = false;\n"
 			"layout(binding = 12) uniform sampler2D albedoMap;\n"
-			"uniform bool hasAlbedoMap = false;\n"
 			"layout(binding = 14) uniform sampler2D emissivecolorMap;\n"
-			"uniform bool hasEmissiveColorMap = false;\n"
 			"layout(binding = 15) uniform sampler2D metalnessMap;\n"
-			"uniform bool hasMetalnessMap = false;\n"
 			"layout(binding = 16) uniform sampler2D roughnessMap;\n"
-			"uniform bool hasRoughnessMap = false;\n"
 			"layout(binding = 17) uniform sampler2D ambientocclusionMap;\n"
-			"uniform bool hasAmbientOcclusionMap = false;\n"
 			"layout(binding = 18) uniform sampler2D brdfLUT;\n"
 			"layout(binding = 19) uniform sampler2D irradianceMap;\n"
 			"layout(binding = 20) uniform sampler2D prefilt;\n"
-			"uniform float alphaCutoff = 0.01f;\n"
-			"uniform int parallaxSamples = 10;\n"
 			"uniform vec3 cameraPosition;\n"
 			"uniform vec4 lightVec;\n"
 			"uniform vec2 resolution;\n"
@@ -225,6 +311,9 @@ namespace TDModelView
 			"}\n"
 			"float max3(vec3 v){ return max(max(v.x,v.y),v.z); }\n"
 			"void main() {\n"
+			"#if defined(DEPTH_ONLY) && !defined(ALPHA_TEST)\n"
+			"	return;\n"
+			"#endif\n"
 			"	vec2 newTexCoord = texCoord.xy;\n"
 			"	if (hasDisplacementMap) {\n" // Apply parallax effect.
 			"		newTexCoord = parallax();\n"
@@ -248,6 +337,9 @@ namespace TDModelView
 			"	}\n"
 			"	vec4 gAlbedo = vec4(diffuseColor.rgb, opacityVal);\n"
 			"	if(gAlbedo.a <= 0.0f){ discard; return; }\n" // Do transparency fragment discard here
+			"#ifdef DEPTH_ONLY\n"
+			"	return;\n"
+			"#endif\n"
 			"	vec4 specularColor = vec4(material.specular, material.specularFactor);\n"
 			"	if (hasSpecularMap) {\n"
 			"		vec4 spec = texture(specularMap, newTexCoord);\n"
@@ -255,10 +347,12 @@ namespace TDModelView
 			"	}\n"
 			"	vec4 gSpecular = vec4(specularColor.rgb, specularColor.a);\n"
 			"	vec3 nml = normalize(normal);\n"
-			"	if (useBumpMap)\n"
-			"		nml = bumpMapping(newTexCoord).xyz;\n"
-			"	else if (hasNormalMap)\n"
+			"#ifdef BUMP_MAP\n"
+			"	nml = bumpMapping(newTexCoord).xyz;\n"
+			"#else\n"
+			"	if (hasNormalMap)\n"
 			"		nml = normalMapping(newTexCoord).xyz;\n"
+			"#endif\n"
 			"	vec3 emissiveColor = material.emissive;\n"
 			"	if (hasEmissiveColorMap) {\n"
 			"		emissiveColor = texture(emissivecolorMap,newTexCoord).rgb;\n"
@@ -333,7 +427,8 @@ namespace TDModelView
 		// Compile vertex shader.
 		char infoLog[1024];
 		unsigned int vert_id = glCreateShader(GL_VERTEX_SHADER);
-		glShaderSource(vert_id, 1, &vert, NULL);
+		const char* vertSources[] = { header.c_str(), vert };
+		glShaderSource(vert_id, 2, vertSources, NULL);
 		glCompileShader(vert_id);
 		int success;
 		glGetShaderiv(vert_id, GL_COMPILE_STATUS, &success);
@@ -345,7 +440,8 @@ namespace TDModelView
 
 		// Compile frag shader.
 		unsigned int frag_id = glCreateShader(GL_FRAGMENT_SHADER);
-		glShaderSource(frag_id, 1, &frag, NULL);
+		const char* fragSources[] = { header.c_str(), frag };
+		glShaderSource(frag_id, 2, fragSources, NULL);
 		glCompileShader(frag_id);
 		glGetShaderiv(frag_id, GL_COMPILE_STATUS, &success);
 		if (!success) {
@@ -355,12 +451,18 @@ namespace TDModelView
 		}
 
 		// Attach and compile all.
-		shader->handle = "defaultShader";
+		char handle[32];
+		snprintf(handle, sizeof(handle), "defaultShader_%08x", features);
+		shader->handle = handle;
 		shader->ID = glCreateProgram();
 		glAttachShader(shader->ID, vert_id);
 		glAttachShader(shader->ID, frag_id);
 		glLinkProgram(shader->ID);
-		shader->checkCompileErrors(shader->ID, "defaultShader");
+		shader->checkCompileErrors(shader->ID, shader->handle);
+		shader->cacheUniforms();
+		GLuint materialBlock = glGetUniformBlockIndex(shader->ID, "MaterialBlock");
+		if (materialBlock != GL_INVALID_INDEX)
+			glUniformBlockBinding(shader->ID, materialBlock, MATERIAL_BLOCK_BINDING);
 
 		// Cleanup.
 		glDeleteShader(vert_id);
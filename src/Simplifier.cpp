@@ -0,0 +1,262 @@
+#include "Simplifier.hpp"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace TDModelView
+{
+	// Sum of squared distances to a set of area weighted planes: Q(p) = p'Ap + 2b.p + c, over a total weight w.
+	struct Quadric
+	{
+		float a00 = 0, a11 = 0, a22 = 0, a01 = 0, a02 = 0, a12 = 0;
+		float b0 = 0, b1 = 0, b2 = 0;
+		float c = 0;
+		float w = 0;
+
+		void addPlane(float nx, float ny, float nz, float d, float weight)
+		{
+			a00 += weight * nx * nx; a11 += weight * ny * ny; a22 += weight * nz * nz;
+			a01 += weight * nx * ny; a02 += weight * nx * nz; a12 += weight * ny * nz;
+			b0 += weight * nx * d; b1 += weight * ny * d; b2 += weight * nz * d;
+			c += weight * d * d;
+			w += weight;
+		}
+
+		void add(const Quadric& q)
+		{
+			a00 += q.a00; a11 += q.a11; a22 += q.a22;
+			a01 += q.a01; a02 += q.a02; a12 += q.a12;
+			b0 += q.b0; b1 += q.b1; b2 += q.b2;
+			c += q.c;
+			w += q.w;
+		}
+
+		// Mean squared distance of p to the planes.
+		float error(const float* p) const
+		{
+			float x = p[0], y = p[1], z = p[2];
+			float e = a00 * x * x + a11 * y * y + a22 * z * z + 2.0f * (a01 * x * y + a02 * x * z + a12 * y * z) +
+				2.0f * (b0 * x + b1 * y + b2 * z) + c;
+			return w > 0.0f ? std::fabs(e) / w : 0.0f;
+		}
+	};
+
+	static void triangleNormal(const float* a, const float* b, const float* c, float* n)
+	{
+		float e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+		float e2[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+		n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+		n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+		n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+	}
+
+	// Mark vertices that must stay put: every vertex of a position shared by several vertices (a seam), and every
+	// position on an edge that isn't matched by exactly one opposite edge (an open border or a non-manifold edge).
+	static void findLockedVertices(const uint32_t* indices, size_t numIndices, const std::vector<float>& pos,
+		size_t numVertices, std::vector<uint8_t>& locked)
+	{
+		// Group vertices by position.
+		std::vector<uint32_t> order(numVertices);
+		for (size_t v = 0; v < numVertices; ++v)
+			order[v] = (uint32_t)v;
+		auto less = [&](uint32_t a, uint32_t b) {
+			const float* pa = &pos[a * 3];
+			const float* pb = &pos[b * 3];
+			return pa[0] != pb[0] ? pa[0] < pb[0] : (pa[1] != pb[1] ? pa[1] < pb[1] : pa[2] < pb[2]);
+		};
+		std::sort(order.begin(), order.end(), less);
+		std::vector<uint32_t> remap(numVertices);
+		std::vector<uint8_t> lockedPosition(numVertices, 0);
+		for (size_t i = 0; i < numVertices;) {
+			size_t j = i + 1;
+			while (j < numVertices && !less(order[i], order[j]))
+				j++;
+			for (size_t k = i; k < j; ++k)
+				remap[order[k]] = order[i];
+			if (j - i > 1)
+				lockedPosition[order[i]] = 1;
+			i = j;
+		}
+
+		// Directed edges between positions. An edge is interior if it occurs once in each direction.
+		std::vector<uint64_t> edges;
+		edges.reserve(numIndices);
+		for (size_t i = 0; i + 2 < numIndices; i += 3) {
+			for (int e = 0; e < 3; ++e) {
+				uint32_t a = remap[indices[i + e]], b = remap[indices[i + (e + 1) % 3]];
+				edges.push_back((uint64_t(a) << 32) | b);
+			}
+		}
+		std::sort(edges.begin(), edges.end());
+		for (size_t i = 0; i < edges.size();) {
+			size_t j = i + 1;
+			while (j < edges.size() && edges[j] == edges[i])
+				j++;
+			uint32_t a = uint32_t(edges[i] >> 32), b = uint32_t(edges[i]);
+			uint64_t reverse = (uint64_t(b) << 32) | a;
+			auto r = std::equal_range(edges.begin(), edges.end(), reverse);
+			if (j - i != 1 || r.second - r.first != 1)
+				lockedPosition[a] = lockedPosition[b] = 1;
+			i = j;
+		}
+
+		locked.assign(numVertices, 0);
+		for (size_t v = 0; v < numVertices; ++v)
+			locked[v] = lockedPosition[remap[v]];
+	}
+
+	size_t simplifyMesh(uint32_t* destination, const uint32_t* indices, size_t numIndices, const float* positions,
+		size_t stride, size_t numVertices, size_t targetIndexCount, float targetError, float* resultError)
+	{
+		numIndices -= numIndices % 3;
+		std::copy(indices, indices + numIndices, destination);
+		if (resultError)
+			*resultError = 0.0f;
+		if (numIndices <= targetIndexCount || numVertices == 0)
+			return numIndices;
+
+		// Work on positions scaled into the unit cube, so errors are relative to the mesh's size.
+		std::vector<float> pos(numVertices * 3);
+		float lo[3] = { INFINITY, INFINITY, INFINITY }, hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+		for (size_t v = 0; v < numVertices; ++v) {
+			const float* p = (const float*)((const char*)positions + v * stride);
+			for (int k = 0; k < 3; ++k) {
+				lo[k] = std::min(lo[k], p[k]);
+				hi[k] = std::max(hi[k], p[k]);
+			}
+		}
+		float extent = std::max({ hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2] });
+		float scale = extent > 0.0f ? 1.0f / extent : 1.0f;
+		for (size_t v = 0; v < numVertices; ++v) {
+			const float* p = (const float*)((const char*)positions + v * stride);
+			for (int k = 0; k < 3; ++k)
+				pos[v * 3 + k] = (p[k] - lo[k]) * scale;
+		}
+
+		std::vector<uint8_t> locked;
+		findLockedVertices(destination, numIndices, pos, numVertices, locked);
+
+		// Each vertex starts with the planes of the triangles around it.
+		std::vector<Quadric> quadrics(numVertices);
+		for (size_t i = 0; i < numIndices; i += 3) {
+			const float* p0 = &pos[destination[i] * 3];
+			float n[3];
+			triangleNormal(p0, &pos[destination[i + 1] * 3], &pos[destination[i + 2] * 3], n);
+			float len = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+			if (len <= 0.0f)
+				continue;
+			n[0] /= len; n[1] /= len; n[2] /= len;
+			float d = -(n[0] * p0[0] + n[1] * p0[1] + n[2] * p0[2]);
+			for (int k = 0; k < 3; ++k)
+				quadrics[destination[i + k]].addPlane(n[0], n[1], n[2], d, len * 0.5f);
+		}
+
+		// Collapse in passes. Each pass gives every movable vertex its cheapest neighbour to collapse onto, then makes
+		// the cheapest collapses whose neighbourhoods don't overlap, so each can be checked on its own for flipped
+		// triangles.
+		float maxCost = targetError * targetError;
+		float worst = 0.0f;
+		std::vector<uint32_t> adjOffset(numVertices + 1), adj, collapse(numVertices);
+		std::vector<uint32_t> bestTarget(numVertices);
+		std::vector<float> bestCost(numVertices);
+		std::vector<uint32_t> candidates;
+		std::vector<uint8_t> touched(numVertices);
+		while (numIndices > targetIndexCount) {
+			// Triangles around each vertex (CSR).
+			std::fill(adjOffset.begin(), adjOffset.end(), 0);
+			for (size_t i = 0; i < numIndices; ++i)
+				adjOffset[destination[i] + 1]++;
+			for (size_t v = 0; v < numVertices; ++v)
+				adjOffset[v + 1] += adjOffset[v];
+			adj.resize(numIndices);
+			{
+				std::vector<uint32_t> fill(adjOffset.begin(), adjOffset.end() - 1);
+				for (size_t i = 0; i < numIndices; ++i)
+					adj[fill[destination[i]]++] = uint32_t(i / 3);
+			}
+
+			std::fill(bestCost.begin(), bestCost.end(), INFINITY);
+			for (size_t i = 0; i < numIndices; i += 3) {
+				for (int e = 0; e < 3; ++e) {
+					uint32_t a = destination[i + e], b = destination[i + (e + 1) % 3];
+					for (int dir = 0; dir < 2; ++dir, std::swap(a, b)) {
+						if (locked[a] || a == b)
+							continue;
+						float cost = quadrics[a].error(&pos[b * 3]);
+						if (cost < bestCost[a]) {
+							bestCost[a] = cost;
+							bestTarget[a] = b;
+						}
+					}
+				}
+			}
+			candidates.clear();
+			for (size_t v = 0; v < numVertices; ++v) {
+				if (bestCost[v] <= maxCost)
+					candidates.push_back((uint32_t)v);
+			}
+			std::sort(candidates.begin(), candidates.end(), [&](uint32_t a, uint32_t b) { return bestCost[a] < bestCost[b]; });
+
+			// Each collapse removes about two triangles.
+			size_t budget = (numIndices - targetIndexCount) / 6 + 1;
+			size_t collapses = 0;
+			std::fill(touched.begin(), touched.end(), 0);
+			for (size_t v = 0; v < numVertices; ++v)
+				collapse[v] = (uint32_t)v;
+			for (uint32_t v0 : candidates) {
+				if (collapses >= budget)
+					break;
+				uint32_t v1 = bestTarget[v0];
+				if (touched[v0] || touched[v1])
+					continue;
+
+				// Reject the collapse if any remaining triangle around v0 would turn over.
+				bool flips = false;
+				for (uint32_t k = adjOffset[v0]; k < adjOffset[v0 + 1] && !flips; ++k) {
+					const uint32_t* t = &destination[adj[k] * 3];
+					if (t[0] == v1 || t[1] == v1 || t[2] == v1)
+						continue;
+					const float* p[3];
+					const float* q[3];
+					for (int c = 0; c < 3; ++c) {
+						p[c] = &pos[t[c] * 3];
+						q[c] = t[c] == v0 ? &pos[v1 * 3] : p[c];
+					}
+					float n0[3], n1[3];
+					triangleNormal(p[0], p[1], p[2], n0);
+					triangleNormal(q[0], q[1], q[2], n1);
+					flips = n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2] <= 0.0f;
+				}
+				if (flips)
+					continue;
+
+				for (uint32_t k = adjOffset[v0]; k < adjOffset[v0 + 1]; ++k) {
+					const uint32_t* t = &destination[adj[k] * 3];
+					touched[t[0]] = touched[t[1]] = touched[t[2]] = 1;
+				}
+				collapse[v0] = v1;
+				quadrics[v1].add(quadrics[v0]);
+				worst = std::max(worst, bestCost[v0]);
+				collapses++;
+			}
+			if (collapses == 0)
+				break;
+
+			// Rewrite the triangles and drop the ones that collapsed to a line.
+			size_t out = 0;
+			for (size_t i = 0; i < numIndices; i += 3) {
+				uint32_t a = collapse[destination[i]], b = collapse[destination[i + 1]], c = collapse[destination[i + 2]];
+				if (a == b || b == c || a == c)
+					continue;
+				destination[out++] = a;
+				destination[out++] = b;
+				destination[out++] = c;
+			}
+			numIndices = out;
+		}
+
+		if (resultError)
+			*resultError = std::sqrt(worst);
+		return numIndices;
+	}
+}
@@ -1,9 +1,94 @@
 #include "structs.hpp"
+#include <algorithm>
+#include <cmath>
+#include <map>
 
 namespace TDModelView 
 {
+	std::shared_ptr<Texture> TextureBank::acquire(const std::string& filename, bool* created)
+	{
+		if (created)
+			*created = false;
+		std::lock_guard<std::mutex> lock(table->mutex);
+		auto it = table->index.find(filename);
+		if (it != table->index.end()) {
+			std::shared_ptr<Texture> tx = table->slots[it->second].lock();
+			if (tx)
+				return tx;
+		}
+
+		unsigned int slot = 0;
+		if (table->freeSlots.size()) {
+			slot = table->freeSlots.back();
+			table->freeSlots.pop_back();
+		}
+		else {
+			slot = table->slots.size();
+			table->slots.emplace_back();
+		}
+
+		// The deleter frees the GL texture and returns the slot once the last handle is gone.
+		std::weak_ptr<SlotTable> weakTable = table;
+		std::shared_ptr<Texture> tx(new Texture(), [weakTable, slot](Texture* t) {
+			std::string path = t->filepath;
+			t->clear();
+			delete t;
+			std::shared_ptr<SlotTable> tbl = weakTable.lock();
+			if (!tbl)
+				return;
+			std::lock_guard<std::mutex> lock(tbl->mutex);
+			auto it = tbl->index.find(path);
+			if (it != tbl->index.end() && it->second == slot)
+				tbl->index.erase(it);
+			tbl->freeSlots.push_back(slot);
+		});
+		tx->filepath = filename;
+		table->slots[slot] = tx;
+		table->index[filename] = slot;
+		if (created)
+			*created = true;
+		return tx;
+	}
+
+	std::shared_ptr<Texture> TextureBank::add(std::string filename, std::string dir)
+	{
+		bool created = false;
+		std::shared_ptr<Texture> tx = acquire(checkFilepath(filename, dir), &created);
+		if (created)
+			tx->upload(Texture::decode(filename, dir));
+		return tx;
+	}
+
+	void TextureBank::clear()
+	{
+		// Live handles keep their textures; the bank just stops indexing them.
+		table = std::make_shared<SlotTable>();
+	}
+
+	std::shared_ptr<Texture> TextureBank::getPtr(const std::string& filename)
+	{
+		std::lock_guard<std::mutex> lock(table->mutex);
+		auto it = table->index.find(filename);
+		if (it == table->index.end())
+			return nullptr;
+		return table->slots[it->second].lock();
+	}
+
+	std::vector<std::shared_ptr<Texture>> TextureBank::handles()
+	{
+		std::vector<std::shared_ptr<Texture>> result;
+		std::lock_guard<std::mutex> lock(table->mutex);
+		for (auto& w : table->slots) {
+			std::shared_ptr<Texture> tx = w.lock();
+			if (tx)
+				result.push_back(tx);
+		}
+		return result;
+	}
+
 	void TextureBank::remove(std::string filename) 
 	{
+		// Drop every material reference; the texture itself goes away with its last handle.
 		for (int i = 0; i < eng->scene->materials.size(); ++i) {
 			for (int j = 0; j < eng->scene->materials[i]->textures.size(); ++j)
 			{
@@ -14,13 +99,12 @@ namespace TDModelView
 				}
 			}
 		}
-		for (int i = 0; i < textures.size(); ++i) {
-			if (textures[i].filepath == filename)
-			{
-				textures[i].clear();
-				textures.erase(textures.begin() + i);
-			}
-		}
+	}
+
+	size_t TextureBank::size()
+	{
+		std::lock_guard<std::mutex> lock(table->mutex);
+		return table->index.size();
 	}
 
 	void Camera::Update()
@@ -37,68 +121,955 @@ namespace TDModelView
 		VP = P * V;
 	}
 
-	void Renderer::Render() 
+	// Round-to-nearest float -> IEEE half. Denormals flush to zero, out of range values saturate to infinity.
+	static uint16_t floatToHalf(float f)
 	{
-		if (eng->windowClose || eng->scene->meshes.size() == 0 || eng->ui->showFileDialog)
+		uint32_t x;
+		memcpy(&x, &f, sizeof(x));
+		uint16_t sign = (x >> 16) & 0x8000;
+		uint32_t absx = x & 0x7fffffff;
+		if (absx >= 0x7f800000)// inf or nan
+			return sign | 0x7c00 | (absx > 0x7f800000 ? 0x200 : 0);
+		int exp = int(absx >> 23) - 127 + 15;
+		if (exp >= 31)
+			return sign | 0x7c00;
+		if (exp <= 0)
+			return sign;
+		uint32_t mant = absx & 0x7fffff;
+		uint16_t h = sign | uint16_t(exp << 10) | uint16_t(mant >> 13);
+		if ((mant & 0x1fff) > 0x1000 || ((mant & 0x1fff) == 0x1000 && (h & 1)))
+			h++;// carries into the exponent correctly
+		return h;
+	}
+
+	static int16_t toSnorm16(float v)
+	{
+		v = v < -1.0f ? -1.0f : (v > 1.0f ? 1.0f : v);
+		return (int16_t)std::lround(v * 32767.0f);
+	}
+
+	// Octahedral mapping of a unit vector onto the [-1,1]^2 square (Cigolle et al. 2014).
+	static void octEncode(glm::vec3 n, int16_t out[2])
+	{
+		float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+		if (l1 <= 0.0f) {
+			out[0] = out[1] = 0;
+			return;
+		}
+		float x = n.x / l1, y = n.y / l1;
+		if (n.z < 0.0f) {
+			float ox = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+			float oy = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+			x = ox;
+			y = oy;
+		}
+		out[0] = toSnorm16(x);
+		out[1] = toSnorm16(y);
+	}
+
+	void Mesh::packVertices(std::vector<PackedVertex>& out)
+	{
+		// Quantize against the bounds of the vertices themselves, which may differ from bbox after rescaling.
+		glm::vec3 lo(std::numeric_limits<float>::max()), hi(-std::numeric_limits<float>::max());
+		if (vertices.size())
+			positionBounds(&vertices[0].position.x, vertices.size(), sizeof(Vertex), lo, hi);
+		else
+			lo = hi = glm::vec3(0.0f);
+		positionOffset = lo;
+		positionScale = hi - lo;
+		glm::vec3 inv;
+		for (int c = 0; c < 3; ++c)
+			inv[c] = positionScale[c] > 0.0f ? 65535.0f / positionScale[c] : 0.0f;
+
+		out.resize(vertices.size());
+		for (size_t i = 0; i < vertices.size(); ++i) {
+			const Vertex& v = vertices[i];
+			PackedVertex& p = out[i];
+			for (int c = 0; c < 3; ++c)
+				p.position[c] = (uint16_t)std::lround(glm::clamp((v.position[c] - lo[c]) * inv[c], 0.0f, 65535.0f));
+			p.position[3] = glm::dot(glm::cross(v.normal, v.tangent), v.bitangent) < 0.0f ? 0 : 65535;
+			p.uv[0] = floatToHalf(v.uv.x);
+			p.uv[1] = floatToHalf(v.uv.y);
+			octEncode(v.normal, p.normal);
+			octEncode(v.tangent, p.tangent);
+		}
+	}
+
+	// Closest Moller-Trumbore hit of an object space ray against a stored mesh's triangles, if nearer than 'best'.
+	static void intersectTriangles(const Vertex* verts, const uint32_t* inds, const GeometryStore::Range& r,
+		const glm::vec3& o, const glm::vec3& d, float& best)
+	{
+		for (uint32_t i = 0; i + 2 < r.numIndices; i += 3) {
+			if (inds[i] >= r.numVertices || inds[i + 1] >= r.numVertices || inds[i + 2] >= r.numVertices)
+				continue;
+			const glm::vec3& v0 = verts[inds[i]].position;
+			glm::vec3 e1 = verts[inds[i + 1]].position - v0;
+			glm::vec3 e2 = verts[inds[i + 2]].position - v0;
+			glm::vec3 p = glm::cross(d, e2);
+			float det = glm::dot(e1, p);
+			if (std::abs(det) < 1e-12f)
+				continue;
+			float invDet = 1.0f / det;
+			glm::vec3 s = o - v0;
+			float u = glm::dot(s, p) * invDet;
+			if (u < 0.0f || u > 1.0f)
+				continue;
+			glm::vec3 q = glm::cross(s, e1);
+			float v = glm::dot(d, q) * invDet;
+			if (v < 0.0f || u + v > 1.0f)
+				continue;
+			float tri = glm::dot(e2, q) * invDet;
+			if (tri >= 0.0f && tri < best)
+				best = tri;
+		}
+	}
+
+	bool Mesh::intersect(const glm::vec3& origin, const glm::vec3& dir, float& t) const
+	{
+		if (!hasGeometry())
+			return false;
+
+		// Intersect in object space, once per instance. The ray parameter is unchanged by the affine transform, so t
+		// stays comparable across instances.
+		float best = std::numeric_limits<float>::max();
+		for (GLuint k = 0; k < instanceCount(); ++k) {
+			glm::mat4 inv = glm::inverse(instances.empty() ? modelMatrix : modelMatrix * instances[k]);
+			glm::vec3 o = glm::vec3(inv * glm::vec4(origin, 1.0f));
+			glm::vec3 d = glm::vec3(inv * glm::vec4(dir, 0.0f));
+			intersectTriangles(store->vertices(storeIndex), store->indices(storeIndex), store->range(storeIndex), o, d, best);
+		}
+		if (best == std::numeric_limits<float>::max())
+			return false;
+		t = best;
+		return true;
+	}
+
+	void Mesh::bakeTransform(const glm::mat4& M)
+	{
+		if (vertices.empty())
+			return;
+		TDModelView::transformPositions(&vertices[0].position.x, vertices.size(), sizeof(Vertex), M);
+		glm::mat3 L = glm::mat3(M);
+		glm::mat3 N = glm::transpose(glm::inverse(L));
+		auto unit = [](glm::vec3 v) { float l = glm::length(v); return l > 0.0f ? v / l : v; };
+		for (auto& v : vertices) {
+			v.normal = unit(N * v.normal);
+			v.tangent = unit(L * v.tangent);
+			v.bitangent = unit(L * v.bitangent);
+		}
+		// A mirroring transform turns the triangles inside out, so restore their winding.
+		if (glm::determinant(L) < 0.0f) {
+			for (size_t i = 0; i + 2 < indices.size(); i += 3)
+				std::swap(indices[i + 1], indices[i + 2]);
+		}
+		recalcBounds();
+	}
+
+	// Move each vertex v to remap[v] by following the permutation's cycles, so no second vertex array is needed.
+	// Consumes 'remap'.
+	static void permuteVertices(ArenaVector<Vertex>& vertices, std::vector<uint32_t>& remap)
+	{
+		for (uint32_t v = 0; v < vertices.size(); ++v) {
+			while (remap[v] != v) {
+				uint32_t to = remap[v];
+				std::swap(vertices[v], vertices[to]);
+				std::swap(remap[v], remap[to]);
+			}
+		}
+	}
+
+	size_t Mesh::optimize(bool reduceOverdraw, size_t& missesBefore, size_t& missesAfter)
+	{
+		missesBefore = missesAfter = 0;
+		size_t nv = vertices.size(), ni = indices.size() - indices.size() % 3;
+		if (ni < 6)
+			return 0;
+		for (size_t i = 0; i < ni; ++i) {
+			if (indices[i] >= nv)
+				return 0;
+		}
+		missesBefore = countCacheMisses(indices.data(), ni, nv);
+		optimizeVertexCache(indices.data(), ni, nv);
+		if (reduceOverdraw)
+			optimizeOverdraw(indices.data(), ni, &vertices[0].position.x, sizeof(Vertex), nv);
+
+		std::vector<uint32_t> remap;
+		buildFetchRemap(indices.data(), ni, nv, remap);
+		// A second vertex array would double the arena's peak.
+		permuteVertices(vertices, remap);
+		missesAfter = countCacheMisses(indices.data(), ni, nv);
+		return ni / 3;
+	}
+
+	size_t Mesh::buildLODs(size_t maxLevels, float maxError)
+	{
+		// Below this there is little left to gain from fewer triangles.
+		const size_t MIN_LOD_TRIANGLES = 64;
+		lods.clear();
+		lodIndices.clear();
+		size_t nv = vertices.size(), ni = indices.size() - indices.size() % 3;
+		if (ni / 3 < MIN_LOD_TRIANGLES * 2)
+			return 0;
+		for (size_t i = 0; i < ni; ++i) {
+			if (indices[i] >= nv)
+				return 0;
+		}
+
+		// Simplify each level from the one before. The collapses add up, so its error is the sum of the steps.
+		std::vector<uint32_t> source(indices.begin(), indices.begin() + ni), simplified(ni);
+		float error = 0.0f;
+		while (lods.size() < maxLevels && ni / 3 >= MIN_LOD_TRIANGLES * 2) {
+			float stepError = 0.0f;
+			size_t n = simplifyMesh(simplified.data(), source.data(), ni, &vertices[0].position.x, sizeof(Vertex), nv,
+				ni / 2, maxError - error, &stepError);
+			if (n == 0 || n > ni * 3 / 4)
+				break;
+			error += stepError;
+			optimizeVertexCache(simplified.data(), n, nv);
+			lods.push_back({ GLuint(indices.size() + lodIndices.size()), GLuint(n), error });
+			lodIndices.insert(lodIndices.end(), simplified.begin(), simplified.begin() + n);
+			source.assign(simplified.begin(), simplified.begin() + n);
+			ni = n;
+		}
+		return lods.size();
+	}
+
+	size_t Mesh::buildMeshlets(bool optimized, size_t& missesBefore, size_t& missesAfter)
+	{
+		meshlets.clear();
+		missesBefore = missesAfter = 0;
+		size_t nv = vertices.size(), ni = indices.size() - indices.size() % 3;
+		if (ni / 3 <= MESHLET_MAX_TRIANGLES)
+			return 0;
+		for (size_t i = 0; i < ni; ++i) {
+			if (indices[i] >= nv)
+				return 0;
+		}
+		if (optimized)
+			missesBefore = countCacheMisses(indices.data(), ni, nv);
+		size_t count = TDModelView::buildMeshlets(indices.data(), ni, &vertices[0].position.x, sizeof(Vertex), nv,
+			MESHLET_MAX_VERTICES, MESHLET_MAX_TRIANGLES, meshlets);
+		if (!optimized || count == 0)
+			return count;
+
+		// Clustering regroups the triangles and loses the cache order optimize() gave them, so reorder each cluster's
+		// own range again. A cluster keeps the same triangles in the same place, so its bounds and cone stay valid.
+		// The overdraw order isn't restored: clusters stay in the order they were grown, which keeps neighbours next
+		// to each other for merged draws. The vertices are numbered in a local range first, since the optimizer's
+		// work is proportional to the vertex count it's given.
+		std::vector<uint32_t> local(nv, UINT32_MAX), used, cluster;
+		for (const Meshlet& c : meshlets) {
+			GLuint* first = indices.data() + c.firstIndex;
+			used.clear();
+			cluster.resize(c.indexCount);
+			for (uint32_t i = 0; i < c.indexCount; ++i) {
+				uint32_t& l = local[first[i]];
+				if (l == UINT32_MAX) {
+					l = (uint32_t)used.size();
+					used.push_back(first[i]);
+				}
+				cluster[i] = l;
+			}
+			optimizeVertexCache(cluster.data(), cluster.size(), used.size());
+			for (uint32_t i = 0; i < c.indexCount; ++i)
+				first[i] = used[cluster[i]];
+			for (uint32_t v : used)
+				local[v] = UINT32_MAX;
+		}
+
+		// Renumber the vertices in the new fetch order. The LOD levels share them, so their indices follow.
+		std::vector<uint32_t> remap;
+		buildFetchRemap(indices.data(), ni, nv, remap);
+		for (GLuint& i : lodIndices)
+			i = remap[i];
+		permuteVertices(vertices, remap);
+		missesAfter = countCacheMisses(indices.data(), ni, nv);
+		return count;
+	}
+
+	std::vector<std::shared_ptr<Mesh>> Mesh::splitForShortIndices()
+	{
+		std::vector<std::shared_ptr<Mesh>> chunks;
+		size_t ni = indices.size() - indices.size() % 3;
+		if (vertices.size() <= MAX_SHORT_INDEX_VERTICES || ni == 0)
+			return chunks;
+
+		// Greedily add triangles to the current chunk until one would push it past the vertex limit.
+		Arena* arena = vertices.get_allocator().arena;
+		std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+		std::vector<uint32_t> used;// vertices of the current chunk, to reset 'remap' when it's done
+		std::shared_ptr<Mesh> chunk;
+		auto finishChunk = [&]() {
+			if (!chunk)
+				return;
+			for (uint32_t v : used)
+				remap[v] = UINT32_MAX;
+			used.clear();
+			chunk->recalcBounds();
+			chunks.push_back(chunk);
+			chunk.reset();
+		};
+		for (size_t i = 0; i < ni; i += 3) {
+			int newVerts = 0;
+			for (int k = 0; k < 3; ++k) {
+				if (indices[i + k] >= vertices.size())
+					return std::vector<std::shared_ptr<Mesh>>();
+				newVerts += remap[indices[i + k]] == UINT32_MAX ? 1 : 0;
+			}
+			if (chunk && chunk->vertices.size() + newVerts > MAX_SHORT_INDEX_VERTICES)
+				finishChunk();
+			if (!chunk) {
+				chunk = std::make_shared<Mesh>(arena);
+				chunk->material = material;
+				chunk->modelMatrix = modelMatrix;
+				chunk->instances = instances;
+				chunk->compact = compact;
+				chunk->vertices.reserve(std::min(vertices.size(), MAX_SHORT_INDEX_VERTICES));
+			}
+			for (int k = 0; k < 3; ++k) {
+				uint32_t v = indices[i + k];
+				if (remap[v] == UINT32_MAX) {
+					remap[v] = (uint32_t)chunk->vertices.size();
+					chunk->vertices.push_back(vertices[v]);
+					used.push_back(v);
+				}
+				chunk->indices.push_back(remap[v]);
+			}
+		}
+		finishChunk();
+		return chunks;
+	}
+
+	void Mesh::calculateTangents()
+	{
+		generateTangents(vertices.data(), vertices.size(), indices.size() ? indices.data() : nullptr, indices.size(),
+			eng->threadPool.get());
+	}
+
+	void Scene::normalize()
+	{
+		// Calculate dimensions for rescaling models to make them fit scene limits.
+		recalcBounds();
+		float scaleFactor = 1.0f;
+		if (bbox.maxDim() < minSceneBound) {
+			// Flat models have no thickness to scale up, so fall back to their largest dimension.
+			float dim = bbox.minDim() > 0.0f ? bbox.minDim() : bbox.maxDim();
+			if (dim > 0.0f)
+				scaleFactor = minSceneBound / dim;
+		}
+		else if (bbox.minDim() > maxSceneBound)
+			scaleFactor = maxSceneBound / bbox.maxDim();
+
+		if (scaleFactor < 1.0e-6f)
+			scaleFactor = 1.0e-6f;
+
+		for (auto x : meshes)
+		{
+			// Add dummy material if necessary.
+			if (x->material == nullptr)
+				x->material = std::shared_ptr<Material>();
+		}
+		if (scaleFactor == 1.0f)
+			return;
+
+		// Apply scaling to vertices, one pool task per mesh, and refresh the bounds it changed. Instanced meshes scale
+		// their instance transforms instead, since their vertices are shared by every copy.
+		glm::mat4 S = glm::mat4(1.0f);
+		S[0][0] = S[1][1] = S[2][2] = scaleFactor;
+		std::vector<std::future<void>> tasks;
+		tasks.reserve(meshes.size());
+		for (auto& x : meshes) {
+			Mesh* m = x.get();
+			if (m->instances.size()) {
+				for (auto& inst : m->instances)
+					inst = S * inst;
+				continue;
+			}
+			tasks.push_back(eng->threadPool->submit([m, scaleFactor]() {
+				m->scalePositions(scaleFactor, glm::vec3(0.0f));
+				m->recalcBounds();
+			}));
+		}
+		for (auto& t : tasks)
+			eng->threadPool->wait(t);
+		recalcBounds();
+	}
+
+	void Renderer::bindTexture(int unit, GLuint id)
+	{
+		if (bound.textures[unit] == (GLint)id)
+			return;
+		if (bound.activeUnit != unit) {
+			glActiveTexture(GL_TEXTURE0 + unit);
+			bound.activeUnit = unit;
+		}
+		glBindTexture(GL_TEXTURE_2D, id);
+		bound.textures[unit] = id;
+		stateChanges++;
+	}
+
+	void Renderer::bindMaterial(Material* material)
+	{
+		// Material and textures are only rebound when they differ from the previous draw.
+		if (material->uboIndex != bound.material) {
+			if (material->uboIndex >= 0)
+				glBindBufferRange(GL_UNIFORM_BUFFER, MATERIAL_BLOCK_BINDING, eng->scene->materialUBO,
+					material->uboIndex * eng->scene->materialStride, sizeof(MaterialBlock));
+			bound.material = material->uboIndex;
+			stateChanges++;
+		}
+		bindMaterialTextures(material);
+	}
+
+	void Renderer::bindMaterialTextures(Material* material)
+	{
+		for (int i = 0; i < aiTextureType_UNKNOWN; ++i){
+			if (material->HasTexture(aiTextureType(i)))
+				bindTexture(i, material->textures[i]->id);
+			else if (i == (int)aiTextureType_REFLECTION)
+				bindTexture(i, hdr_tx->id);
+		}
+	}
+
+	void Renderer::setFrameUniforms(Shader* s)
+	{
+		s->setVec3("cameraPosition", eng->scene->m_Camera.position);
+		s->setVec4("lightVec", eng->scene->m_Light);
+		s->setFloat("ambientLightBlend", ambientLightBlend);
+		s->setFloat("aoStrength", aoStrength);
+		s->setFloat("reflectionStrength", reflectionStrength);
+		s->setVec2("resolution", resolution);
+	}
+
+	uint32_t Renderer::shaderFeatures(Material* material, uint32_t pass) const
+	{
+		// Depth-only passes keep just the maps that move vertices or decide what's discarded.
+		static const uint32_t DEPTH_MAPS = 1u << aiTextureType_HEIGHT;
+		static const uint32_t ALPHA_TEST_MAPS = DEPTH_MAPS | (1u << aiTextureType_DISPLACEMENT) |
+			(1u << aiTextureType_DIFFUSE) | (1u << aiTextureType_BASE_COLOR) | (1u << aiTextureType_OPACITY);
+		uint32_t features = material->textureMask() & SHADER_MAPS;
+		if (useModelNormals)
+			features &= ~(1u << aiTextureType_NORMALS);
+		if (pass & SHADER_DEPTH_ONLY)
+			features &= (pass & SHADER_ALPHA_TEST) ? ALPHA_TEST_MAPS : DEPTH_MAPS;
+		else if (material->useBumpMap)
+			features |= SHADER_BUMP_MAP;
+		return features | pass;
+	}
+
+	uint32_t Renderer::variantSettings() const
+	{
+		return uint32_t(useModelNormals) | (uint32_t(depthPrepass) << 1) | (uint32_t(indirectDraw && indirectSupported) << 2);
+	}
+
+	void Renderer::prepareVariants()
+	{
+		// Compile the permutations the scene's materials will draw with now, rather than stalling on them mid-frame.
+		// Depth-only variants keep so few maps that building both kinds for every opaque material costs little.
+		uint32_t path = indirectDraw && indirectSupported ? SHADER_INDIRECT : 0;
+		for (auto& item : drawQueue) {
+			Material* material = item.mesh->material.get();
+			variant(shaderFeatures(material, path));
+			if (depthPrepass && !material->translucent()) {
+				variant(shaderFeatures(material, path | SHADER_DEPTH_ONLY));
+				variant(shaderFeatures(material, path | SHADER_DEPTH_ONLY | SHADER_ALPHA_TEST));
+			}
+		}
+		preparedSettings = variantSettings();
+	}
+
+	Renderer::ShaderVariant& Renderer::variant(uint32_t features)
+	{
+		auto it = variants.find(features);
+		if (it == variants.end()) {
+			ShaderVariant v;
+			v.shader = defaultShader(features);
+			v.uniforms.init(v.shader);
+			it = variants.emplace(features, v).first;
+		}
+		return it->second;
+	}
+
+	Renderer::ShaderVariant& Renderer::useVariant(uint32_t features)
+	{
+		// Programs are only switched when the permutation changes, which the draw order keeps rare.
+		ShaderVariant& v = variant(features);
+		if (bound.program != (GLint)v.shader->ID) {
+			v.shader->use();
+			bound.program = v.shader->ID;
+			stateChanges++;
+		}
+		if (v.frame != frameNumber) {
+			setFrameUniforms(v.shader);
+			v.frame = frameNumber;
+		}
+		return v;
+	}
+
+	void Renderer::setDrawUniforms(Shader* s, const DrawUniforms& u, Mesh* m)
+	{
+		s->setMat4(u.modelMatrix, m->modelMatrix);
+		glm::mat4 MVP = eng->scene->m_Camera.VP * m->modelMatrix;
+		s->setMat4(u.modelViewProjection, MVP);
+		glm::mat3 nMat = glm::transpose(glm::inverse(glm::mat3(m->modelMatrix)));
+		s->setMat3(u.normalMatrix, nMat);
+		s->setBool(u.compactVertices, m->compact);
+		s->setVec3(u.positionOffset, m->positionOffset);
+		s->setVec3(u.positionScale, m->positionScale);
+		s->setBool(u.instanced, !m->instances.empty());
+	}
+
+	void Renderer::buildDrawQueue()
+	{
+		// Sort draws so meshes sharing a texture set, and within that a vertex format, index type and material, are
+		// submitted back to back.
+		std::map<std::array<GLuint, aiTextureType_UNKNOWN>, uint64_t> textureSets;
+		drawQueue.clear();
+		drawQueue.reserve(eng->scene->meshes.size());
+		for (size_t n = 0; n < eng->scene->meshes.size(); ++n) {
+			auto& m = eng->scene->meshes[n];
+			std::array<GLuint, aiTextureType_UNKNOWN> ids;
+			for (int i = 0; i < aiTextureType_UNKNOWN; ++i)
+				ids[i] = m->material->HasTexture(aiTextureType(i)) ? m->material->textures[i]->id : 0;
+			auto it = textureSets.emplace(ids, textureSets.size()).first;
+			DrawItem item;
+			item.key = (it->second << 32) | (uint64_t(m->compact) << 31) | (uint64_t(m->indexType == GL_UNSIGNED_SHORT) << 30) |
+				uint64_t(uint32_t(m->material->uboIndex + 1) & 0x3FFFFFFF);
+			item.mesh = m.get();
+			item.meshIndex = (uint32_t)n;
+			drawQueue.push_back(item);
+		}
+		std::stable_sort(drawQueue.begin(), drawQueue.end(), [](const DrawItem& a, const DrawItem& b) { return a.key < b.key; });
+
+		// World space bounds in queue order for culling.
+		drawBounds.clear();
+		for (auto& item : drawQueue) {
+			glm::vec3 wMin, wMax;
+			item.mesh->worldBounds(wMin, wMax);
+			drawBounds.push(wMin, wMax);
+		}
+		drawVisible.assign(drawQueue.size(), 1);
+		drawLevel.assign(drawQueue.size(), 0);
+		drawQueueRevision = eng->scene->revision;
+
+		prepareVariants();
+		commandsDirty = true;
+
+		// World space spheres and normal cones of the meshlets. Model matrices only scale uniformly, so a cone keeps its
+		// angle and a sphere its shape. Instanced meshes are drawn whole.
+		drawClusters.assign(drawQueue.size(), ClusterRange{ 0, 0 });
+		clusterBounds.clear();
+		clusterCones.clear();
+		for (size_t d = 0; d < drawQueue.size(); ++d) {
+			Mesh* m = drawQueue[d].mesh;
+			if (m->meshlets.empty() || !m->instances.empty())
+				continue;
+			glm::mat3 L = glm::mat3(m->modelMatrix);
+			glm::mat3 N = glm::transpose(glm::inverse(L));
+			float scale = std::max(glm::length(L[0]), std::max(glm::length(L[1]), glm::length(L[2])));
+			drawClusters[d] = { (uint32_t)clusterBounds.size(), (uint32_t)m->meshlets.size() };
+			for (auto& c : m->meshlets) {
+				glm::vec3 center = glm::vec3(m->modelMatrix * glm::vec4(c.center[0], c.center[1], c.center[2], 1.0f));
+				glm::vec3 radius = glm::vec3(c.radius * scale);
+				clusterBounds.push(center - radius, center + radius);
+				glm::vec3 axis = glm::normalize(N * glm::vec3(c.coneAxis[0], c.coneAxis[1], c.coneAxis[2]));
+				clusterCones.push_back(glm::vec4(axis, c.coneCutoff));
+			}
+		}
+		clusterVisible.assign(clusterBounds.size(), 0);
+
+		// Last frame's depth may include meshes that are gone now, so occlusion culling waits for a fresh capture.
+		// Cluster bounds follow the draws' so the classic path can test both at once.
+		if (occlusionSupported) {
+			BoxArray bounds = drawBounds;
+			bounds.append(clusterBounds);
+			occlusion.setBounds(bounds);
+			occlusion.invalidate();
+		}
+	}
+
+	void Renderer::buildCommands()
+	{
+		// One command and one DrawData per queued draw, in queue order, so a batch's first draw plus gl_DrawID finds
+		// the draw's data. Draws share a batch while their texture set, vertex format and index type (the key above
+		// the material bits), shader permutation and translucency stay the same.
+		std::vector<DrawData> drawData(drawQueue.size());
+		commands.resize(drawQueue.size());
+		batches.clear();
+		for (size_t d = 0; d < drawQueue.size(); ++d) {
+			Mesh* m = drawQueue[d].mesh;
+			const GeometryBuffer::Allocation& a = m->gpu->allocation(m->gpuHandle);
+			DrawCommand& c = commands[d];
+			c.count = m->lodIndexCount(drawLevel[d]);
+			c.instanceCount = drawVisible[d] ? m->instanceCount() : 0;
+			c.firstIndex = GLuint(a.indexOffset / m->indexSize()) + m->lodFirstIndex(drawLevel[d]);
+			c.baseVertex = (GLint)a.firstVertex;
+			c.baseInstance = (GLuint)a.firstInstance;
+			DrawData& dd = drawData[d];
+			dd.modelMatrix = m->modelMatrix;
+			dd.normalMatrix = glm::mat4(glm::transpose(glm::inverse(glm::mat3(m->modelMatrix))));
+			dd.positionOffset = glm::vec4(m->positionOffset, 0.0f);
+			dd.positionScale = glm::vec4(m->positionScale, 0.0f);
+			dd.materialIndex = (uint32_t)std::max(m->material->uboIndex, 0);
+			dd.compactVertices = m->compact;
+			dd.instanced = !m->instances.empty();
+			if (batches.empty() || (drawQueue[d].key >> 30) != (drawQueue[batches.back().first].key >> 30) ||
+				m->material->useBumpMap != drawQueue[batches.back().first].mesh->material->useBumpMap ||
+				m->material->translucent() != batches.back().translucent) {
+				DrawBatch b = { (uint32_t)d, 0, m->vao(), m->indexType, false, m->material->translucent() };
+				batches.push_back(b);
+			}
+			batches.back().count++;
+			batches.back().alphaTested |= m->material->alphaTested();
+		}
+		if (!drawDataBuffer)
+			glCreateBuffers(1, &drawDataBuffer);
+		if (!commandBuffer)
+			glCreateBuffers(1, &commandBuffer);
+		glNamedBufferData(drawDataBuffer, drawData.size() * sizeof(DrawData), drawData.data(), GL_STATIC_DRAW);
+		glNamedBufferData(commandBuffer, commands.size() * sizeof(DrawCommand), commands.data(), GL_DYNAMIC_DRAW);
+		commandsDirty = false;
+		commandGeometryRevision = eng->scene->buffers ? eng->scene->buffers->revision() : 0;
+	}
+
+	void Renderer::selectLevels()
+	{
+		// A level's error is relative to its mesh's largest extent, which is never more than the diagonal of the draw's
+		// world bounds. Project that diagonal at the bounds' nearest possible distance and take the coarsest level whose
+		// error covers no more than lodPixelError pixels there.
+		std::fill(drawLevel.begin(), drawLevel.end(), 0);
+		if (!levelOfDetail || resolution.y <= 0.0f)
+			return;
+		const Camera& camera = eng->scene->m_Camera;
+		float pixelsPerUnit = resolution.y / (2.0f * std::tan(camera.fov_rad * 0.5f));// at distance 1
+		for (size_t d = 0; d < drawQueue.size(); ++d) {
+			Mesh* m = drawQueue[d].mesh;
+			if (!drawVisible[d] || m->lods.empty())
+				continue;
+			glm::vec3 center(drawBounds.cx[d], drawBounds.cy[d], drawBounds.cz[d]);
+			glm::vec3 extent(drawBounds.ex[d], drawBounds.ey[d], drawBounds.ez[d]);
+			float radius = glm::length(extent);
+			float distance = glm::length(center - camera.position) - radius;
+			if (distance <= camera.zNear)
+				continue;
+			float pixels = 2.0f * radius * pixelsPerUnit / distance;
+			unsigned int level = 0;
+			while (level < m->lods.size() && m->lods[level].error * pixels <= lodPixelError)
+				level++;
+			drawLevel[d] = (uint8_t)level;
+		}
+	}
+
+	void Renderer::cullClusters(const Frustum& frustum)
+	{
+		// Clusters of draws that are hidden, drawn at a coarser level or drawn whole stay cleared, so occlusion culling
+		// skips them too.
+		std::fill(clusterVisible.begin(), clusterVisible.end(), 0);
+		culledClusters = 0;
+		if (!clusterCulling)
 			return;
-		shader->use();
-
-		// static uniform locs.
-		static GLuint UcameraPosition = glGetUniformLocation(shader->ID, "cameraPosition");
-		static GLuint Ulvec = glGetUniformLocation(shader->ID, "lightVec");
-		static GLuint Umodmat = glGetUniformLocation(shader->ID, "modelMatrix");
-		static GLuint Umvp = glGetUniformLocation(shader->ID, "modelViewProjection");
-		static GLuint Unmat = glGetUniformLocation(shader->ID, "normalMatrix");
-		static GLuint UuseBmaps = glGetUniformLocation(shader->ID, "useBumpMap");
-		static GLuint UambLightBlend = glGetUniformLocation(shader->ID, "ambientLightBlend");
-		static GLuint UaoStrength = glGetUniformLocation(shader->ID, "aoStrength");
-		static GLuint UreflStr = glGetUniformLocation(shader->ID, "reflectionStrength");
-		static GLuint Uresolution = glGetUniformLocation(shader->ID, "resolution");
-
-
-		// Set uniforms:
-		glUniform1i(UuseBmaps, useBumpMaps);
-		glUniform3fv(UcameraPosition, 1, &eng->scene->m_Camera.position[0]);
-		glUniform4fv(Ulvec, 1, &eng->scene->m_Light[0]);
-		glUniform1f(UambLightBlend, ambientLightBlend);
-		glUniform1f(UaoStrength, aoStrength);
-		glUniform1f(UreflStr, reflectionStrength);
-		glUniform2fv(Uresolution, 1, &resolution[0]);
-
-
-		for (auto m : eng->scene->meshes) {
-			glUniformMatrix4fv(Umodmat, 1, GL_FALSE, &m->modelMatrix[0][0]);
-			glm::mat4 MVP = eng->scene->m_Camera.VP * m->modelMatrix;
-			glUniformMatrix4fv(Umvp, 1, GL_FALSE, &MVP[0][0]);
-			glm::mat3 nMat = glm::transpose(glm::inverse(glm::mat3(m->modelMatrix)));
-			glUniformMatrix3fv(Unmat, 1, GL_FALSE, &nMat[0][0]);
-			m->material->setUniforms(shader, useModelNormals);
-
-			// Bind textures:
-			for (int i = 0; i < aiTextureType_UNKNOWN; ++i){
-				glActiveTexture(GL_TEXTURE0 + i);
-				if (m->material->HasTexture(aiTextureType(i))) {
-					m->material->BindTexture(aiTextureType(i));
+		glm::vec3 eye = eng->scene->m_Camera.position;
+		for (size_t d = 0; d < drawQueue.size(); ++d) {
+			const ClusterRange& r = drawClusters[d];
+			if (!drawVisible[d] || drawLevel[d] != 0 || r.count == 0)
+				continue;
+			unsigned int visible = r.count;
+			if (frustumCulling)
+				visible = cullBoxes(frustum, clusterBounds, clusterVisible.data(), r.first, r.count);
+			else
+				std::fill(clusterVisible.begin() + r.first, clusterVisible.begin() + r.first + r.count, 1);
+			// Without backface culling the back of a cluster is still drawn, so cones can't reject anything.
+			if (cullBackfaces) {
+				for (uint32_t k = r.first; k < r.first + r.count; ++k) {
+					if (!clusterVisible[k])
+						continue;
+					float center[3] = { clusterBounds.cx[k], clusterBounds.cy[k], clusterBounds.cz[k] };
+					const glm::vec4& cone = clusterCones[k];
+					if (clusterBackfacing(center, clusterBounds.ex[k], &cone.x, cone.w, &eye.x)) {
+						clusterVisible[k] = 0;
+						visible--;
+					}
 				}
-				else if (i == (int)aiTextureType_REFLECTION){
-					glBindTexture(GL_TEXTURE_2D, hdr_tx->id);
+			}
+			culledClusters += r.count - visible;
+		}
+	}
+
+	void Renderer::captureDepth()
+	{
+		if (occlusionCulling && occlusionSupported) {
+			profiler.begin("Hi-Z capture");
+			occlusion.capture(0);
+			bound.program = -1;// the pyramid is reduced with a compute program
+			profiler.end();
+		}
+		else
+			occlusion.invalidate();
+	}
+
+	unsigned int Renderer::submitDraw(size_t d, GLenum mode)
+	{
+		// Meshes of one vertex format share a VAO, so this only rebinds when the format changes.
+		Mesh* m = drawQueue[d].mesh;
+		GLuint vao = m->vao();
+		if (bound.vao != (GLint)vao) {
+			glBindVertexArray(vao);
+			bound.vao = vao;
+			stateChanges++;
+		}
+
+		const ClusterRange& clusters = drawClusters[d];
+		unsigned int triangles = 0;
+		if (clusterCulling && drawLevel[d] == 0 && clusters.count) {
+			// Visible meshlets next to each other in the index buffer go out as one draw.
+			for (uint32_t k = 0; k < clusters.count;) {
+				if (!clusterVisible[clusters.first + k]) {
+					k++;
+					continue;
 				}
+				GLuint first = m->meshlets[k].firstIndex, count = 0;
+				while (k < clusters.count && clusterVisible[clusters.first + k])
+					count += m->meshlets[k++].indexCount;
+				m->DrawRange(mode, first, count);
+				drawCalls++;
+				triangles += count / 3;
 			}
-			glActiveTexture(GL_TEXTURE18);// bind brdf pre-calc'd lut
-			glBindTexture(GL_TEXTURE_2D, lut_tx->id);
-			
-			glActiveTexture(GL_TEXTURE19);
-			glBindTexture(GL_TEXTURE_2D, hdr_irradiance_tx->id);
+		}
+		else {
+			m->Draw(mode, drawLevel[d]);
+			drawCalls++;
+			triangles += m->lodIndexCount(drawLevel[d]) / 3 * m->instanceCount();
+		}
+#ifdef _DEBUG
+		checkError("After rendering model");
+#endif
+		return triangles;
+	}
 
-			glActiveTexture(GL_TEXTURE20);
-			glBindTexture(GL_TEXTURE_2D, hdr_prefilt_tx->id);
+	void Renderer::shadeDraw(size_t d, GLenum mode)
+	{
+		Mesh* m = drawQueue[d].mesh;
+		ShaderVariant& v = useVariant(shaderFeatures(m->material.get(), 0));
+		setDrawUniforms(v.shader, v.uniforms, m);
+		bindMaterial(m->material.get());
+		drawnTriangles += submitDraw(d, mode);
+	}
 
+	void Renderer::renderDepthPrepass(GLenum mode)
+	{
+		// Depth only, for the same clusters and levels the shading pass draws. Opaque materials go first through the
+		// shader with no fragment work, then those whose fragments may be discarded. Translucent ones stay out so they
+		// don't hide what's behind them. The material is bound for both since height maps move vertices.
+		profiler.begin("Depth pre-pass");
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		for (int alpha = 0; alpha < 2; ++alpha) {
+			uint32_t pass = alpha ? SHADER_DEPTH_ONLY | SHADER_ALPHA_TEST : SHADER_DEPTH_ONLY;
+			for (size_t d = 0; d < drawQueue.size(); ++d) {
+				Material* material = drawQueue[d].mesh->material.get();
+				if (!drawVisible[d] || material->translucent() || material->alphaTested() != (alpha != 0))
+					continue;
+				ShaderVariant& v = useVariant(shaderFeatures(material, pass));
+				setDrawUniforms(v.shader, v.uniforms, drawQueue[d].mesh);
+				bindMaterial(material);
+				submitDraw(d, mode);
+			}
+		}
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		profiler.end();
+	}
+
+	void Renderer::renderIndirect(GLenum mode)
+	{
+		// The command buffer is rebuilt only when the draw queue or the geometry layout changed. Otherwise only
+		// visibility and levels of detail differ from last frame, so patch the commands that changed and upload the span
+		// covering them. If occlusion culling zeroed counts on the GPU last frame, the whole buffer is uploaded again.
+		if (commandsDirty || (eng->scene->buffers && eng->scene->buffers->revision() != commandGeometryRevision))
+			buildCommands();
+		else {
+			size_t first = commands.size(), last = 0;
+			for (size_t d = 0; d < commands.size(); ++d) {
+				Mesh* m = drawQueue[d].mesh;
+				GLuint count = drawVisible[d] ? m->instanceCount() : 0;
+				GLuint numIndices = m->lodIndexCount(drawLevel[d]);
+				if (commands[d].instanceCount != count || commands[d].count != numIndices) {
+					const GeometryBuffer::Allocation& a = m->gpu->allocation(m->gpuHandle);
+					commands[d].instanceCount = count;
+					commands[d].count = numIndices;
+					commands[d].firstIndex = GLuint(a.indexOffset / m->indexSize()) + m->lodFirstIndex(drawLevel[d]);
+					first = std::min(first, d);
+					last = d + 1;
+				}
+			}
+			if (commandsOccluded) {
+				first = 0;
+				last = commands.size();
+			}
+			if (first < last)
+				glNamedBufferSubData(commandBuffer, first * sizeof(DrawCommand), (last - first) * sizeof(DrawCommand), &commands[first]);
+		}
+		commandsOccluded = false;
+		for (auto& c : commands)
+			drawnTriangles += c.count / 3 * c.instanceCount;
 
-			
-			m->DrawElements(eng->render->wireframeModeOn ? GL_LINES : GL_TRIANGLES);
+		// Hidden draws get their instance count zeroed right in the command buffer, so the result never leaves the GPU.
+		// Their triangles come off the count once the GPU reports them, like occludedMeshes a few frames late.
+		if (occlusionCulling && occlusion.ready()) {
+			occludedMeshes = occlusion.cull(eng->scene->m_Camera.VP, drawVisible.data(), drawVisible.size(), commandBuffer);
+			drawnTriangles -= std::min(drawnTriangles, occlusion.culledTriangles());
+			commandsOccluded = true;
+		}
+
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, DRAW_DATA_BINDING, drawDataBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MATERIAL_BUFFER_BINDING, eng->scene->materialSSBO);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+		// Draws in a batch share their textures, so they share a shader permutation too.
+		auto drawBatches = [&](uint32_t pass, bool translucent) {
+			for (auto& b : batches) {
+				if (b.translucent != translucent || ((pass & SHADER_DEPTH_ONLY) && b.alphaTested != ((pass & SHADER_ALPHA_TEST) != 0)))
+					continue;
+				Material* material = drawQueue[b.first].mesh->material.get();
+				ShaderVariant& v = useVariant(shaderFeatures(material, pass | SHADER_INDIRECT));
+				v.shader->setMat4(v.uniforms.viewProjection, eng->scene->m_Camera.VP);
+				bindMaterialTextures(material);
+				if (bound.vao != (GLint)b.vao) {
+					glBindVertexArray(b.vao);
+					bound.vao = b.vao;
+					stateChanges++;
+				}
+				v.shader->setUint(v.uniforms.drawOffset, b.first);
+				glMultiDrawElementsIndirect(mode, b.indexType, (void*)(uintptr_t)(b.first * sizeof(DrawCommand)), b.count, 0);
+				drawCalls++;
 #ifdef _DEBUG
-			checkError("After rendering model");
+				checkError("After rendering model");
 #endif
+			}
+		};
+
+		// As on the classic path, opaque batches are laid down in the pre-pass and shaded with GL_EQUAL, and the
+		// translucent ones go last.
+		if (depthPrepass) {
+			profiler.begin("Depth pre-pass");
+			glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+			drawBatches(SHADER_DEPTH_ONLY, false);
+			drawBatches(SHADER_DEPTH_ONLY | SHADER_ALPHA_TEST, false);
+			glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+			glDepthFunc(GL_EQUAL);
+			glDepthMask(GL_FALSE);
+			profiler.end();
+		}
+		profiler.begin("Shading");
+		drawBatches(0, false);
+		profiler.end();
+		if (depthPrepass) {
+			glDepthFunc(GL_LESS);
+			glDepthMask(GL_TRUE);
+		}
+		captureDepth();// opaque depth only, see Render()
+		profiler.begin("Shading");
+		drawBatches(0, true);
+		profiler.end();
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		glBindVertexArray(0);
+	}
+
+	void Renderer::Render() 
+	{
+		if (eng->windowClose || eng->scene->meshes.size() == 0 || eng->ui->showFileDialog)
+			return;
+
+		if (drawQueueRevision != eng->scene->revision)
+			buildDrawQueue();
+		// Options that change which permutations are drawn with get theirs compiled up front as well.
+		else if (variantSettings() != preparedSettings)
+			prepareVariants();
+
+		// Bindings may have been changed by anything drawn since the last frame, so start from a clean slate.
+		bound.reset();
+		drawCalls = drawnTriangles = stateChanges = 0;
+		frameNumber++;
+		profiler.beginFrame();
+		bindTexture(18, lut_tx->id);// brdf pre-calc'd lut
+		bindTexture(19, hdr_irradiance_tx->id);
+		bindTexture(20, hdr_prefilt_tx->id);
+
+		// Skip meshes whose bounds are entirely outside the view frustum. Once a model has finished loading the scene
+		// BVH rejects whole groups of meshes at once; while it's still streaming in, test every mesh.
+		culledMeshes = 0;
+		Frustum frustum;
+		frustum.extract(eng->scene->m_Camera.VP);
+		if (frustumCulling) {
+			if (eng->scene->hasBVH()) {
+				meshVisible.resize(eng->scene->meshes.size());
+				culledMeshes = drawQueue.size() - eng->scene->bvh.cull(frustum, meshVisible);
+				for (size_t d = 0; d < drawQueue.size(); ++d)
+					drawVisible[d] = meshVisible[drawQueue[d].meshIndex];
+			}
+			else
+				culledMeshes = drawQueue.size() - cullBoxes(frustum, drawBounds, drawVisible.data());
+		}
+		else
+			std::fill(drawVisible.begin(), drawVisible.end(), 1);
+
+		selectLevels();
+
+		GLenum mode = eng->render->wireframeModeOn ? GL_LINES : GL_TRIANGLES;
+		occludedMeshes = culledClusters = 0;
+		if (indirectDraw && indirectSupported) {
+			renderIndirect(mode);
+			profiler.endFrame();
+			return;
+		}
+
+		// Large meshes split into meshlets lose the clusters outside the frustum or facing away.
+		cullClusters(frustum);
+
+		// Then drop draws, and clusters, hidden behind last frame's depth.
+		if (occlusionCulling && occlusion.ready()) {
+			if (clusterVisible.empty())
+				occludedMeshes = occlusion.cull(eng->scene->m_Camera.VP, drawVisible.data(), drawVisible.size());
+			else {
+				size_t numDraws = drawVisible.size();
+				occlusionVisible.assign(drawVisible.begin(), drawVisible.end());
+				occlusionVisible.insert(occlusionVisible.end(), clusterVisible.begin(), clusterVisible.end());
+				occlusion.cull(eng->scene->m_Camera.VP, occlusionVisible.data(), occlusionVisible.size());
+				for (size_t d = 0; d < numDraws; ++d) {
+					occludedMeshes += drawVisible[d] && !occlusionVisible[d];
+					drawVisible[d] = occlusionVisible[d];
+				}
+				for (size_t k = 0; k < clusterVisible.size(); ++k) {
+					culledClusters += clusterVisible[k] && !occlusionVisible[numDraws + k];
+					clusterVisible[k] = occlusionVisible[numDraws + k];
+				}
+			}
+		}
+
+		// With the pre-pass, opaque draws are shaded only where they match its depth exactly, so each pixel runs the
+		// full shader once. Translucent draws are left out of it and always go last with the usual depth test.
+		if (depthPrepass) {
+			renderDepthPrepass(mode);
+			glDepthFunc(GL_EQUAL);
+			glDepthMask(GL_FALSE);
+		}
+		profiler.begin("Shading");
+		for (size_t d = 0; d < drawQueue.size(); ++d) {
+			if (drawVisible[d] && !drawQueue[d].mesh->material->translucent())
+				shadeDraw(d, mode);
+		}
+		profiler.end();
+		if (depthPrepass) {
+			glDepthFunc(GL_LESS);
+			glDepthMask(GL_TRUE);
+		}
+		// Translucent surfaces still write depth, but mustn't occlude what shows through them next frame, so the Hi-Z
+		// pyramid is taken from the opaque depth alone and they're drawn after it.
+		captureDepth();
+		profiler.begin("Shading");
+		for (size_t d = 0; d < drawQueue.size(); ++d) {
+			if (drawVisible[d] && drawQueue[d].mesh->material->translucent())
+				shadeDraw(d, mode);
 		}
+		profiler.end();
+		glBindVertexArray(0);
+		profiler.endFrame();
 	}
 }
\ No newline at end of file
@@ -0,0 +1,149 @@
+#include "Tangents.hpp"
+#include "structs.hpp"
+#include <algorithm>
+
+namespace TDModelView
+{
+	static const size_t TRIANGLES_PER_PART = 1 << 16;
+	static const size_t MAX_PARTS = 64;
+	static const size_t VERTICES_PER_CHUNK = 1 << 14;
+
+	// Run fn(i) for i in [0, n), spreading the calls over the pool and helping out on this thread until all are done.
+	template<class F>
+	static void parallelFor(ThreadPool* pool, size_t n, F fn)
+	{
+		if (pool == nullptr || n < 2) {
+			for (size_t i = 0; i < n; ++i)
+				fn(i);
+			return;
+		}
+		std::vector<std::future<void>> tasks;
+		tasks.reserve(n - 1);
+		for (size_t i = 1; i < n; ++i)
+			tasks.push_back(pool->submit([&fn, i]() { fn(i); }));
+		fn(0);
+		for (auto& t : tasks)
+			pool->wait(t);
+	}
+
+	// A contiguous range of triangles and the span of vertex indices they touch. Each part accumulates into its own
+	// buffer covering just that span, so parts never write to shared memory.
+	struct TangentPart
+	{
+		size_t firstTri = 0, endTri = 0;
+		uint32_t lo = UINT32_MAX, hi = 0;
+		std::vector<float> acc;// 6 floats (tangent, bitangent) per vertex in [lo, hi]
+		size_t span() const { return lo <= hi ? size_t(hi - lo) + 1 : 0; }
+	};
+
+	void generateTangents(Vertex* vertices, size_t numVertices, const uint32_t* indices, size_t numIndices, ThreadPool* pool)
+	{
+		if (numVertices == 0)
+			return;
+		if (indices == nullptr)
+			numIndices = numVertices;
+		auto index = [indices](size_t i) { return indices ? indices[i] : (uint32_t)i; };
+		size_t numTris = numIndices / 3;
+
+		// Split the triangles and find the vertex span of each part. The split only depends on the mesh, so the
+		// (floating point) summation order and the result are the same with or without a pool.
+		size_t numParts = (numTris + TRIANGLES_PER_PART - 1) / TRIANGLES_PER_PART;
+		numParts = std::min(std::max<size_t>(numParts, 1), MAX_PARTS);
+		std::vector<TangentPart> parts(numParts);
+		parallelFor(pool, numParts, [&](size_t p) {
+			TangentPart& part = parts[p];
+			part.firstTri = numTris * p / numParts;
+			part.endTri = numTris * (p + 1) / numParts;
+			for (size_t i = part.firstTri * 3; i < part.endTri * 3; ++i) {
+				uint32_t v = index(i);
+				if (v < numVertices) {
+					part.lo = std::min(part.lo, v);
+					part.hi = std::max(part.hi, v);
+				}
+			}
+		});
+
+		// Badly ordered index buffers make every part span most of the mesh. Merge neighbours until the private
+		// buffers take at most twice the memory of a single shared one.
+		auto totalSpan = [&]() { size_t s = 0; for (auto& p : parts) s += p.span(); return s; };
+		while (parts.size() > 1 && totalSpan() > 2 * numVertices) {
+			std::vector<TangentPart> merged((parts.size() + 1) / 2);
+			for (size_t i = 0; i < merged.size(); ++i) {
+				merged[i] = parts[2 * i];
+				if (2 * i + 1 < parts.size()) {
+					const TangentPart& b = parts[2 * i + 1];
+					merged[i].endTri = b.endTri;
+					merged[i].lo = std::min(merged[i].lo, b.lo);
+					merged[i].hi = std::max(merged[i].hi, b.hi);
+				}
+			}
+			parts.swap(merged);
+		}
+
+		// Accumulate each triangle's unit tangent and bitangent, weighted by its area, into its part's buffer.
+		parallelFor(pool, parts.size(), [&](size_t p) {
+			TangentPart& part = parts[p];
+			part.acc.assign(part.span() * 6, 0.0f);
+			for (size_t tri = part.firstTri; tri < part.endTri; ++tri) {
+				uint32_t i0 = index(tri * 3), i1 = index(tri * 3 + 1), i2 = index(tri * 3 + 2);
+				if (i0 >= numVertices || i1 >= numVertices || i2 >= numVertices)
+					continue;
+				const Vertex& v0 = vertices[i0];
+				const Vertex& v1 = vertices[i1];
+				const Vertex& v2 = vertices[i2];
+				glm::vec3 deltaPos1 = v1.position - v0.position;
+				glm::vec3 deltaPos2 = v2.position - v0.position;
+				glm::vec2 deltaUV1 = glm::vec2(v1.uv) - glm::vec2(v0.uv);
+				glm::vec2 deltaUV2 = glm::vec2(v2.uv) - glm::vec2(v0.uv);
+				float det = deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x;
+				if (std::abs(det) < 1e-20f)
+					continue;
+				float area = glm::length(glm::cross(deltaPos1, deltaPos2));
+				glm::vec3 tangent = (deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y) / det;
+				glm::vec3 bitangent = (deltaPos2 * deltaUV1.x - deltaPos1 * deltaUV2.x) / det;
+				float tl = glm::length(tangent), bl = glm::length(bitangent);
+				if (!(tl > 0.0f) || !(bl > 0.0f) || !(area > 0.0f))
+					continue;
+				tangent *= area / tl;
+				bitangent *= area / bl;
+				for (uint32_t v : { i0, i1, i2 }) {
+					float* a = &part.acc[size_t(v - part.lo) * 6];
+					a[0] += tangent.x; a[1] += tangent.y; a[2] += tangent.z;
+					a[3] += bitangent.x; a[4] += bitangent.y; a[5] += bitangent.z;
+				}
+			}
+		});
+
+		// Sum the parts for each vertex (always in part order, so the result is deterministic) and orthonormalize.
+		size_t numChunks = (numVertices + VERTICES_PER_CHUNK - 1) / VERTICES_PER_CHUNK;
+		parallelFor(pool, numChunks, [&](size_t c) {
+			size_t first = c * VERTICES_PER_CHUNK;
+			size_t count = std::min(VERTICES_PER_CHUNK, numVertices - first);
+			std::vector<float> soa(count * 9, 0.0f);
+			float* n[3] = { &soa[0], &soa[count], &soa[count * 2] };
+			float* t[3] = { &soa[count * 3], &soa[count * 4], &soa[count * 5] };
+			float* b[3] = { &soa[count * 6], &soa[count * 7], &soa[count * 8] };
+			for (auto& part : parts) {
+				if (part.span() == 0 || part.hi < first || part.lo >= first + count)
+					continue;
+				size_t lo = std::max<size_t>(part.lo, first), hi = std::min<size_t>(part.hi, first + count - 1);
+				for (size_t v = lo; v <= hi; ++v) {
+					const float* a = &part.acc[(v - part.lo) * 6];
+					size_t i = v - first;
+					t[0][i] += a[0]; t[1][i] += a[1]; t[2][i] += a[2];
+					b[0][i] += a[3]; b[1][i] += a[4]; b[2][i] += a[5];
+				}
+			}
+			for (size_t i = 0; i < count; ++i) {
+				const glm::vec3& nv = vertices[first + i].normal;
+				n[0][i] = nv.x; n[1][i] = nv.y; n[2][i] = nv.z;
+			}
+			orthonormalizeTangents(n, t, b, count);
+			for (size_t i = 0; i < count; ++i) {
+				Vertex& v = vertices[first + i];
+				v.tangent = glm::vec3(t[0][i], t[1][i], t[2][i]);
+				v.bitangent = glm::vec3(b[0][i], b[1][i], b[2][i]);
+			}
+		});
+	}
+}
@@ -0,0 +1,106 @@
+#include "ThreadPool.hpp"
+
+namespace TDModelView
+{
+	// Index of the queue owned by the current thread, or -1 for threads outside of the pool.
+	static thread_local int currentWorker = -1;
+	static thread_local const void* currentPool = nullptr;
+
+	ThreadPool::ThreadPool(unsigned int numThreads)
+	{
+		if (numThreads == 0)
+			numThreads = std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 1;
+		for (unsigned int i = 0; i < numThreads; ++i)
+			queues.push_back(std::make_unique<WorkQueue>());
+		for (unsigned int i = 0; i < numThreads; ++i)
+			workers.emplace_back(&ThreadPool::workerLoop, this, i);
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& t : workers) {
+			if (t.joinable())
+				t.join();
+		}
+	}
+
+	void ThreadPool::push(std::function<void()> task)
+	{
+		// Workers keep their own subtasks local (LIFO) for cache locality, outside callers spread work round-robin.
+		if (currentPool == this && currentWorker >= 0) {
+			std::lock_guard<std::mutex> lock(queues[currentWorker]->mutex);
+			queues[currentWorker]->tasks.push_front(std::move(task));
+		}
+		else {
+			unsigned int idx = nextQueue++ % (unsigned int)queues.size();
+			std::lock_guard<std::mutex> lock(queues[idx]->mutex);
+			queues[idx]->tasks.push_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			pendingTasks++;
+		}
+		wake.notify_one();
+	}
+
+	bool ThreadPool::pop(unsigned int queueIdx, std::function<void()>& task)
+	{
+		std::lock_guard<std::mutex> lock(queues[queueIdx]->mutex);
+		if (queues[queueIdx]->tasks.empty())
+			return false;
+		task = std::move(queues[queueIdx]->tasks.front());
+		queues[queueIdx]->tasks.pop_front();
+		pendingTasks--;
+		return true;
+	}
+
+	bool ThreadPool::steal(unsigned int thiefIdx, std::function<void()>& task)
+	{
+		for (unsigned int i = 1; i <= queues.size(); ++i) {
+			unsigned int victim = (thiefIdx + i) % (unsigned int)queues.size();
+			std::unique_lock<std::mutex> lock(queues[victim]->mutex, std::try_to_lock);
+			if (!lock.owns_lock() || queues[victim]->tasks.empty())
+				continue;
+			task = std::move(queues[victim]->tasks.back());
+			queues[victim]->tasks.pop_back();
+			pendingTasks--;
+			return true;
+		}
+		return false;
+	}
+
+	bool ThreadPool::runPendingTask()
+	{
+		std::function<void()> task;
+		bool isWorker = currentPool == this && currentWorker >= 0;
+		unsigned int idx = isWorker ? (unsigned int)currentWorker : nextQueue % (unsigned int)queues.size();
+		if ((isWorker && pop(idx, task)) || steal(idx, task)) {
+			task();
+			return true;
+		}
+		return false;
+	}
+
+	void ThreadPool::workerLoop(unsigned int idx)
+	{
+		currentWorker = (int)idx;
+		currentPool = this;
+		while (true) {
+			std::function<void()> task;
+			if (pop(idx, task) || steal(idx, task)) {
+				task();
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			wake.wait(lock, [this]() { return stopping || pendingTasks > 0; });
+			if (stopping && pendingTasks <= 0)
+				return;
+		}
+	}
+}
@@ -6,7 +6,7 @@
 #include <glm/gtc/type_ptr.hpp>
 #include "imgui_internal.h"
 #include <filesystem>
-#include "ASSIMPio.hpp"
+#include "ModelLoader.hpp"
 
 namespace TDModelView 
 {
@@ -280,6 +280,16 @@ namespace TDModelView
                         this->fileDialogSize,
                         this->fileDialogPath);
                 }
+                ImGui::Checkbox("Use Model Cache", &eng->useModelCache);
+                ImGui::Checkbox("Compact Vertices", &eng->useCompactVertices);
+                ImGui::Checkbox("Keep CPU Geometry", &eng->keepGeometry);
+                ImGui::Checkbox("Optimize Meshes", &eng->optimizeMeshes);
+                if (eng->optimizeMeshes)
+                    ImGui::Checkbox("Reduce Overdraw", &eng->reduceOverdraw);
+                ImGui::Checkbox("Split Meshes for 16-bit Indices", &eng->splitLargeMeshes);
+                ImGui::Checkbox("Preserve Instancing", &eng->preserveInstances);
+                ImGui::Checkbox("Generate LODs", &eng->generateLODs);
+                ImGui::Checkbox("Build Meshlets", &eng->buildMeshlets);
                 if (ImGui::MenuItem("Exit##main_menu", nullptr))
                 {
                     eng->windowClose = true;
@@ -304,6 +314,16 @@ namespace TDModelView
                     eng->scene->m_Camera.position = eng->scene->bbox.center();
                     eng->scene->m_Camera.Update();
                 }
+                if (eng->scene->selectedMesh >= 0 && ImGui::Button("Frame Selection")) {
+                    glm::vec3 wMin, wMax;
+                    eng->scene->meshes[eng->scene->selectedMesh]->worldBounds(wMin, wMax);
+                    BoundingBox b;
+                    b.bboxMin = wMin;
+                    b.bboxMax = wMax;
+                    eng->scene->fitCamera(b);
+                }
+                if (eng->scene->selectedMesh >= 0 && !(eng->loader && eng->loader->isLoading()) && ImGui::Button("Remove Selection"))
+                    eng->scene->removeMesh(eng->scene->selectedMesh);
                 ImGui::SliderFloat("Camera Speed", &eng->scene->m_Camera.movementSpeed, 0.0f, 20.0f);
                 if (ImGui::Checkbox("Cull Backfaces", &eng->render->cullBackfaces))
                 {
@@ -312,6 +332,16 @@ namespace TDModelView
                     else
                         glDisable(GL_CULL_FACE);
                 }
+                ImGui::Checkbox("Frustum Culling", &eng->render->frustumCulling);
+                if (eng->render->occlusionSupported)
+                    ImGui::Checkbox("Occlusion Culling", &eng->render->occlusionCulling);
+                ImGui::Checkbox("Cluster Culling", &eng->render->clusterCulling);
+                ImGui::Checkbox("Level of Detail", &eng->render->levelOfDetail);
+                if (eng->render->levelOfDetail)
+                    ImGui::SliderFloat("LOD Pixel Error", &eng->render->lodPixelError, 0.25f, 8.0f);
+                if (eng->render->indirectSupported)
+                    ImGui::Checkbox("Multi-Draw Indirect", &eng->render->indirectDraw);
+                ImGui::Checkbox("Depth Pre-Pass", &eng->render->depthPrepass);
                 ImGui::Checkbox("Use Model Normals", &eng->render->useModelNormals);
                 if(!eng->render->useModelNormals)
                     ImGui::Checkbox("Use Bump Maps", &eng->render->useBumpMaps);
@@ -331,6 +361,73 @@ namespace TDModelView
                 ImGui::Text(str.c_str());
                 str = "# verts: " + std::to_string(eng->scene->vertexCount);
                 ImGui::Text(str.c_str());
+                if (eng->scene->instanceCount > 0) {
+                    str = "# instances: " + std::to_string(eng->scene->instanceCount);
+                    ImGui::Text(str.c_str());
+                }
+                str = "vertex memory: " + std::to_string(eng->scene->vertexBytes / (1024 * 1024)) + " MB";
+                ImGui::Text(str.c_str());
+                str = "index memory: " + std::to_string(eng->scene->indexBytes / (1024 * 1024)) + " MB";
+                ImGui::Text(str.c_str());
+                if (eng->scene->buffers) {
+                    str = "GPU geometry buffers: " + std::to_string(eng->scene->buffers->usedBytes() / (1024 * 1024)) + " / " +
+                        std::to_string(eng->scene->buffers->capacityBytes() / (1024 * 1024)) + " MB used, " +
+                        std::to_string(eng->scene->buffers->compactions()) + " compactions";
+                    ImGui::Text(str.c_str());
+                }
+                if (eng->scene->geometry) {
+                    // Querying residency walks every page of the mapping, so it's only sampled once a second.
+                    static const GeometryStore* residentStore = nullptr;
+                    static double residentTime = 0.0;
+                    static size_t resident = 0;
+                    if (residentStore != eng->scene->geometry.get() || glfwGetTime() - residentTime >= 1.0) {
+                        residentStore = eng->scene->geometry.get();
+                        residentTime = glfwGetTime();
+                        resident = residentStore->residentBytes();
+                    }
+                    str = "CPU geometry: " + std::to_string(eng->scene->geometry->size() / (1024 * 1024)) + " MB mapped, " +
+                        std::to_string(resident / (1024 * 1024)) + " MB resident";
+                    ImGui::Text(str.c_str());
+                }
+                str = "# culled meshes: " + std::to_string(eng->render->culledMeshes) + " / " + std::to_string(eng->scene->meshes.size());
+                ImGui::Text(str.c_str());
+                if (eng->render->occlusionCulling) {
+                    str = "# occluded meshes: " + std::to_string(eng->render->occludedMeshes);
+                    ImGui::Text(str.c_str());
+                }
+                if (eng->scene->meshletCount > 0) {
+                    str = "# culled meshlets: " + std::to_string(eng->render->culledClusters) + " / " + std::to_string(eng->scene->meshletCount);
+                    ImGui::Text(str.c_str());
+                }
+                str = "# draw calls: " + std::to_string(eng->render->drawCalls);
+                ImGui::Text(str.c_str());
+                str = "# tris drawn: " + std::to_string(eng->render->drawnTriangles);
+                ImGui::Text(str.c_str());
+                if (eng->scene->lodMeshes > 0) {
+                    str = "# LODs: " + std::to_string(eng->scene->lodLevels) + " over " + std::to_string(eng->scene->lodMeshes) + " meshes";
+                    ImGui::Text(str.c_str());
+                }
+                str = "# state changes: " + std::to_string(eng->render->stateChanges);
+                ImGui::Text(str.c_str());
+                str = "# shader variants: " + std::to_string(eng->render->shaderVariants());
+                ImGui::Text(str.c_str());
+                for (auto& s : eng->render->profiler.sections()) {
+                    str = "GPU " + s.name + ": " + std::to_string(s.milliseconds) + " ms";
+                    ImGui::Text(str.c_str());
+                }
+                if (eng->scene->optimizedTriangles > 0) {
+                    float tris = float(eng->scene->optimizedTriangles);
+                    str = "vertex cache ACMR: " + std::to_string(eng->scene->cacheMissesBefore / tris) + " -> " +
+                        std::to_string(eng->scene->cacheMissesAfter / tris);
+                    ImGui::Text(str.c_str());
+                }
+                str = "SIMD: " + std::string(simdLevelName(simdLevel()));
+                ImGui::Text(str.c_str());
+                if (eng->scene->selectedMesh >= 0) {
+                    auto& m = eng->scene->meshes[eng->scene->selectedMesh];
+                    str = "selected mesh: #" + std::to_string(eng->scene->selectedMesh) + " (" + std::to_string(m->numIndices / 3) + " tris)";
+                    ImGui::Text(str.c_str());
+                }
                 ImGui::EndMenu();
             }
             
@@ -389,6 +486,10 @@ namespace TDModelView
             eng->scene->m_Camera.position += eng->scene->m_Camera.front * io.MouseWheel * eng->scene->m_Camera.movementSpeed;
             eng->scene->m_Camera.Update();
         }
+
+        // Double-click in the viewport selects the mesh under the cursor.
+        if (ImGui::IsMouseDoubleClicked(0) && !io.WantCaptureMouse)
+            pickMesh();
        
         // ========================================================
 
@@ -396,6 +497,21 @@ namespace TDModelView
 
         if (showFileDialog)
             FileDialogModalPopup();
+        if (eng->loader && eng->loader->isLoading())
+            LoadProgressPopup();
+    }
+    void UI::pickMesh()
+    {
+        if (eng->scene->meshes.empty() || (eng->loader && eng->loader->isLoading()))
+            return;
+
+        // Unproject the cursor onto the near and far planes to get a world-space ray.
+        glm::mat4 invVP = glm::inverse(eng->scene->m_Camera.VP);
+        glm::vec4 nearPt = invVP * glm::vec4((float)mouseNDC_x, (float)mouseNDC_y, -1.0f, 1.0f);
+        glm::vec4 farPt = invVP * glm::vec4((float)mouseNDC_x, (float)mouseNDC_y, 1.0f, 1.0f);
+        glm::vec3 origin = glm::vec3(nearPt) / nearPt.w;
+        glm::vec3 dir = glm::normalize(glm::vec3(farPt) / farPt.w - origin);
+        eng->scene->selectedMesh = eng->scene->pick(origin, dir);
     }
     void UI::FileDialogModalPopup()
     {
@@ -408,7 +524,7 @@ namespace TDModelView
         if (CustomFileDialog::Instance()->FileDialog("Load Model", ImGuiWindowFlags_NoCollapse)) {
             if (CustomFileDialog::Instance()->IsOk == true) {
                 try {
-                    ASSIMPreader ai(CustomFileDialog::Instance()->GetFilepathName());
+                    eng->loader->load(CustomFileDialog::Instance()->GetFilepathName());
                 }
                 catch (std::exception e1) {
                     ErrorMessageBox(e1.what());
@@ -417,4 +533,25 @@ namespace TDModelView
             CustomFileDialog::Instance()->CloseDialog("Load Model");
         }
     }
+    void UI::LoadProgressPopup()
+    {
+        progressBarPosition = ImVec2(
+            0.5f * (window_width - progressBarSize.x),
+            0.5f * (window_height - progressBarSize.y));
+        ImGui::SetNextWindowPos(progressBarPosition, ImGuiCond_Always);
+        ImGui::SetNextWindowSize(progressBarSize, ImGuiCond_Always);
+
+        if (ImGui::Begin("Loading##load_progress", nullptr, ImGuiWindowFlags_NoCollapse | ImGuiWindowFlags_NoResize |
+            ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoSavedSettings))
+        {
+            std::string str = eng->loader->stageName() + ": " + eng->loader->filename();
+            ImGui::Text(str.c_str());
+            ImGui::ProgressBar(eng->loader->progress(), ImVec2(-1.0f, 0.0f));
+            if (eng->loader->isCancelled())
+                ImGui::Text("Cancelling...");
+            else if (ImGui::Button("Cancel##load_progress"))
+                eng->loader->cancel();
+        }
+        ImGui::End();
+    }
 }
\ No newline at end of file
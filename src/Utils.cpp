@@ -6,10 +6,14 @@
 #include <fstream>
 #include <sstream>
 #include <filesystem>
+#include <mutex>
 #include "CPPfilesys.hpp"
 
 namespace TDModelView 
 {
+    // Models are loaded on worker threads, so logging and error reporting must be serialized.
+    static std::recursive_mutex logMutex;
+
     std::string getDateTime() 
     {//See: https://stackoverflow.com/questions/997512/string-representation-of-time-t
         std::time_t now = std::time(NULL);
@@ -22,6 +26,7 @@ namespace TDModelView
 
     void WriteToLogFile(std::string str)
     {
+        std::lock_guard<std::recursive_mutex> lock(logMutex);
         std::ofstream outp("runtime.log", std::ios::out | std::ios::binary | std::ios::app);
         if (!outp.is_open())
             return;
@@ -161,8 +166,21 @@ namespace TDModelView
         return err > 0;
     }
 
+    bool hasExtension(std::string name)
+    {
+        GLint count = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+        for (GLint i = 0; i < count; ++i) {
+            const char* ext = (const char*)glGetStringi(GL_EXTENSIONS, (GLuint)i);
+            if (ext && name == ext)
+                return true;
+        }
+        return false;
+    }
+
     void ErrorMessageBox(std::string str)
     {
+        std::lock_guard<std::recursive_mutex> lock(logMutex);
         errorString.append("\n" + str);
 
         if (eng && !eng->windowClose && !eng->silenceErrors)
@@ -0,0 +1,408 @@
+#include "VertexKernels.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <immintrin.h>
+#define KERNELS_USE_SIMD
+#ifdef _MSC_VER
+#include <intrin.h>
+#define KERNELS_TARGET_AVX
+#else
+#include <cpuid.h>
+#define KERNELS_TARGET_AVX __attribute__((target("avx")))
+#endif
+#endif
+
+namespace TDModelView
+{
+	// The SIMD paths load and store 16 bytes per position, i.e. one float past z. That float is always preserved,
+	// but it must be addressable, so when the stride is shorter than that the last position is handled as a scalar.
+	static size_t wideCount(size_t count, size_t stride)
+	{
+		return (stride >= 4 * sizeof(float) || count == 0) ? count : count - 1;
+	}
+
+	static inline float* at(float* p, size_t i, size_t stride) { return (float*)((char*)p + i * stride); }
+	static inline const float* at(const float* p, size_t i, size_t stride) { return (const float*)((const char*)p + i * stride); }
+
+	// Scalar versions, also used for the tails of the SIMD ones. The SIMD code does the arithmetic in the same order,
+	// so every level gives bit-identical results.
+
+	static void boundsScalar(const float* p, size_t begin, size_t count, size_t stride, float* mn, float* mx)
+	{
+		for (size_t i = begin; i < count; ++i) {
+			const float* v = at(p, i, stride);
+			for (int c = 0; c < 3; ++c) {
+				mn[c] = v[c] < mn[c] ? v[c] : mn[c];
+				mx[c] = v[c] > mx[c] ? v[c] : mx[c];
+			}
+		}
+	}
+
+	static void scaleScalar(float* p, size_t begin, size_t count, size_t stride, float s, const float* o)
+	{
+		for (size_t i = begin; i < count; ++i) {
+			float* v = at(p, i, stride);
+			for (int c = 0; c < 3; ++c)
+				v[c] = v[c] * s + o[c];
+		}
+	}
+
+	static void transformScalar(float* p, size_t begin, size_t count, size_t stride, const float* m)
+	{
+		for (size_t i = begin; i < count; ++i) {
+			float* v = at(p, i, stride);
+			float x = v[0], y = v[1], z = v[2];
+			for (int c = 0; c < 3; ++c)
+				v[c] = m[c] * x + m[4 + c] * y + m[8 + c] * z + m[12 + c];
+		}
+	}
+
+	static void orthonormalizeScalar(const float* const n[3], float* const t[3], float* const b[3], size_t begin, size_t count)
+	{
+		for (size_t i = begin; i < count; ++i) {
+			float nx = n[0][i], ny = n[1][i], nz = n[2][i];
+			float tx = t[0][i], ty = t[1][i], tz = t[2][i];
+			float bx = b[0][i], by = b[1][i], bz = b[2][i];
+			float d = nx * tx + ny * ty + nz * tz;
+			tx = tx - nx * d; ty = ty - ny * d; tz = tz - nz * d;
+			float len2 = tx * tx + ty * ty + tz * tz;
+			if (!(len2 > 1e-30f)) {
+				// Project whichever of X or Y is further from n instead.
+				float ax = std::fabs(nx) < 0.9f ? 1.0f : 0.0f, ay = 1.0f - ax;
+				d = nx * ax + ny * ay;
+				tx = ax - nx * d; ty = ay - ny * d; tz = 0.0f - nz * d;
+				len2 = tx * tx + ty * ty + tz * tz;
+			}
+			float inv = 1.0f / std::sqrt(len2);
+			tx = tx * inv; ty = ty * inv; tz = tz * inv;
+			d = bx * nx + by * ny + bz * nz;
+			bx = bx - nx * d; by = by - ny * d; bz = bz - nz * d;
+			d = bx * tx + by * ty + bz * tz;
+			bx = bx - tx * d; by = by - ty * d; bz = bz - tz * d;
+			float cx = ny * tz - nz * ty, cy = nz * tx - nx * tz, cz = nx * ty - ny * tx;
+			if (cx * bx + cy * by + cz * bz < 0.0f) {
+				tx = -tx; ty = -ty; tz = -tz;
+			}
+			t[0][i] = tx; t[1][i] = ty; t[2][i] = tz;
+			b[0][i] = bx; b[1][i] = by; b[2][i] = bz;
+		}
+	}
+
+#ifdef KERNELS_USE_SIMD
+	// SSE2: one position per register, xyz in lanes 0-2. Lane 3 is carried through untouched.
+
+	static void boundsSSE(const float* p, size_t count, size_t stride, float* mn, float* mx)
+	{
+		size_t n = wideCount(count, stride);
+		__m128 vmin = _mm_setr_ps(mn[0], mn[1], mn[2], 0.0f);
+		__m128 vmax = _mm_setr_ps(mx[0], mx[1], mx[2], 0.0f);
+		for (size_t i = 0; i < n; ++i) {
+			__m128 v = _mm_loadu_ps(at(p, i, stride));
+			vmin = _mm_min_ps(vmin, v);
+			vmax = _mm_max_ps(vmax, v);
+		}
+		float a[4], b[4];
+		_mm_storeu_ps(a, vmin);
+		_mm_storeu_ps(b, vmax);
+		for (int c = 0; c < 3; ++c) {
+			mn[c] = a[c];
+			mx[c] = b[c];
+		}
+		boundsScalar(p, n, count, stride, mn, mx);
+	}
+
+	static void scaleSSE(float* p, size_t count, size_t stride, float s, const float* o)
+	{
+		size_t n = wideCount(count, stride);
+		const __m128 keep = _mm_castsi128_ps(_mm_setr_epi32(0, 0, 0, -1));
+		const __m128 vs = _mm_set1_ps(s);
+		const __m128 vo = _mm_setr_ps(o[0], o[1], o[2], 0.0f);
+		for (size_t i = 0; i < n; ++i) {
+			float* v = at(p, i, stride);
+			__m128 x = _mm_loadu_ps(v);
+			__m128 r = _mm_add_ps(_mm_mul_ps(x, vs), vo);
+			_mm_storeu_ps(v, _mm_or_ps(_mm_andnot_ps(keep, r), _mm_and_ps(keep, x)));
+		}
+		scaleScalar(p, n, count, stride, s, o);
+	}
+
+	static void transformSSE(float* p, size_t count, size_t stride, const float* m)
+	{
+		size_t n = wideCount(count, stride);
+		const __m128 keep = _mm_castsi128_ps(_mm_setr_epi32(0, 0, 0, -1));
+		const __m128 c0 = _mm_loadu_ps(m), c1 = _mm_loadu_ps(m + 4), c2 = _mm_loadu_ps(m + 8), c3 = _mm_loadu_ps(m + 12);
+		for (size_t i = 0; i < n; ++i) {
+			float* v = at(p, i, stride);
+			__m128 x = _mm_loadu_ps(v);
+			__m128 r = _mm_mul_ps(c0, _mm_shuffle_ps(x, x, _MM_SHUFFLE(0, 0, 0, 0)));
+			r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_shuffle_ps(x, x, _MM_SHUFFLE(1, 1, 1, 1))));
+			r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 2, 2, 2))));
+			r = _mm_add_ps(r, c3);
+			_mm_storeu_ps(v, _mm_or_ps(_mm_andnot_ps(keep, r), _mm_and_ps(keep, x)));
+		}
+		transformScalar(p, n, count, stride, m);
+	}
+
+	// Four tangent frames per register, one per lane.
+	static void orthonormalizeSSE(const float* const n[3], float* const t[3], float* const b[3], size_t count)
+	{
+		const __m128 one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps();
+		const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		const __m128 signMask = _mm_set1_ps(-0.0f);
+		size_t n4 = count & ~size_t(3);
+		for (size_t i = 0; i < n4; i += 4) {
+			__m128 nx = _mm_loadu_ps(n[0] + i), ny = _mm_loadu_ps(n[1] + i), nz = _mm_loadu_ps(n[2] + i);
+			__m128 tx = _mm_loadu_ps(t[0] + i), ty = _mm_loadu_ps(t[1] + i), tz = _mm_loadu_ps(t[2] + i);
+			__m128 bx = _mm_loadu_ps(b[0] + i), by = _mm_loadu_ps(b[1] + i), bz = _mm_loadu_ps(b[2] + i);
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, tx), _mm_mul_ps(ny, ty)), _mm_mul_ps(nz, tz));
+			tx = _mm_sub_ps(tx, _mm_mul_ps(nx, d));
+			ty = _mm_sub_ps(ty, _mm_mul_ps(ny, d));
+			tz = _mm_sub_ps(tz, _mm_mul_ps(nz, d));
+			__m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, tx), _mm_mul_ps(ty, ty)), _mm_mul_ps(tz, tz));
+			__m128 bad = _mm_cmpngt_ps(len2, _mm_set1_ps(1e-30f));
+			if (_mm_movemask_ps(bad)) {
+				__m128 ax = _mm_and_ps(_mm_cmplt_ps(_mm_and_ps(nx, absMask), _mm_set1_ps(0.9f)), one);
+				__m128 ay = _mm_sub_ps(one, ax);
+				__m128 da = _mm_add_ps(_mm_mul_ps(nx, ax), _mm_mul_ps(ny, ay));
+				__m128 fx = _mm_sub_ps(ax, _mm_mul_ps(nx, da));
+				__m128 fy = _mm_sub_ps(ay, _mm_mul_ps(ny, da));
+				__m128 fz = _mm_sub_ps(zero, _mm_mul_ps(nz, da));
+				__m128 flen2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(fx, fx), _mm_mul_ps(fy, fy)), _mm_mul_ps(fz, fz));
+				tx = _mm_or_ps(_mm_and_ps(bad, fx), _mm_andnot_ps(bad, tx));
+				ty = _mm_or_ps(_mm_and_ps(bad, fy), _mm_andnot_ps(bad, ty));
+				tz = _mm_or_ps(_mm_and_ps(bad, fz), _mm_andnot_ps(bad, tz));
+				len2 = _mm_or_ps(_mm_and_ps(bad, flen2), _mm_andnot_ps(bad, len2));
+			}
+			__m128 inv = _mm_div_ps(one, _mm_sqrt_ps(len2));
+			tx = _mm_mul_ps(tx, inv);
+			ty = _mm_mul_ps(ty, inv);
+			tz = _mm_mul_ps(tz, inv);
+			d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(bx, nx), _mm_mul_ps(by, ny)), _mm_mul_ps(bz, nz));
+			bx = _mm_sub_ps(bx, _mm_mul_ps(nx, d));
+			by = _mm_sub_ps(by, _mm_mul_ps(ny, d));
+			bz = _mm_sub_ps(bz, _mm_mul_ps(nz, d));
+			d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(bx, tx), _mm_mul_ps(by, ty)), _mm_mul_ps(bz, tz));
+			bx = _mm_sub_ps(bx, _mm_mul_ps(tx, d));
+			by = _mm_sub_ps(by, _mm_mul_ps(ty, d));
+			bz = _mm_sub_ps(bz, _mm_mul_ps(tz, d));
+			__m128 cx = _mm_sub_ps(_mm_mul_ps(ny, tz), _mm_mul_ps(nz, ty));
+			__m128 cy = _mm_sub_ps(_mm_mul_ps(nz, tx), _mm_mul_ps(nx, tz));
+			__m128 cz = _mm_sub_ps(_mm_mul_ps(nx, ty), _mm_mul_ps(ny, tx));
+			__m128 h = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, bx), _mm_mul_ps(cy, by)), _mm_mul_ps(cz, bz));
+			__m128 flip = _mm_and_ps(_mm_cmplt_ps(h, zero), signMask);
+			_mm_storeu_ps(t[0] + i, _mm_xor_ps(tx, flip));
+			_mm_storeu_ps(t[1] + i, _mm_xor_ps(ty, flip));
+			_mm_storeu_ps(t[2] + i, _mm_xor_ps(tz, flip));
+			_mm_storeu_ps(b[0] + i, bx);
+			_mm_storeu_ps(b[1] + i, by);
+			_mm_storeu_ps(b[2] + i, bz);
+		}
+		orthonormalizeScalar(n, t, b, n4, count);
+	}
+
+	// AVX: two positions per register, one in each 128-bit half.
+
+	KERNELS_TARGET_AVX static inline __m256 load2(const float* a, const float* b)
+	{
+		return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(a)), _mm_loadu_ps(b), 1);
+	}
+
+	KERNELS_TARGET_AVX static inline void store2(float* a, float* b, __m256 v)
+	{
+		_mm_storeu_ps(a, _mm256_castps256_ps128(v));
+		_mm_storeu_ps(b, _mm256_extractf128_ps(v, 1));
+	}
+
+	KERNELS_TARGET_AVX static void boundsAVX(const float* p, size_t count, size_t stride, float* mn, float* mx)
+	{
+		size_t n = wideCount(count, stride) & ~size_t(1);
+		__m256 vmin = _mm256_setr_ps(mn[0], mn[1], mn[2], 0.0f, mn[0], mn[1], mn[2], 0.0f);
+		__m256 vmax = _mm256_setr_ps(mx[0], mx[1], mx[2], 0.0f, mx[0], mx[1], mx[2], 0.0f);
+		for (size_t i = 0; i < n; i += 2) {
+			__m256 v = load2(at(p, i, stride), at(p, i + 1, stride));
+			vmin = _mm256_min_ps(vmin, v);
+			vmax = _mm256_max_ps(vmax, v);
+		}
+		__m128 lo = _mm_min_ps(_mm256_castps256_ps128(vmin), _mm256_extractf128_ps(vmin, 1));
+		__m128 hi = _mm_max_ps(_mm256_castps256_ps128(vmax), _mm256_extractf128_ps(vmax, 1));
+		float a[4], b[4];
+		_mm_storeu_ps(a, lo);
+		_mm_storeu_ps(b, hi);
+		for (int c = 0; c < 3; ++c) {
+			mn[c] = a[c];
+			mx[c] = b[c];
+		}
+		boundsScalar(p, n, count, stride, mn, mx);
+	}
+
+	KERNELS_TARGET_AVX static void scaleAVX(float* p, size_t count, size_t stride, float s, const float* o)
+	{
+		size_t n = wideCount(count, stride) & ~size_t(1);
+		const __m256 vs = _mm256_set1_ps(s);
+		const __m256 vo = _mm256_setr_ps(o[0], o[1], o[2], 0.0f, o[0], o[1], o[2], 0.0f);
+		for (size_t i = 0; i < n; i += 2) {
+			float* a = at(p, i, stride);
+			float* b = at(p, i + 1, stride);
+			__m256 x = load2(a, b);
+			__m256 r = _mm256_add_ps(_mm256_mul_ps(x, vs), vo);
+			store2(a, b, _mm256_blend_ps(r, x, 0x88));
+		}
+		scaleScalar(p, n, count, stride, s, o);
+	}
+
+	KERNELS_TARGET_AVX static void transformAVX(float* p, size_t count, size_t stride, const float* m)
+	{
+		size_t n = wideCount(count, stride) & ~size_t(1);
+		const __m256 c0 = _mm256_broadcast_ps((const __m128*)m);
+		const __m256 c1 = _mm256_broadcast_ps((const __m128*)(m + 4));
+		const __m256 c2 = _mm256_broadcast_ps((const __m128*)(m + 8));
+		const __m256 c3 = _mm256_broadcast_ps((const __m128*)(m + 12));
+		for (size_t i = 0; i < n; i += 2) {
+			float* a = at(p, i, stride);
+			float* b = at(p, i + 1, stride);
+			__m256 x = load2(a, b);
+			__m256 r = _mm256_mul_ps(c0, _mm256_permute_ps(x, _MM_SHUFFLE(0, 0, 0, 0)));
+			r = _mm256_add_ps(r, _mm256_mul_ps(c1, _mm256_permute_ps(x, _MM_SHUFFLE(1, 1, 1, 1))));
+			r = _mm256_add_ps(r, _mm256_mul_ps(c2, _mm256_permute_ps(x, _MM_SHUFFLE(2, 2, 2, 2))));
+			r = _mm256_add_ps(r, c3);
+			store2(a, b, _mm256_blend_ps(r, x, 0x88));
+		}
+		transformScalar(p, n, count, stride, m);
+	}
+#endif
+
+	void orthonormalizeTangents(const float* const n[3], float* const t[3], float* const b[3], size_t count)
+	{
+#ifdef KERNELS_USE_SIMD
+		if (simdLevel() >= SimdLevel::SSE2) {
+			orthonormalizeSSE(n, t, b, count);
+			return;
+		}
+#endif
+		orthonormalizeScalar(n, t, b, 0, count);
+	}
+
+	SimdLevel detectSimdLevel()
+	{
+#ifdef KERNELS_USE_SIMD
+		unsigned int ecx = 0, edx = 0;
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 1);
+		ecx = (unsigned int)info[2];
+		edx = (unsigned int)info[3];
+#else
+		unsigned int eax = 0, ebx = 0;
+		if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+			return SimdLevel::SCALAR;
+#endif
+		// AVX also needs the OS to save the upper register halves (OSXSAVE + XCR0 bits 1 and 2).
+		bool avx = (ecx & (1u << 28)) && (ecx & (1u << 27));
+		if (avx) {
+#ifdef _MSC_VER
+			unsigned long long xcr0 = _xgetbv(0);
+#else
+			unsigned int lo = 0, hi = 0;
+			__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+			unsigned long long xcr0 = ((unsigned long long)hi << 32) | lo;
+#endif
+			avx = (xcr0 & 6) == 6;
+		}
+		if (avx)
+			return SimdLevel::AVX;
+		if (edx & (1u << 26))
+			return SimdLevel::SSE2;
+#endif
+		return SimdLevel::SCALAR;
+	}
+
+	static std::atomic<int>& currentLevel()
+	{
+		static std::atomic<int> level{ (int)detectSimdLevel() };
+		return level;
+	}
+
+	SimdLevel simdLevel()
+	{
+		return (SimdLevel)currentLevel().load();
+	}
+
+	void setSimdLevel(SimdLevel level)
+	{
+		currentLevel() = std::min((int)level, (int)detectSimdLevel());
+	}
+
+	const char* simdLevelName(SimdLevel level)
+	{
+		switch (level) {
+		case SimdLevel::AVX:
+			return "AVX";
+		case SimdLevel::SSE2:
+			return "SSE2";
+		default:
+			return "scalar";
+		}
+	}
+
+	void positionBounds(const float* positions, size_t count, size_t stride, glm::vec3& outMin, glm::vec3& outMax)
+	{
+		if (count == 0)
+			return;
+		float mn[3] = { outMin.x, outMin.y, outMin.z };
+		float mx[3] = { outMax.x, outMax.y, outMax.z };
+		switch (simdLevel()) {
+#ifdef KERNELS_USE_SIMD
+		case SimdLevel::AVX:
+			boundsAVX(positions, count, stride, mn, mx);
+			break;
+		case SimdLevel::SSE2:
+			boundsSSE(positions, count, stride, mn, mx);
+			break;
+#endif
+		default:
+			boundsScalar(positions, 0, count, stride, mn, mx);
+		}
+		outMin = glm::vec3(mn[0], mn[1], mn[2]);
+		outMax = glm::vec3(mx[0], mx[1], mx[2]);
+	}
+
+	void scalePositions(float* positions, size_t count, size_t stride, float scale, const glm::vec3& offset)
+	{
+		float o[3] = { offset.x, offset.y, offset.z };
+		switch (simdLevel()) {
+#ifdef KERNELS_USE_SIMD
+		case SimdLevel::AVX:
+			scaleAVX(positions, count, stride, scale, o);
+			break;
+		case SimdLevel::SSE2:
+			scaleSSE(positions, count, stride, scale, o);
+			break;
+#endif
+		default:
+			scaleScalar(positions, 0, count, stride, scale, o);
+		}
+	}
+
+	void transformPositions(float* positions, size_t count, size_t stride, const glm::mat4& M)
+	{
+		float m[16];
+		for (int c = 0; c < 4; ++c)
+			for (int r = 0; r < 4; ++r)
+				m[c * 4 + r] = M[c][r];
+		switch (simdLevel()) {
+#ifdef KERNELS_USE_SIMD
+		case SimdLevel::AVX:
+			transformAVX(positions, count, stride, m);
+			break;
+		case SimdLevel::SSE2:
+			transformSSE(positions, count, stride, m);
+			break;
+#endif
+		default:
+			transformScalar(positions, 0, count, stride, m);
+		}
+	}
+}
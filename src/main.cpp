@@ -1,7 +1,7 @@
 #include "stdafx.h" 
 #include "structs.hpp"
 #include "UI.hpp"
-#include "ASSIMPio.hpp"
+#include "ModelLoader.hpp"
 #include <exception>
 #include <filesystem>
 
@@ -156,12 +156,13 @@ int main(int argc, char** argv)
     try {
         eng = std::make_shared<EngineBase>(window);
         eng->init(w, h);
+        eng->loader = std::make_shared<ModelLoader>();
 
         // If there's an argument passed for a parseable model(s), import them first before rendering.
         for (unsigned int i = 1; i < argc; ++i) {
             std::filesystem::path fp(argv[i]);
             if (std::filesystem::is_regular_file(fp)) {
-                ASSIMPreader ai(fp.string());
+                eng->loader->load(fp.string());
                 break;
             }
         }
@@ -173,6 +174,7 @@ int main(int argc, char** argv)
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
             eng->processInput();
+            eng->loader->update();
             eng->render->Render();
             eng->ui->render();
 